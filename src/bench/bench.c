@@ -0,0 +1,520 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "types.h"
+#include "voxels.h"
+#include "voxels_io.h"
+#include "voxels_csg.h"
+#include "voxels_compact.h"
+#include "camera.h"
+#include "render_core.h"
+#include "render_threads.h"
+#include "voxrender.h"
+#include "microsec.h"
+#include "city.h"
+
+/* Headless benchmark. Renders a fixed scene along a camera path and writes per-frame timings (CSV) and a summary (JSON) */
+
+#define DEFAULT_FRAMES 100
+#define DEFAULT_WARMUP 2
+#define DEFAULT_OCTREE_DEPTH 9
+#define DEFAULT_FOV radians(65)
+#define DEFAULT_SEED 1234
+
+#define MAX_CONFIGS 16
+#define MAX_KEYS 4096
+
+typedef struct CameraKey
+{
+	float pos[3];
+	float yaw, pitch;
+} CameraKey;
+
+static CameraKey keys[MAX_KEYS];
+static int num_keys = 0;
+
+static const char HELP_TEXT[] = \
+"Usage:\n"
+"    voxbench.bin [options]\n"
+"Options:\n"
+"  -h,--help       Print this text and exit\n"
+"  -res=WxH[,WxH]  Resolutions to test (default 800x600)\n"
+"  -t=N[,N]        Thread counts to test (default 1)\n"
+"  -frames=N       Frames per configuration (default 100)\n"
+"  -warmup=N       Untimed frames before each configuration (default 2)\n"
+"  -d=N            Octree depth of the generated scene (default 9)\n"
+"  -scene=FILE     Load an octree dump (F1 in rays.bin) instead of generating the scene\n"
+"  -path=FILE      Camera path. One key per line: x y z yaw pitch (F12 in rays.bin records one)\n"
+"  -shadows        Enable shadows\n"
+"  -ao             Enable ambient occlusion\n"
+"  -aocache        Reuse the AO of voxel faces between frames\n"
+"  -progressive    Average AO and soft shadows over frames while the camera stays still\n"
+"  -checker        Trace the primary rays of half the pixels per frame in a checkerboard pattern\n"
+"  -pipelined      Copy each frame out while the next one renders\n"
+"  -trav=N         Traversal method (0=recursive, 1=iterative, 2=packet, 3=compact, 4=DAG, 5=grid)\n"
+"  -bricks         Store the lowest compact octree levels as bricks\n"
+"  -dac=N          Ray types traced with the DAC method (1=primary, 2=shadow, 4=AO)\n"
+"  -reproj         Start primary rays from the previous frame's reprojected hits\n"
+"  -beam           Start primary rays at the depth found by an 8x8 beam pre-pass\n"
+"  -csv=FILE       Per-frame results (default bench.csv)\n"
+"  -json=FILE      Summary (default bench.json)\n"
+"  -ppm=FILE       Save the last frame of the last configuration\n"
+"  -trace=FILE     Chrome trace JSON of the render stages of the last configuration\n"
+"  -heatmap=FILE   Traversal cost of the last frame as a PPM (stats=1 builds only)\n";
+
+static int parse_list( const char *s, int *out, int max_count )
+{
+	int n = 0;
+	
+	while( n < max_count && *s )
+	{
+		char *end;
+		out[n++] = strtol( s, &end, 10 );
+		if ( end == s )
+			break;
+		s = *end == ',' ? end + 1 : end;
+	}
+	
+	return n;
+}
+
+static int parse_resolutions( const char *s, int *w, int *h, int max_count )
+{
+	int n = 0;
+	
+	while( n < max_count && sscanf( s, "%dx%d", w+n, h+n ) == 2 )
+	{
+		n++;
+		s = strchr( s, ',' );
+		if ( !s )
+			break;
+		s++;
+	}
+	
+	return n;
+}
+
+static int load_path( const char *filename )
+{
+	FILE *fp = fopen( filename, "r" );
+	char line[256];
+	
+	if ( !fp ) {
+		printf( "Error: failed to open %s\n", filename );
+		return 0;
+	}
+	
+	num_keys = 0;
+	while( num_keys < MAX_KEYS && fgets( line, sizeof(line), fp ) )
+	{
+		CameraKey *k = keys + num_keys;
+		
+		if ( line[0] == '#' )
+			continue;
+		
+		if ( sscanf( line, "%f %f %f %f %f", k->pos, k->pos+1, k->pos+2, &k->yaw, &k->pitch ) == 5 )
+			num_keys++;
+	}
+	
+	fclose( fp );
+	return num_keys > 0;
+}
+
+/* Circles around the volume looking at its center */
+static void default_path( void )
+{
+	const int n = 16;
+	int i;
+	
+	for( i=0; i<=n; i++ )
+	{
+		float a = 2 * M_PI * i / n;
+		CameraKey *k = keys + i;
+		k->pos[0] = 0.5f - 1.2f * sin( a );
+		k->pos[1] = 0.7f;
+		k->pos[2] = 0.5f - 1.2f * cos( a );
+		k->yaw = a;
+		k->pitch = -0.25f;
+	}
+	
+	num_keys = n + 1;
+}
+
+/* Linear interpolation between keys. The whole path is spread over num_frames frames */
+static void get_camera_key( CameraKey *out, int frame, int num_frames )
+{
+	float t = num_frames > 1 ? frame * ( num_keys - 1 ) / (float)( num_frames - 1 ) : 0;
+	int i = t;
+	float f = t - i;
+	const CameraKey *a, *b;
+	int k;
+	
+	if ( i >= num_keys - 1 ) {
+		i = num_keys - 1;
+		f = 0;
+	}
+	
+	a = keys + i;
+	b = keys + ( i + 1 < num_keys ? i + 1 : i );
+	
+	for( k=0; k<3; k++ )
+		out->pos[k] = a->pos[k] + f * ( b->pos[k] - a->pos[k] );
+	out->yaw = a->yaw + f * ( b->yaw - a->yaw );
+	out->pitch = a->pitch + f * ( b->pitch - a->pitch );
+}
+
+static Octree *generate_scene( int depth )
+{
+	Octree *oc = oc_init( depth );
+	const float size = oc->size;
+	aabb3f box;
+	int n;
+	
+	srand( DEFAULT_SEED );
+	oc_clear( oc, 0 );
+	generate_city( oc );
+	
+	/* Same colored axes as rays.bin */
+	for( n=0; n<3; n++ )
+	{
+		box.min[0] = box.min[1] = box.min[2] = 0;
+		box.max[0] = box.max[1] = box.max[2] = size/32;
+		box.max[n] = size/2;
+		csg_box( oc, &box, 2+n );
+	}
+	
+	return oc;
+}
+
+static int compare_u64( const void *a, const void *b ) {
+	uint64 x = *(const uint64*) a, y = *(const uint64*) b;
+	return ( x > y ) - ( x < y );
+}
+
+/* Nearest-rank percentile of sorted values */
+static double percentile_ms( const uint64 *sorted, int n, double p )
+{
+	int i = (int) ceil( p / 100.0 * n ) - 1;
+	if ( i < 0 ) i = 0;
+	if ( i >= n ) i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static void write_ppm( const char *filename, const uint32 *px, int w, int h )
+{
+	FILE *fp = fopen( filename, "wb" );
+	int i;
+	
+	if ( !fp ) {
+		printf( "Error: failed to open %s\n", filename );
+		return;
+	}
+	
+	fprintf( fp, "P6\n%d %d\n255\n", w, h );
+	for( i=0; i<w*h; i++ ) {
+		fputc( px[i] >> 16 & 0xFF, fp );
+		fputc( px[i] >> 8 & 0xFF, fp );
+		fputc( px[i] & 0xFF, fp );
+	}
+	
+	fclose( fp );
+}
+
+int main( int argc, char **argv )
+{
+	static const char *ray_type_names[NUM_RAY_TYPES] = {"primary", "shadow", "ao"};
+	int res_w[MAX_CONFIGS] = {800}, res_h[MAX_CONFIGS] = {600}, num_res = 1;
+	int thread_counts[MAX_CONFIGS] = {1}, num_thread_counts = 1;
+	int num_frames = DEFAULT_FRAMES;
+	int warmup = DEFAULT_WARMUP;
+	int depth = DEFAULT_OCTREE_DEPTH;
+	int shadows = 0, aoccl = 0, trav = TRAVERSE_RECURSIVE, dac = 0, reproj = 0, beam = 0, aocache = 0, progressive = 0, pipelined = 0, checker = 0;
+	const char *scene_file = NULL, *path_file = NULL, *ppm_file = NULL, *trace_file = NULL, *heatmap_file = NULL;
+	const char *csv_file = "bench.csv", *json_file = "bench.json";
+	FILE *csv, *json;
+	uint64 *sorted;
+	Octree *volume;
+	int r, t, f, k;
+	int first_config = 1;
+	
+	for( r=1; r<argc; r++ )
+	{
+		const char *a = argv[r];
+		
+		if ( strncmp( a, "-res=", 5 ) == 0 )
+			num_res = parse_resolutions( a + 5, res_w, res_h, MAX_CONFIGS );
+		else if ( strncmp( a, "-t=", 3 ) == 0 )
+			num_thread_counts = parse_list( a + 3, thread_counts, MAX_CONFIGS );
+		else if ( sscanf( a, "-frames=%d", &num_frames ) == 1 ) {}
+		else if ( sscanf( a, "-warmup=%d", &warmup ) == 1 ) {}
+		else if ( sscanf( a, "-d=%d", &depth ) == 1 ) {}
+		else if ( sscanf( a, "-trav=%d", &trav ) == 1 ) {}
+		else if ( sscanf( a, "-dac=%d", &dac ) == 1 ) {}
+		else if ( strncmp( a, "-scene=", 7 ) == 0 )
+			scene_file = a + 7;
+		else if ( strncmp( a, "-path=", 6 ) == 0 )
+			path_file = a + 6;
+		else if ( strncmp( a, "-csv=", 5 ) == 0 )
+			csv_file = a + 5;
+		else if ( strncmp( a, "-json=", 6 ) == 0 )
+			json_file = a + 6;
+		else if ( strncmp( a, "-ppm=", 5 ) == 0 )
+			ppm_file = a + 5;
+		else if ( strncmp( a, "-trace=", 7 ) == 0 )
+			trace_file = a + 7;
+		else if ( strncmp( a, "-heatmap=", 9 ) == 0 )
+			heatmap_file = a + 9;
+		else if ( !strcmp( a, "-shadows" ) )
+			shadows = 1;
+		else if ( !strcmp( a, "-ao" ) )
+			aoccl = 1;
+		else if ( !strcmp( a, "-bricks" ) )
+			oc_use_bricks = 1;
+		else if ( !strcmp( a, "-reproj" ) )
+			reproj = 1;
+		else if ( !strcmp( a, "-beam" ) )
+			beam = 1;
+		else if ( !strcmp( a, "-aocache" ) )
+			aocache = 1;
+		else if ( !strcmp( a, "-progressive" ) )
+			progressive = 1;
+		else if ( !strcmp( a, "-pipelined" ) )
+			pipelined = 1;
+		else if ( !strcmp( a, "-checker" ) )
+			checker = 1;
+		else
+		{
+			printf( "%s", HELP_TEXT );
+			return strcmp( a, "-h" ) && strcmp( a, "--help" );
+		}
+	}
+	
+	if ( num_res <= 0 || num_thread_counts <= 0 || num_frames <= 0 || trav < 0 || trav >= NUM_TRAVERSAL_METHODS ) {
+		printf( "%s", HELP_TEXT );
+		return 1;
+	}
+	
+	/* The scene doesn't change during the benchmark, so derived data is built only once */
+	oc_verbose = 1;
+	
+	if ( path_file ) {
+		if ( !load_path( path_file ) )
+			return 1;
+	} else {
+		default_path();
+	}
+	
+	if ( scene_file )
+	{
+		FILE *fp = fopen( scene_file, "r" );
+		volume = fp ? oc_read( fp ) : NULL;
+		if ( fp )
+			fclose( fp );
+		if ( !volume ) {
+			printf( "Error: failed to load %s\n", scene_file );
+			return 1;
+		}
+	}
+	else
+		volume = generate_scene( depth );
+	
+	/* Colors don't affect speed. Any fixed palette will do */
+	for( k=1; k<NUM_MATERIALS; k++ ) {
+		uint32 c = k * 2654435761u;
+		voxrender_set_material( k, 64 + ( c >> 8 & 127 ), 64 + ( c >> 16 & 127 ), 64 + ( c >> 24 & 127 ) );
+	}
+	
+	sorted = malloc( sizeof( sorted[0] ) * num_frames );
+	csv = fopen( csv_file, "w" );
+	json = fopen( json_file, "w" );
+	
+	if ( !sorted || !csv || !json ) {
+		printf( "Error: failed to open output files or allocate memory\n" );
+		return 1;
+	}
+	
+	fprintf( csv, "width,height,threads,frame,frame_us" );
+	for( k=0; k<NUM_RAY_TYPES; k++ )
+		fprintf( csv, ",%s_rays,%s_us", ray_type_names[k], ray_type_names[k] );
+	fprintf( csv, "\n" );
+	
+	fprintf( json, "{\n\t\"scene\": \"%s\",\n\t\"octree_depth\": %d,\n\t\"nodes\": %u,\n",
+		scene_file ? scene_file : "city", volume->root_level, volume->num_nodes );
+	fprintf( json, "\t\"camera_keys\": %d,\n\t\"frames\": %d,\n\t\"shadows\": %d,\n\t\"ao\": %d,\n\t\"ao_cache\": %d,\n\t\"progressive\": %d,\n\t\"checkerboard\": %d,\n\t\"pipelined\": %d,\n\t\"traversal\": \"%s\",\n\t\"bricks\": %d,\n\t\"dac\": %d,\n\t\"reprojection\": %d,\n\t\"beam_prepass\": %d,\n",
+		num_keys, num_frames, shadows, aoccl, aocache, progressive, checker, pipelined, TRAVERSAL_METHOD_NAMES[trav], oc_use_bricks, dac, reproj, beam );
+	fprintf( json, "\t\"configs\": [" );
+	
+	for( r=0; r<num_res; r++ )
+	{
+		for( t=0; t<num_thread_counts; t++ )
+		{
+			const int w = res_w[r], h = res_h[r];
+			VoxRender vr;
+			RenderStats total = {{0}};
+			uint64 total_time = 0;
+			uint64 wall_start = 0, wall_time;
+			uint32 *pixels;
+			
+			pixels = malloc( sizeof( pixels[0] ) * w * h );
+			if ( !pixels || !voxrender_init( &vr, w, h, thread_counts[t] ) ) {
+				printf( "Error: failed to set up %dx%d with %d threads\n", w, h, thread_counts[t] );
+				free( pixels );
+				continue;
+			}
+			
+			vr.volume = volume;
+			vr.shadows = shadows;
+			vr.aoccl = aoccl;
+			vr.ao_cache = aocache;
+			vr.progressive = progressive;
+			vr.checkerboard = checker;
+			vr.pipelined = pipelined;
+			vr.traversal_method = trav;
+			vr.dac_method = dac;
+			vr.reprojection = reproj;
+			vr.beam_prepass = beam;
+			vr.light_pos[0] = 0.5f;
+			vr.light_pos[1] = 1000;
+			vr.light_pos[2] = 0.5f;
+			vr.out_rgb = pixels;
+			vr.out_stride = w;
+			set_projection( &vr.camera, DEFAULT_FOV, w / (float) h );
+			
+			/* One more round collects the last pipelined frame */
+			for( f=-warmup; f<=num_frames; f++ )
+			{
+				CameraKey key;
+				int done; /* Frame whose results are in vr.perf and pixels. Negative if none */
+				
+				if ( f == 0 ) {
+					wall_start = get_microsec();
+					if ( trace_file && r == num_res - 1 && t == num_thread_counts - 1 ) {
+						clear_render_trace();
+						enable_profiler = 1;
+					}
+				}
+				
+				if ( f < num_frames )
+				{
+					get_camera_key( &key, f < 0 ? 0 : f, num_frames );
+					memcpy( vr.camera.pos, key.pos, sizeof( key.pos ) );
+					vr.camera.yaw = key.yaw;
+					vr.camera.pitch = key.pitch;
+					update_camera_matrix( &vr.camera );
+					
+					done = voxrender_frame( &vr ) ? f - pipelined : -1;
+				}
+				else
+					done = voxrender_finish( &vr ) ? f - 1 : -1;
+				
+				if ( done < 0 )
+					continue;
+				
+				sorted[done] = vr.perf.frame_time;
+				total_time += vr.perf.frame_time;
+				
+				fprintf( csv, "%d,%d,%d,%d,%u", w, h, thread_counts[t], done, (unsigned) vr.perf.frame_time );
+				for( k=0; k<NUM_RAY_TYPES; k++ ) {
+					total.rays[k] += vr.perf.stats.rays[k];
+					total.trace_time[k] += vr.perf.stats.trace_time[k];
+					add_traversal_totals( total.traversal + k, vr.perf.stats.traversal + k );
+					fprintf( csv, ",%u,%u", (unsigned) vr.perf.stats.rays[k], (unsigned) vr.perf.stats.trace_time[k] );
+				}
+				for( k=0; k<NUM_RENDER_STAGES; k++ )
+					total.stage_time[k] += vr.perf.stats.stage_time[k];
+				total.reprojected += vr.perf.stats.reprojected;
+				total.beam_skipped += vr.perf.stats.beam_skipped;
+				total.ao_pixels += vr.perf.stats.ao_pixels;
+				total.ao_cached += vr.perf.stats.ao_cached;
+				fprintf( csv, "\n" );
+			}
+			
+			wall_time = get_microsec() - wall_start;
+			
+			qsort( sorted, num_frames, sizeof( sorted[0] ), compare_u64 );
+			
+			fprintf( json, "%s\n\t\t{\n", first_config ? "" : "," );
+			fprintf( json, "\t\t\t\"width\": %d, \"height\": %d, \"threads\": %d,\n", w, h, thread_counts[t] );
+			fprintf( json, "\t\t\t\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f,\n",
+				total_time / 1000.0 / num_frames,
+				percentile_ms( sorted, num_frames, 50 ),
+				percentile_ms( sorted, num_frames, 90 ),
+				percentile_ms( sorted, num_frames, 99 ),
+				sorted[0] / 1000.0,
+				sorted[num_frames-1] / 1000.0 );
+			
+			/* Wall time per frame including copying the frames out, which pipelining overlaps with rendering */
+			fprintf( json, "\t\t\t\"wall_ms\": %.3f,\n", wall_time / 1000.0 / num_frames );
+			
+			/* Rays/sec per ray type is measured in thread time: how fast one thread traces that kind of ray */
+			for( k=0; k<NUM_RAY_TYPES; k++ )
+			{
+				fprintf( json, "\t\t\t\"%s\": { \"rays\": %.0f, \"mrays_per_thread_sec\": %.3f",
+					ray_type_names[k],
+					(double) total.rays[k],
+					total.trace_time[k] ? total.rays[k] / (double) total.trace_time[k] : 0.0 );
+				
+				#ifdef TRAVERSAL_STATS
+				if ( total.traversal[k].rays )
+				{
+					const TraversalTotals *tt = total.traversal + k;
+					double n = tt->rays;
+					fprintf( json, ", \"nodes_per_ray\": %.2f, \"aabb_tests_per_ray\": %.2f, \"early_outs_per_ray\": %.2f, \"mean_depth\": %.2f, \"max_depth\": %u",
+						tt->nodes / n, tt->aabb_tests / n, tt->early_outs / n, tt->depth_sum / n, (unsigned) tt->max_depth );
+				}
+				#endif
+				
+				fprintf( json, " },\n" );
+			}
+			
+			/* Mean per frame. Stages are summed over threads, "frame" is wall time */
+			fprintf( json, "\t\t\t\"stage_ms\": {" );
+			for( k=0; k<NUM_RENDER_STAGES; k++ )
+				fprintf( json, "%s \"%s\": %.3f", k ? "," : "", RENDER_STAGE_NAMES[k], total.stage_time[k] / 1000.0 / num_frames );
+			fprintf( json, " },\n" );
+			
+			fprintf( json, "\t\t\t\"reprojected_pct\": %.1f,\n",
+				total.rays[RAY_PRIMARY] ? 100.0 * total.reprojected / total.rays[RAY_PRIMARY] : 0.0 );
+			fprintf( json, "\t\t\t\"beam_skipped_pct\": %.1f,\n",
+				total.rays[RAY_PRIMARY] ? 100.0 * total.beam_skipped / total.rays[RAY_PRIMARY] : 0.0 );
+			fprintf( json, "\t\t\t\"ao_cache_hit_pct\": %.1f,\n",
+				total.ao_pixels ? 100.0 * total.ao_cached / total.ao_pixels : 0.0 );
+			fprintf( json, "\t\t\t\"mrays_per_sec\": %.3f,\n",
+				total_time ? ( total.rays[RAY_PRIMARY] + total.rays[RAY_SHADOW] + total.rays[RAY_AO] ) / (double) total_time : 0.0 );
+			fprintf( json, "\t\t\t\"compact_nodes\": %u\n\t\t}", volume->compact ? (unsigned) volume->compact->num_nodes : 0 );
+			first_config = 0;
+			
+			printf( "%dx%d, %d threads: mean %.2f ms, p50 %.2f ms, p99 %.2f ms, wall %.2f ms\n",
+				w, h, thread_counts[t],
+				total_time / 1000.0 / num_frames,
+				percentile_ms( sorted, num_frames, 50 ),
+				percentile_ms( sorted, num_frames, 99 ),
+				wall_time / 1000.0 / num_frames );
+			
+			if ( ppm_file && r == num_res - 1 && t == num_thread_counts - 1 )
+				write_ppm( ppm_file, pixels, w, h );
+			
+			if ( heatmap_file && r == num_res - 1 && t == num_thread_counts - 1 && !write_heatmap_ppm( heatmap_file ) )
+				printf( "Error: failed to write %s (needs a stats=1 build)\n", heatmap_file );
+			
+			if ( enable_profiler ) {
+				enable_profiler = 0;
+				if ( !write_render_trace( trace_file ) )
+					printf( "Error: failed to write %s\n", trace_file );
+			}
+			
+			voxrender_shutdown( &vr );
+			free( pixels );
+		}
+	}
+	
+	fprintf( json, "\n\t]\n}\n" );
+	fclose( json );
+	fclose( csv );
+	
+	free( sorted );
+	oc_free( volume );
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <math.h>
+#include "render_core.h"
+#include "dynres.h"
+
+#define OVER_BUDGET 1.05f /* Shrink when frames take longer than this times the budget */
+#define UNDER_BUDGET 0.8f /* Grow when frames take less than this. The gap keeps the resolution from flickering */
+#define MAX_SHRINK 0.7f /* Per step, relative to the width */
+#define MAX_GROW 1.15f
+
+void dynres_init( DynRes *d, uint64 budget )
+{
+	d->budget = budget;
+	d->scale = 1;
+	d->ao_samples = NUM_AO_SAMPLES;
+	d->avg_time = 0;
+	d->settle = DYNRES_SETTLE_FRAMES;
+}
+
+int dynres_update( DynRes *d, uint64 frame_time, int use_ao, int screen_w, int screen_h, int *w, int *h )
+{
+	const int old_samples = d->ao_samples;
+	float ratio, step;
+	int new_w, new_h;
+	
+	/* Single slow frames shouldn't drop the resolution */
+	d->avg_time = d->avg_time ? 0.7f * d->avg_time + 0.3f * frame_time : frame_time;
+	
+	if ( d->settle > 0 ) {
+		d->settle--;
+		return 0;
+	}
+	
+	ratio = d->budget / d->avg_time;
+	step = sqrtf( ratio );
+	
+	if ( d->avg_time > d->budget * OVER_BUDGET )
+	{
+		if ( d->scale > DYNRES_MIN_SCALE )
+			d->scale *= step > MAX_SHRINK ? step : MAX_SHRINK;
+		else if ( use_ao && d->ao_samples > DYNRES_MIN_AO_SAMPLES )
+			d->ao_samples = ( d->ao_samples / 2 + 3 ) & ~3;
+	}
+	else if ( d->avg_time < d->budget * UNDER_BUDGET )
+	{
+		if ( d->ao_samples < NUM_AO_SAMPLES )
+			d->ao_samples = d->ao_samples * 2 < NUM_AO_SAMPLES ? d->ao_samples * 2 : NUM_AO_SAMPLES;
+		else if ( d->scale < 1 )
+			d->scale *= step < MAX_GROW ? step : MAX_GROW;
+	}
+	
+	if ( d->scale < DYNRES_MIN_SCALE )
+		d->scale = DYNRES_MIN_SCALE;
+	if ( d->scale > 1 )
+		d->scale = 1;
+	
+	if ( d->ao_samples < DYNRES_MIN_AO_SAMPLES )
+		d->ao_samples = DYNRES_MIN_AO_SAMPLES;
+	
+	new_w = (int)( screen_w * d->scale ) & ~0xF;
+	if ( new_w < 16 )
+		new_w = 16;
+	
+	/* Full scale renders exactly the screen */
+	new_h = d->scale < 1 ? (int)( new_w * screen_h / (float) screen_w + 0.5f ) : screen_h;
+	if ( new_h < 2 )
+		new_h = 2;
+	
+	if ( new_w == *w && new_h == *h && d->ao_samples == old_samples )
+		return 0;
+	
+	*w = new_w;
+	*h = new_h;
+	d->avg_time = 0;
+	d->settle = DYNRES_SETTLE_FRAMES;
+	return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef _DYNRES_H
+#define _DYNRES_H
+#include "types.h"
+
+/* Dynamic resolution. Picks the render resolution and AO sample count of the next frame
+so that frames take about as long as the budget. Render time is assumed to follow the pixel count.
+The resolution goes down first and the AO samples after that. They come back in the opposite order */
+#define DYNRES_MIN_SCALE 0.25f /* Smallest render width relative to the screen */
+#define DYNRES_MIN_AO_SAMPLES 8
+#define DYNRES_SETTLE_FRAMES 4 /* Frames measured after each change before the next one */
+
+typedef struct DynRes
+{
+	uint64 budget; /* Target frame time (microseconds) */
+	float scale; /* Render width / screen width */
+	int ao_samples; /* For ao_sample_count */
+	float avg_time; /* Smoothed frame time since the last change. 0 if nothing measured yet */
+	int settle; /* Frames to go before the next change */
+} DynRes;
+
+void dynres_init( DynRes *d, uint64 budget );
+
+/* Feeds the time of the last frame and computes the render resolution for a screen_w x screen_h screen.
+The width is a multiple of 16 and the aspect ratio stays close to the screen's. AO samples only drop if use_ao is set.
+Returns 1 if *w, *h or d->ao_samples changed */
+int dynres_update( DynRes *d, uint64 frame_time, int use_ao, int screen_w, int screen_h, int *w, int *h );
+
+#endif
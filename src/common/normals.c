@@ -21,20 +21,42 @@ void unpack_normal( PNor k, float xp[1], float yp[1], float zp[1] )
 	*zp = z;
 }
 
+/* Spiral points whose z is this many steps away can't be the nearest one. The spacing of the points is about sqrt(4*pi/N) */
+#define SEARCH_WINDOW 32
+
+static float table[N][3];
+static int table_ready = 0;
+
 PNor pack_normal( float x, float y, float z )
 {
-	const float
-		a = N / 2.0,
-		b = 2.0 / ( N * M_PI ),
-		c = 0.5 + N/2.0 + 1.0/N;
+	/* Inverse of z in unpack_normal */
+	const int k0 = ( z - ( 1.0 / N - 1.0 ) ) * ( N / 2.0 );
+	float max_dot = -2.0f;
+	int k, best = 0;
 	
-	return z*a + atan2( y, x )*b + c;
+	if ( !table_ready )
+	{
+		for( k=0; k<N; k++ )
+			unpack_normal( k, table[k], table[k]+1, table[k]+2 );
+		table_ready = 1;
+	}
+	
+	/* The nearest spiral point is close in z but can be anywhere around the spiral */
+	for( k=k0-SEARCH_WINDOW; k<=k0+SEARCH_WINDOW; k++ )
+	{
+		float dot;
+		
+		if ( k < 0 || k >= N )
+			continue;
+		
+		dot = x * table[k][0] + y * table[k][1] + z * table[k][2];
+		if ( dot > max_dot ) {
+			max_dot = dot;
+			best = k;
+		}
+	}
 	
-	/*
-	float k0 = ( z - a ) / b;
-	float k = k0 + atan2( y, x ) / M_PI * b - ( 1.0 / N );
-	return k;
-	*/
+	return best;
 }
 
 #if 0
@@ -0,0 +1,122 @@
+#include <math.h>
+#include "voxels.h"
+#include "render_core.h"
+
+/* Beam pre-pass for primary rays. A beam is described by the common origin of its rays and the range of their inverse directions.
+Nodes are tested with interval arithmetic (like subset_may_hit in oc_traverse2.c), so the result is a lower bound for every ray in the beam */
+
+#define fmin(x,y) ((x)<(y)?(x):(y))
+#define fmax(x,y) ((x)>(y)?(x):(y))
+
+int enable_beam_prepass = 0;
+
+typedef struct Beam
+{
+	float o[3];
+	float i_min[3], i_max[3];
+	float spread; /* width of the beam at distance 1 */
+	unsigned rec_mask; /* child order. Only affects speed */
+	float best;
+} Beam;
+
+/* Returns the range of t where some ray of the beam may be inside the box. enter > leave if none can */
+static void beam_interval( const Beam *b, const float lo[3], const float hi[3], float *enter_p, float *leave_p )
+{
+	float enter = -INFINITY, leave = INFINITY;
+	int k;
+	
+	for( k=0; k<3; k++ )
+	{
+		float t0 = ( lo[k] - b->o[k] ) * b->i_min[k];
+		float t1 = ( lo[k] - b->o[k] ) * b->i_max[k];
+		float t2 = ( hi[k] - b->o[k] ) * b->i_min[k];
+		float t3 = ( hi[k] - b->o[k] ) * b->i_max[k];
+		float a = fmin( fmin( t0, t1 ), fmin( t2, t3 ) );
+		float c = fmax( fmax( t0, t1 ), fmax( t2, t3 ) );
+		
+		/* Mixed direction signs give a range around zero, which is still conservative */
+		enter = fmax( enter, a );
+		leave = fmin( leave, c );
+	}
+	
+	*enter_p = enter;
+	*leave_p = leave;
+}
+
+static void beam_traverse( Beam *b, const OctreeNode *node, int level, const float lo[3], const float hi[3] )
+{
+	float enter, leave;
+	int n, k;
+	
+	beam_interval( b, lo, hi, &enter, &leave );
+	
+	if ( enter > leave || leave < 0.0f || enter >= b->best )
+		return;
+	
+	if ( enter < 0.0f )
+		enter = 0.0f;
+	
+	if ( !node->children || level <= 0 )
+	{
+		/* Same leaf rule as traversal_func in oc_traverse.c */
+		if ( node->mat )
+			b->best = enter;
+		return;
+	}
+	
+	/* Past this size the beam covers the whole node anyway. Going deeper would only multiply the work */
+	if ( hi[0] - lo[0] < enter * b->spread ) {
+		b->best = enter;
+		return;
+	}
+	
+	level--;
+	
+	for( n=0; n<8; n++ )
+	{
+		int c = n ^ b->rec_mask;
+		const OctreeNode *child = node->children + c;
+		float clo[3], chi[3];
+		
+		if ( !child->children && !child->mat )
+			continue; /* air */
+		
+		for( k=0; k<3; k++ ) {
+			float split = ( lo[k] + hi[k] ) * 0.5f;
+			if ( c & ( 4 >> k ) ) {
+				clo[k] = split;
+				chi[k] = hi[k];
+			} else {
+				clo[k] = lo[k];
+				chi[k] = split;
+			}
+		}
+		
+		beam_traverse( b, child, level, clo, chi );
+	}
+}
+
+float oc_beam_min_depth( const Octree *oc, const float o[3], const float i_min[3], const float i_max[3], float spread )
+{
+	float lo[3] = {0, 0, 0}, hi[3];
+	Beam b;
+	int k;
+	
+	b.rec_mask = 0;
+	b.spread = spread;
+	b.best = INFINITY;
+	
+	for( k=0; k<3; k++ ) {
+		b.o[k] = o[k];
+		b.i_min[k] = i_min[k];
+		b.i_max[k] = i_max[k];
+		hi[k] = oc->size;
+		
+		/* Mostly negative directions: visit children in reverse order */
+		if ( i_min[k] + i_max[k] < 0 )
+			b.rec_mask |= 4 >> k;
+	}
+	
+	beam_traverse( &b, &oc->root, oc->root_level - oc_detail_level, lo, hi );
+	return b.best;
+}
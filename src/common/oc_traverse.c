@@ -1,19 +1,26 @@
 #include <stdlib.h>
+#include <math.h>
 #include <xmmintrin.h>
 #include "voxels.h"
 #include "types.h"
 #include "render_core.h"
+#include "traversal_stats.h"
+#include "voxels_distance.h"
 
 #define ALLOW_DEBUG_VISUALS 1
 int oc_show_travel_depth = 0;
 int oc_detail_level = 0;
 
+#ifdef TRAVERSAL_STATS
+__thread TraversalStats *oc_ray_stats = NULL;
+#endif
+
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #define MAX(a,b) ((a)>(b)?(a):(b))
 
 static const float missed = -1.0f;
 
-static float traversal_func( const OctreeNode *parent, uint8 *out_m, float *out_z, int level, unsigned rec_mask,
+static float traversal_func( const OctreeNode *parent, uint8 *out_m, uint8 *out_face, int level, unsigned rec_mask,
 float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, float max_ray_depth )
 {
 	float near, far;
@@ -22,6 +29,8 @@ float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, fl
 	near = MAX( MAX( tminx, tminy ), tminz );
 	far = MIN( MIN( tmaxx, tmaxy ), tmaxz );
 	
+	STATS_TEST( oc_ray_stats, near > far || far < 0.0f || near > max_ray_depth );
+	
 	if ( near > far )
 		return missed;
 	
@@ -31,6 +40,8 @@ float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, fl
 	if ( near > max_ray_depth )
 		return missed;
 	
+	STATS_NODE( oc_ray_stats, level );
+	
 	if ( parent->children && level > 0 )
 	{
 		float tsplitx, tsplity, tsplitz;
@@ -60,7 +71,7 @@ float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, fl
 			get_child_interval( 1, tsplity, tminy, tmaxy );
 			get_child_interval( 2, tsplitz, tminz, tmaxz );
 			
-			hit_depth = traversal_func( parent->children+k, out_m, out_z, level, rec_mask, a[0], a[1], a[2], b[0], b[1], b[2], max_ray_depth );
+			hit_depth = traversal_func( parent->children+k, out_m, out_face, level, rec_mask, a[0], a[1], a[2], b[0], b[1], b[2], max_ray_depth );
 			
 			if ( hit_depth != missed )
 				return hit_depth;
@@ -69,13 +80,15 @@ float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, fl
 	else if ( parent->mat )
 	{
 		*out_m = ( ALLOW_DEBUG_VISUALS && oc_show_travel_depth ) ? ( level + 2 & MATERIAL_BITMASK ) : parent->mat;
+		if ( out_face )
+			*out_face = ENTRY_FACE( tminx, tminy, tminz, rec_mask );
 		return near;
 	}
 	
 	return missed;
 }
 
-float oc_traverse( const Octree *oc, uint8 *out_m, float ray_ox, float ray_oy, float ray_oz, float ray_dx, float ray_dy, float ray_dz, float max_ray_depth )
+float oc_traverse( const Octree *oc, uint8 *out_m, uint8 *out_face, float ray_ox, float ray_oy, float ray_oz, float ray_dx, float ray_dy, float ray_dz, float max_ray_depth )
 {
 	int initial_level = oc->root_level - oc_detail_level;
 	float size = oc->size;
@@ -105,6 +118,319 @@ float oc_traverse( const Octree *oc, uint8 *out_m, float ray_ox, float ray_oy, f
 	compute_interval( 2, ray_oz, ray_dz );
 	
 	*out_m = 0;
-	out_z = traversal_func( &oc->root, out_m, &out_z, initial_level, mask, tmin[0], tmin[1], tmin[2], tmax[0], tmax[1], tmax[2], max_ray_depth );
+	STATS_BEGIN( initial_level );
+	out_z = traversal_func( &oc->root, out_m, out_face, initial_level, mask, tmin[0], tmin[1], tmin[2], tmax[0], tmax[1], tmax[2], max_ray_depth );
 	return out_z == missed ? max_ray_depth : out_z;
 }
+
+/* Iterative version of the above. Parametric traversal (Revelles et al. 2000) with an explicit stack.
+Only the children that the ray actually crosses are visited.
+Coordinates are mirrored with the direction mask so that t0 < t1 on every axis */
+typedef struct TraversalFrame
+{
+	const OctreeNode *node;
+	float t0[3], t1[3], tm[3];
+	int level;
+	unsigned next; /* Next child to visit (mirrored index). 8 when done, 9 when the node has not been entered yet */
+} TraversalFrame;
+
+#define MAX_TRAVERSAL_DEPTH 32
+
+static unsigned first_child( const float t0[3], const float tm[3] )
+{
+	unsigned c = 0;
+	
+	if ( t0[0] >= t0[1] && t0[0] >= t0[2] ) {
+		/* Entered through a YZ plane */
+		c |= ( tm[1] < t0[0] ) << 1;
+		c |= ( tm[2] < t0[0] );
+	} else if ( t0[1] >= t0[2] ) {
+		/* XZ plane */
+		c |= ( tm[0] < t0[1] ) << 2;
+		c |= ( tm[2] < t0[1] );
+	} else {
+		/* XY plane */
+		c |= ( tm[0] < t0[2] ) << 2;
+		c |= ( tm[1] < t0[2] ) << 1;
+	}
+	
+	return c;
+}
+
+float oc_traverse_iter( const Octree *oc, uint8 *out_m, uint8 *out_face, float ray_ox, float ray_oy, float ray_oz, float ray_dx, float ray_dy, float ray_dz, float max_ray_depth )
+{
+	TraversalFrame stack[MAX_TRAVERSAL_DEPTH];
+	TraversalFrame *f = stack;
+	float size = oc->size;
+	unsigned mask = 0;
+	float t0, t1, invd;
+	
+	#define init_interval(n,x,d) do { \
+		mask |= ( 4 >> n ) * ( d < 0 ); \
+		invd = 1.0f / d; \
+		t0 = -x * invd; \
+		t1 = ( size - x ) * invd; \
+		f->t0[n] = MIN( t0, t1 ); \
+		f->t1[n] = MAX( t0, t1 ); \
+	} while(0)
+	
+	/* Same as in oc_traverse_grid: with a zero direction the interval would be infinite and
+	the split points in tm would become NaN */
+	if ( ray_dx == 0 ) ray_dx = 1e-20f;
+	if ( ray_dy == 0 ) ray_dy = 1e-20f;
+	if ( ray_dz == 0 ) ray_dz = 1e-20f;
+	
+	init_interval( 0, ray_ox, ray_dx );
+	init_interval( 1, ray_oy, ray_dy );
+	init_interval( 2, ray_oz, ray_dz );
+	
+	f->node = &oc->root;
+	f->level = oc->root_level - oc_detail_level;
+	f->next = 9;
+	*out_m = 0;
+	STATS_BEGIN( f->level );
+	
+	while( f >= stack )
+	{
+		TraversalFrame *c;
+		unsigned n, k;
+		
+		if ( f->next == 9 )
+		{
+			/* Entering a new node */
+			float near = MAX( MAX( f->t0[0], f->t0[1] ), f->t0[2] );
+			float far = MIN( MIN( f->t1[0], f->t1[1] ), f->t1[2] );
+			
+			STATS_TEST( oc_ray_stats, near > far || far < 0.0f || near > max_ray_depth );
+			
+			if ( near > far || far < 0.0f || near > max_ray_depth ) {
+				f--;
+				continue;
+			}
+			
+			STATS_NODE( oc_ray_stats, f->level );
+			
+			if ( !f->node->children || f->level <= 0 )
+			{
+				if ( f->node->mat ) {
+					*out_m = ( ALLOW_DEBUG_VISUALS && oc_show_travel_depth ) ? ( f->level + 2 & MATERIAL_BITMASK ) : f->node->mat;
+					if ( out_face )
+						*out_face = ENTRY_FACE( f->t0[0], f->t0[1], f->t0[2], mask );
+					return near;
+				}
+				f--;
+				continue;
+			}
+			
+			for( k=0; k<3; k++ )
+				f->tm[k] = ( f->t0[k] + f->t1[k] ) * 0.5f;
+			
+			f->next = first_child( f->t0, f->tm );
+		}
+		
+		if ( f->next == 8 ) {
+			/* All crossed children visited */
+			f--;
+			continue;
+		}
+		
+		n = f->next;
+		c = f + 1;
+		
+		for( k=0; k<3; k++ )
+		{
+			if ( n & ( 4 >> k ) ) {
+				c->t0[k] = f->tm[k];
+				c->t1[k] = f->t1[k];
+			} else {
+				c->t0[k] = f->t0[k];
+				c->t1[k] = f->tm[k];
+			}
+		}
+		
+		/* The ray leaves this child through the plane with the smallest t1. Crossing it either leads to a sibling or out of the parent */
+		k = c->t1[0] < c->t1[1] ? ( c->t1[0] < c->t1[2] ? 0 : 2 ) : ( c->t1[1] < c->t1[2] ? 1 : 2 );
+		f->next = ( n & ( 4 >> k ) ) ? 8 : ( n | ( 4 >> k ) );
+		
+		c->node = f->node->children + ( n ^ mask );
+		c->level = f->level - 1;
+		c->next = 9;
+		f = c;
+	}
+	
+	return max_ray_depth;
+}
+
+/* Marches through the distance grid (see voxels_distance.h), leaping over the empty cube around each cell.
+The cells are stepped through with integers like a 3D-DDA. A leap of dist cells moves the exit axis by dist
+and the other axes by the number of faces crossed before the exit, which stays inside the empty cube.
+Non-empty cells are traversed with traversal_func starting from the cell's own node. The nodes on the way
+down are kept, so the next non-empty cell only descends from the lowest node it shares with the previous one.
+The ray goes on with the next cell if it misses everything in the cell */
+float oc_traverse_grid( const Octree *oc, uint8 *out_m, uint8 *out_face, float ray_ox, float ray_oy, float ray_oz, float ray_dx, float ray_dy, float ray_dz, float max_ray_depth )
+{
+	const DistanceGrid *g = oc->dist;
+	const OctreeNode *path[MAX_TRAVERSAL_DEPTH];
+	int path_level, prev[3] = {0};
+	float o[3], d[3], invd[3], tnext[3], tdelta[3], faces_per_t[3];
+	float cell, inv_cell, t = 0, t_exit = INFINITY;
+	unsigned mask = 0;
+	int c[3], step[3], k;
+	
+	/* LOD leaves larger than a cell could be hit in cells that are empty at full detail */
+	if ( !g || oc_detail_level > g->cell_level )
+		return oc_traverse( oc, out_m, out_face, ray_ox, ray_oy, ray_oz, ray_dx, ray_dy, ray_dz, max_ray_depth );
+	
+	cell = 1 << g->cell_level;
+	inv_cell = 1.0f / cell;
+	o[0] = ray_ox; o[1] = ray_oy; o[2] = ray_oz;
+	d[0] = ray_dx; d[1] = ray_dy; d[2] = ray_dz;
+	
+	*out_m = 0;
+	STATS_BEGIN( oc->root_level - oc_detail_level );
+	
+	/* Clip to the volume */
+	for( k=0; k<3; k++ )
+	{
+		float t0, t1;
+		
+		/* A tiny direction instead of 0 keeps the intervals finite. Child intervals in traversal_func would become NaN */
+		if ( d[k] == 0 )
+			d[k] = 1e-20f;
+		
+		mask |= ( 4 >> k ) * ( d[k] < 0 );
+		invd[k] = 1.0f / d[k];
+		t0 = -o[k] * invd[k];
+		t1 = ( oc->size - o[k] ) * invd[k];
+		t = MAX( t, MIN( t0, t1 ) );
+		t_exit = MIN( t_exit, MAX( t0, t1 ) );
+	}
+	
+	if ( !( t <= t_exit ) )
+		return max_ray_depth;
+	
+	/* The first cell. Rounding at the faces of the volume is clamped */
+	for( k=0; k<3; k++ )
+	{
+		float p = ( o[k] + d[k] * t ) * inv_cell;
+		
+		c[k] = d[k] < 0 ? (int) ceilf( p ) - 1 : (int) p;
+		c[k] = MAX( 0, MIN( c[k], g->res - 1 ) );
+		
+		/* The position can round into the next cell when d[k] is tiny. Trust the face distances instead */
+		if ( d[k] > 0 ) {
+			if ( c[k] > 0 && ( c[k] * cell - o[k] ) * invd[k] > t )
+				c[k]--;
+			else if ( c[k] < g->res - 1 && ( ( c[k] + 1 ) * cell - o[k] ) * invd[k] <= t )
+				c[k]++;
+		} else {
+			if ( c[k] < g->res - 1 && ( ( c[k] + 1 ) * cell - o[k] ) * invd[k] > t )
+				c[k]++;
+			else if ( c[k] > 0 && ( c[k] * cell - o[k] ) * invd[k] <= t )
+				c[k]--;
+		}
+		
+		tnext[k] = ( ( c[k] + ( d[k] > 0 ) ) * cell - o[k] ) * invd[k];
+		tdelta[k] = cell * fabsf( invd[k] );
+		faces_per_t[k] = fabsf( d[k] ) * inv_cell;
+		step[k] = d[k] > 0 ? 1 : -1;
+	}
+	
+	path[oc->root_level] = &oc->root;
+	path_level = oc->root_level;
+	
+	/* Written so that NAN max_ray_depth never stops the ray */
+	while( !( t > max_ray_depth ) )
+	{
+		float t_leap;
+		int dist = g->dist[ ( c[0] * g->res + c[1] ) * g->res + c[2] ];
+		int e;
+		
+		STATS_TEST( oc_ray_stats, dist > 0 );
+		
+		if ( !dist )
+		{
+			const OctreeNode *node;
+			float hit_depth;
+			int level = g->cell_level, diff;
+			
+			/* The nodes above the level where the cell coordinates first differ are shared with the previous cell */
+			diff = ( c[0] ^ prev[0] ) | ( c[1] ^ prev[1] ) | ( c[2] ^ prev[2] );
+			while( diff ) {
+				level++;
+				diff >>= 1;
+			}
+			
+			/* Down to the node of the cell or a larger leaf that contains it */
+			level = MAX( level, path_level );
+			node = path[level];
+			while( node->children && level > g->cell_level ) {
+				int s = --level - g->cell_level;
+				node = node->children + ( ( c[0] >> s & 1 ) << 2 | ( c[1] >> s & 1 ) << 1 | ( c[2] >> s & 1 ) );
+				path[level] = node;
+			}
+			
+			path_level = level;
+			prev[0] = c[0]; prev[1] = c[1]; prev[2] = c[2];
+			
+			/* The ray enters the cell's slabs one cell width before it leaves them */
+			hit_depth = traversal_func( node, out_m, out_face, level - oc_detail_level, mask,
+				tnext[0] - tdelta[0], tnext[1] - tdelta[1], tnext[2] - tdelta[2], tnext[0], tnext[1], tnext[2], max_ray_depth );
+			
+			if ( hit_depth != missed )
+				return hit_depth;
+			
+			/* Missed everything in the cell. Go on with the next one */
+			dist = 1;
+		}
+		
+		e = tnext[0] < tnext[1] ? ( tnext[0] < tnext[2] ? 0 : 2 ) : ( tnext[1] < tnext[2] ? 1 : 2 );
+		
+		if ( dist == 1 )
+		{
+			/* Plain DDA step through the closest face */
+			t = tnext[e];
+			c[e] += step[e];
+			if ( c[e] < 0 || c[e] >= g->res )
+				break;
+			tnext[e] += tdelta[e];
+			continue;
+		}
+		
+		/* Cells closer than dist are all empty. The ray leaves that cube dist-1 cells after the closest face */
+		t_leap = tnext[e] + ( dist - 1 ) * tdelta[e];
+		
+		for( k=0; k<3; k++ )
+		{
+			float other = tnext[k] + ( dist - 1 ) * tdelta[k];
+			if ( other < t_leap ) {
+				t_leap = other;
+				e = k;
+			}
+		}
+		
+		for( k=0; k<3; k++ )
+		{
+			int n = dist;
+			
+			if ( k != e )
+			{
+				/* Faces crossed before t_leap. Fewer than dist, so the ray is still in the empty cube.
+				A face missed by rounding only makes the next step short */
+				n = t_leap < tnext[k] ? 0 : (int)( ( t_leap - tnext[k] ) * faces_per_t[k] ) + 1;
+				n = MIN( n, dist - 1 );
+				if ( !n )
+					continue;
+			}
+			
+			c[k] += n * step[k];
+			if ( c[k] < 0 || c[k] >= g->res )
+				return max_ray_depth;
+			tnext[k] = ( ( c[k] + ( d[k] > 0 ) ) * cell - o[k] ) * invd[k];
+		}
+		
+		t = t_leap;
+	}
+	
+	return max_ray_depth;
+}
@@ -1,75 +1,217 @@
 #include <stdlib.h>
 #include <xmmintrin.h>
 #include <string.h>
+#include <math.h>
+#include <stdio.h>
 #include "voxels.h"
 #include "render_core.h"
+#include "traversal_stats.h"
 
 #define OCTREE_DEPTH_HARDLIMIT 15
 #define ALLOW_DEBUG_VISUALS 1
 
+/* Subsets with fewer rays than this inherit the ray bounds of their parent instead of computing new ones */
+#define MIN_RAYS_FOR_BOUNDS 64
+
 extern int oc_show_travel_depth;
 extern int oc_detail_level;
 
 #define fmin(x,y) ((x)<(y)?(x):(y))
 #define fmax(x,y) ((x)>(y)?(x):(y))
 
-static size_t intersect_with_aabb( uint32 *ray_ids, size_t num_rays,
-	float const *ray_o[3], float const *ray_d[3],
-	float const aabb_min[3], float const aabb_max[3], float out_depth[] )
+/* Conservative bounds of a set of rays: a box of origins and a box of inverse directions.
+All rays of a set have the same direction signs so this acts like a (loose) frustum */
+typedef struct RayBounds
+{
+	float o_min[3], o_max[3];
+	float i_min[3], i_max[3];
+} RayBounds;
+
+/* Everything that stays the same during the recursion */
+typedef struct DacContext
+{
+	float const *o[3];
+	float const *inv_d[3];
+	uint8 *out_mat; /* Nonzero material also means that the ray has terminated */
+	float *out_depth;
+	uint8 *out_face; /* NULL if not needed */
+	float max_depth;
+	size_t stride; /* Distance between id lists of consecutive recursion levels */
+	size_t num_terminated;
+	int iter;
+	TraversalStats *stats; /* NULL or one per ray. Only used with TRAVERSAL_STATS */
+} DacContext;
+
+void free_dac_scratch( DacScratch *s )
+{
+	free( s->ids );
+	free( s->inv_d );
+	free( s->aux_mat );
+	free( s->aux_z );
+	memset( s, 0, sizeof(*s) );
+}
+
+/* Grows the buffers if needed. Returns 0 if out of memory */
+int reserve_dac_scratch( DacScratch *s, size_t ray_count )
+{
+	if ( ray_count <= s->capacity )
+		return 1;
+	
+	free_dac_scratch( s );
+	
+	/* Round up to a multiple of 16 to keep SSE loads aligned */
+	ray_count = ( ray_count + 15 ) & ~15;
+	
+	s->ids = malloc( sizeof( s->ids[0] ) * ray_count * ( OCTREE_DEPTH_HARDLIMIT + 2 ) );
+	s->inv_d = aligned_alloc( 16, sizeof( s->inv_d[0] ) * ray_count * 3 );
+	s->aux_mat = aligned_alloc( 16, ray_count );
+	s->aux_z = aligned_alloc( 16, sizeof( s->aux_z[0] ) * ray_count );
+	
+	if ( !s->ids || !s->inv_d || !s->aux_mat || !s->aux_z ) {
+		free_dac_scratch( s );
+		return 0;
+	}
+	
+	s->capacity = ray_count;
+	return 1;
+}
+
+/* Interval arithmetic: returns 0 if none of the rays within the bounds can hit the box */
+static int subset_may_hit( const DacContext *ctx, const RayBounds *b, float const aabb_min[3], float const aabb_max[3] )
+{
+	float enter = -INFINITY, leave = INFINITY;
+	int k;
+	
+	for( k=0; k<3; k++ )
+	{
+		float lo, hi, p[4];
+		float enter_k, leave_k;
+		
+		/* Entry plane is the min plane for positive directions */
+		lo = ( ctx->iter & ( 4 >> k ) ) ? aabb_max[k] : aabb_min[k];
+		hi = ( ctx->iter & ( 4 >> k ) ) ? aabb_min[k] : aabb_max[k];
+		
+		p[0] = ( lo - b->o_max[k] ) * b->i_min[k];
+		p[1] = ( lo - b->o_max[k] ) * b->i_max[k];
+		p[2] = ( lo - b->o_min[k] ) * b->i_min[k];
+		p[3] = ( lo - b->o_min[k] ) * b->i_max[k];
+		enter_k = fmin( fmin( p[0], p[1] ), fmin( p[2], p[3] ) );
+		
+		p[0] = ( hi - b->o_max[k] ) * b->i_min[k];
+		p[1] = ( hi - b->o_max[k] ) * b->i_max[k];
+		p[2] = ( hi - b->o_min[k] ) * b->i_min[k];
+		p[3] = ( hi - b->o_min[k] ) * b->i_max[k];
+		leave_k = fmax( fmax( p[0], p[1] ), fmax( p[2], p[3] ) );
+		
+		enter = fmax( enter, enter_k );
+		leave = fmin( leave, leave_k );
+	}
+	
+	/* Written so that NaNs (0*inf) never reject anything */
+	if ( enter > leave || leave < 0.0f || enter > ctx->max_depth )
+		return 0;
+	
+	return 1;
+}
+
+static void compute_bounds( const DacContext *ctx, uint32 const *ids, size_t num_rays, RayBounds *b )
 {
 	size_t r;
+	int k;
+	
+	for( k=0; k<3; k++ ) {
+		b->o_min[k] = b->i_min[k] = INFINITY;
+		b->o_max[k] = b->i_max[k] = -INFINITY;
+	}
+	
 	for( r=0; r<num_rays; r++ )
 	{
-		int k;
-		uint32 id = ray_ids[r];
-		float tmaxs[3], tmins[3];
-		float tmax, tmin;
-		uint32 *last;
+		uint32 id = ids[r];
+		for( k=0; k<3; k++ )
+		{
+			float o = ctx->o[k][id], i = ctx->inv_d[k][id];
+			b->o_min[k] = fmin( b->o_min[k], o );
+			b->o_max[k] = fmax( b->o_max[k], o );
+			b->i_min[k] = fmin( b->i_min[k], i );
+			b->i_max[k] = fmax( b->i_max[k], i );
+		}
+	}
+}
+
+/* Copies the ids of the rays that hit the box (and haven't terminated yet) to out_ids. Tests 4 rays at a time */
+static size_t intersect_with_aabb( const DacContext *ctx, uint32 const *ids, size_t num_rays,
+	float const aabb_min[3], float const aabb_max[3], uint32 *out_ids )
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max_depth = _mm_set1_ps( ctx->max_depth );
+	__m128 bmin[3], bmax[3];
+	size_t r, num_out = 0;
+	int k;
+	
+	for( k=0; k<3; k++ ) {
+		bmin[k] = _mm_set1_ps( aabb_min[k] );
+		bmax[k] = _mm_set1_ps( aabb_max[k] );
+	}
+	
+	for( r=0; r<num_rays; r+=4 )
+	{
+		uint32 id[4];
+		__m128 tmin, tmax, hit;
+		float depth[4];
+		int u, bits;
 		
-		if ( id + 1 )
+		/* Pad the last group with copies of the last ray */
+		for( u=0; u<4; u++ )
+			id[u] = ids[ r + u < num_rays ? r + u : num_rays - 1 ];
+		
+		tmin = _mm_set1_ps( -INFINITY );
+		tmax = _mm_set1_ps( INFINITY );
+		
+		for( k=0; k<3; k++ )
 		{
-			for( k=0; k<3; k++ )
-			{
-				float o, d;
-				float t0, t1;
-				
-				d = 1.0f / ray_d[k][id];
-				o = ray_o[k][id];
-				
-				/* d = 1.0f / d; */
-				t0 = ( aabb_min[k] - o ) * d;
-				t1 = ( aabb_max[k] - o ) * d;
-				
-				tmin = fmin( t0, t1 );
-				tmax = fmax( t0, t1 );
-				
-				tmins[k] = tmin;
-				tmaxs[k] = tmax;
-			}
+			const float *o = ctx->o[k], *i = ctx->inv_d[k];
+			__m128 ov, iv, t0, t1;
 			
-			tmin = fmax( tmins[0], fmax( tmins[1], tmins[2] ) );
-			tmax = fmin( tmaxs[0], fmin( tmaxs[1], tmaxs[2] ) );
-			
-			out_depth[id] = tmin;
-			
-			if ( tmax > 0.0f && tmin < tmax ) {
-				/* The ray did not miss the box. Do not reject! */
-				continue;
+			ov = _mm_set_ps( o[id[3]], o[id[2]], o[id[1]], o[id[0]] );
+			iv = _mm_set_ps( i[id[3]], i[id[2]], i[id[1]], i[id[0]] );
+			t0 = _mm_mul_ps( _mm_sub_ps( bmin[k], ov ), iv );
+			t1 = _mm_mul_ps( _mm_sub_ps( bmax[k], ov ), iv );
+			tmin = _mm_max_ps( tmin, _mm_min_ps( t0, t1 ) );
+			tmax = _mm_min_ps( tmax, _mm_max_ps( t0, t1 ) );
+		}
+		
+		hit = _mm_and_ps( _mm_cmpgt_ps( tmax, zero ), _mm_cmplt_ps( tmin, tmax ) );
+		hit = _mm_and_ps( hit, _mm_cmpngt_ps( tmin, max_depth ) );
+		bits = _mm_movemask_ps( hit );
+		
+		#ifdef TRAVERSAL_STATS
+		if ( ctx->stats ) {
+			for( u=0; u<4 && r+u<num_rays; u++ ) {
+				if ( !ctx->out_mat[id[u]] )
+					STATS_TEST( ctx->stats + id[u], !( bits >> u & 1 ) );
 			}
 		}
+		#endif
+		
+		if ( !bits )
+			continue;
 		
-		/* The ray was terminated before or it missed the box, so reject it */
-		last = --num_rays + ray_ids;
-		ray_ids[r--] = *last;
-		*last = id;
+		_mm_storeu_ps( depth, tmin );
+		
+		for( u=0; u<4 && r+u<num_rays; u++ )
+		{
+			if ( bits >> u & 1 && !ctx->out_mat[id[u]] ) {
+				ctx->out_depth[id[u]] = depth[u];
+				out_ids[num_out++] = id[u];
+			}
+		}
 	}
-	return num_rays;
+	
+	return num_out;
 }
 
-static void process_leaf( const OctreeNode *node,
-	int octree_level,
-	uint32 *id_array, size_t num_rays,
-	uint8 out_mat[] )
+static void process_leaf( DacContext *ctx, const OctreeNode *node, int octree_level, uint32 const *ids, size_t num_rays,
+	float const aabb_min[3], float const aabb_max[3] )
 {
 	uint8 mat = node->mat;
 	size_t r;
@@ -85,37 +227,80 @@ static void process_leaf( const OctreeNode *node,
 	}
 	#endif
 	
+	/* Terminates the rays. Depth was written by intersect_with_aabb */
 	for( r=0; r<num_rays; r++ )
+		ctx->out_mat[ids[r]] = mat;
+	
+	if ( ctx->out_face )
 	{
-		size_t id = id_array[r];
-		out_mat[id] = mat;
-		id_array[r] = -1; /* kill this ray */
+		/* The near planes of the leaf. All rays of the set have the same direction signs */
+		float near[3];
+		int k;
+		
+		for( k=0; k<3; k++ )
+			near[k] = ( ctx->iter & ( 4 >> k ) ) ? aabb_max[k] : aabb_min[k];
+		
+		for( r=0; r<num_rays; r++ )
+		{
+			uint32 id = ids[r];
+			float t[3];
+			
+			for( k=0; k<3; k++ )
+				t[k] = ( near[k] - ctx->o[k][id] ) * ctx->inv_d[k][id];
+			
+			ctx->out_face[id] = ENTRY_FACE( t[0], t[1], t[2], ctx->iter );
+		}
 	}
+	
+	ctx->num_terminated += num_rays;
 }
 
-static void traverse_branch( const OctreeNode *node,
-	int octree_level,
-	uint32 *id_array, size_t num_rays,
-	float const *ray_o[3], float const *ray_d[3],
-	uint8 out_mat[],
-	float out_depth[],
-	const int iter,
-	float const aabb_min[3],
-	float const aabb_max[3]
-	)
+/* Compacts the id list in place. Returns the new length */
+static size_t remove_terminated( const DacContext *ctx, uint32 *ids, size_t num_rays )
 {
+	size_t r, n = 0;
+	for( r=0; r<num_rays; r++ ) {
+		if ( !ctx->out_mat[ids[r]] )
+			ids[n++] = ids[r];
+	}
+	return n;
+}
+
+/* ids are the rays that hit the node's bounding box. The lists of child nodes go to child_ids */
+static void traverse_node( DacContext *ctx, const OctreeNode *node, int octree_level,
+	uint32 *ids, size_t num_rays, const RayBounds *bounds,
+	float const aabb_min[3], float const aabb_max[3], uint32 *child_ids )
+{
+	size_t num_terminated = ctx->num_terminated;
 	int m;
 	
+	#ifdef TRAVERSAL_STATS
+	if ( ctx->stats ) {
+		size_t r;
+		for( r=0; r<num_rays; r++ )
+			STATS_NODE( ctx->stats + ids[r], octree_level );
+	}
+	#endif
+	
+	if ( !node->children || octree_level <= 0 ) {
+		process_leaf( ctx, node, octree_level, ids, num_rays, aabb_min, aabb_max );
+		return;
+	}
+	
 	octree_level--;
 	
 	for( m=0; m<8; m++ )
 	{
-		int child_id = m ^ iter;
-		OctreeNode *child = node->children + child_id;
+		int child_id = m ^ ctx->iter;
+		const OctreeNode *child = node->children + child_id;
 		float child_min[3], child_max[3];
+		RayBounds child_bounds;
 		size_t subset_len;
 		int k;
 		
+		if ( !child->children && !child->mat )
+			continue; /* air */
+		
 		for( k=0; k<3; k++ ) {
 			float split = ( aabb_min[k] + aabb_max[k] ) * 0.5f;
 			if ( child_id & ( 4 >> k ) ) {
@@ -127,66 +312,138 @@ static void traverse_branch( const OctreeNode *node,
 			}
 		}
 		
-		subset_len = intersect_with_aabb( id_array, num_rays, ray_o, ray_d, child_min, child_max, out_depth );
+		/* Reject the whole subset at once if possible */
+		if ( !subset_may_hit( ctx, bounds, child_min, child_max ) )
+			continue;
+		
+		subset_len = intersect_with_aabb( ctx, ids, num_rays, child_min, child_max, child_ids );
 		
 		if ( !subset_len )
 			continue;
 		
-		if ( !octree_level || !child->children )
-			process_leaf( child, octree_level, id_array, subset_len, out_mat );
+		if ( subset_len >= MIN_RAYS_FOR_BOUNDS )
+			compute_bounds( ctx, child_ids, subset_len, &child_bounds );
 		else
-			traverse_branch( child, octree_level, id_array, subset_len, ray_o, ray_d, out_mat, out_depth, iter, child_min, child_max );
+			child_bounds = *bounds;
+		
+		traverse_node( ctx, child, octree_level, child_ids, subset_len, &child_bounds, child_min, child_max, child_ids + ctx->stride );
+		
+		if ( ctx->num_terminated != num_terminated )
+		{
+			/* Stop testing rays that hit something inside the child */
+			num_rays = remove_terminated( ctx, ids, num_rays );
+			num_terminated = ctx->num_terminated;
+			
+			if ( !num_rays )
+				break;
+		}
 	}
 }
 
 void oc_traverse_dac( const Octree oc[1],
+	DacScratch *scratch,
 	size_t ray_count,
 	float const *ray_o[3],
 	float const *ray_d[3],
 	uint8 out_mat[],
-	float out_depth[] )
+	float out_depth[],
+	uint8 out_face[],
+	float max_ray_depth )
 {
-	uint32 *id_arrays[8];
 	size_t id_count[8] = {0};
-	uint32 r;
+	size_t id_start[8];
 	float aabb_min[3] = {0};
 	float aabb_max[3];
-	int t;
+	DacContext ctx;
+	uint32 r;
+	int t, k;
 	
 	if ( !ray_count )
 		return;
 	
+	if ( !reserve_dac_scratch( scratch, ray_count ) ) {
+		printf( "Error: failed to allocate DAC scratch memory\n" );
+		return;
+	}
+	
 	aabb_max[0] = aabb_max[1] = aabb_max[2] = oc->size;
-	id_arrays[0] = aligned_alloc( 16, 8 * sizeof( uint32 ) * ray_count );
 	
-	for( t=1; t<8; t++ )
-		id_arrays[t] = id_arrays[0] + t * ray_count;
+	for( k=0; k<3; k++ ) {
+		ctx.o[k] = ray_o[k];
+		ctx.inv_d[k] = scratch->inv_d + k * scratch->capacity;
+	}
+	ctx.out_mat = out_mat;
+	ctx.out_depth = out_depth;
+	ctx.out_face = out_face;
+	ctx.max_depth = max_ray_depth;
+	ctx.stride = ray_count;
+	ctx.num_terminated = 0;
+	ctx.stats = NULL;
+	
+	#ifdef TRAVERSAL_STATS
+	if ( oc_ray_stats ) {
+		ctx.stats = oc_ray_stats;
+		for( r=0; r<ray_count; r++ )
+			ctx.stats[r].root_level = oc->root_level - oc_detail_level;
+	}
+	#endif
 	
+	/* Precompute inverse directions and count rays per direction octant */
 	for( r=0; r<ray_count; r++ )
 	{
-		int k;
 		uint32 iter = 0;
 		
 		out_mat[r] = 0;
-		out_depth[r] = NAN;
 		
 		for( k=0; k<3; k++ ) {
-			if ( ray_d[k][r] < 0 ) {
+			float d = ray_d[k][r];
+			scratch->inv_d[ k * scratch->capacity + r ] = 1.0f / d;
+			if ( d < 0 ) {
 				/* Ray direction is negative. Child nodes should be traversed in reverse order along this axis. */
 				iter |= 4 >> k;
 			}
 		}
 		
-		id_arrays[iter][ id_count[iter]++ ] = r;
+		id_count[iter]++;
+		scratch->ids[ ray_count + r ] = iter; /* temporary */
+	}
+	
+	/* Counting sort by octant into the first id list */
+	for( t=0,r=0; t<8; t++ ) {
+		id_start[t] = r;
+		r += id_count[t];
+	}
+	
+	for( r=0; r<ray_count; r++ ) {
+		uint32 iter = scratch->ids[ ray_count + r ];
+		scratch->ids[ id_start[iter]++ ] = r;
+	}
+	
+	for( t=0; t<8; t++ )
+	{
+		uint32 *ids, *root_ids;
+		size_t n;
+		RayBounds bounds;
+		
+		if ( !id_count[t] )
+			continue;
+		
+		ids = scratch->ids + id_start[t] - id_count[t];
+		root_ids = scratch->ids + ray_count;
+		ctx.iter = t;
+		
+		n = intersect_with_aabb( &ctx, ids, id_count[t], aabb_min, aabb_max, root_ids );
+		
+		if ( n ) {
+			compute_bounds( &ctx, root_ids, n, &bounds );
+			traverse_node( &ctx, &oc->root, oc->root_level - oc_detail_level,
+				root_ids, n, &bounds, aabb_min, aabb_max, root_ids + ray_count );
+		}
 	}
 	
-	for( t=0; t<8; t++ ) {
-		traverse_branch( &oc->root,
-			oc->root_level - oc_detail_level + 1,
-			id_arrays[t], id_count[t],
-			ray_o, ray_d,
-			out_mat, out_depth,
-			t,
-			aabb_min, aabb_max );
+	/* Same convention as oc_traverse */
+	for( r=0; r<ray_count; r++ ) {
+		if ( !out_mat[r] )
+			out_depth[r] = max_ray_depth;
 	}
 }
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <xmmintrin.h>
+#include "voxels.h"
+#include "voxels_compact.h"
+#include "types.h"
+#include "render_core.h"
+#include "traversal_stats.h"
+
+#define ALLOW_DEBUG_VISUALS 1
+
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+static const float missed = -1.0f;
+
+/* 3D-DDA through a dense brick. The t-intervals are those of the brick's bounding box.
+Voxel coordinates are mirrored with rec_mask so that the ray always steps into the positive direction */
+static float traverse_brick( const uint8 *brick, uint8 *out_m, uint8 *out_face, unsigned rec_mask, float near,
+float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, float max_ray_depth )
+{
+	const float tmin[3] = {tminx, tminy, tminz};
+	float dt[3], next[3];
+	int c[3], k;
+	float t = near;
+	unsigned face = ENTRY_FACE( tminx, tminy, tminz, rec_mask ); /* of the voxel at c */
+	
+	for( k=0; k<3; k++ )
+	{
+		float tmax = k == 0 ? tmaxx : ( k == 1 ? tmaxy : tmaxz );
+		int i;
+		
+		dt[k] = ( tmax - tmin[k] ) * ( 1.0f / NOR_BRICK_S );
+		i = ( near - tmin[k] ) / dt[k];
+		c[k] = i < 0 ? 0 : ( i >= NOR_BRICK_S ? NOR_BRICK_S - 1 : i );
+		next[k] = tmin[k] + ( c[k] + 1 ) * dt[k];
+	}
+	
+	for( ;; )
+	{
+		int x = c[0] ^ ( rec_mask & 4 ? NOR_BRICK_S - 1 : 0 );
+		int y = c[1] ^ ( rec_mask & 2 ? NOR_BRICK_S - 1 : 0 );
+		int z = c[2] ^ ( rec_mask & 1 ? NOR_BRICK_S - 1 : 0 );
+		uint8 m = brick[ x * NOR_BRICK_S2 + y * NOR_BRICK_S + z ];
+		
+		/* Step along the axis whose boundary is closest */
+		k = next[0] < next[1] ? ( next[0] < next[2] ? 0 : 2 ) : ( next[1] < next[2] ? 1 : 2 );
+		
+		if ( m && next[k] >= 0.0f )
+		{
+			*out_m = ( ALLOW_DEBUG_VISUALS && oc_show_travel_depth ) ? 2 : m;
+			if ( out_face )
+				*out_face = face;
+			return t;
+		}
+		
+		if ( ++c[k] == NOR_BRICK_S )
+			return missed;
+		
+		t = next[k];
+		next[k] += dt[k];
+		face = 2 * k + ( rec_mask >> ( 2 - k ) & 1 );
+		
+		if ( t > max_ray_depth )
+			return missed;
+	}
+}
+
+/* Same as traversal_func in oc_traverse.c but never visits empty children */
+static float traversal_func( const CompactOctree *oc, size_t parent, int is_leaf, uint8 *out_m, uint8 *out_face, int level, unsigned rec_mask,
+float tminx, float tminy, float tminz, float tmaxx, float tmaxy, float tmaxz, float max_ray_depth )
+{
+	const CompactNode *nodes = oc->nodes;
+	const CompactNode *p = nodes + parent;
+	float near, far;
+	unsigned n;
+	
+	near = MAX( MAX( tminx, tminy ), tminz );
+	far = MIN( MIN( tmaxx, tmaxy ), tmaxz );
+	
+	STATS_TEST( oc_ray_stats, near > far || far < 0.0f || near > max_ray_depth );
+	
+	if ( near > far )
+		return missed;
+	
+	if ( far < 0.0f )
+		return missed;
+	
+	if ( near > max_ray_depth )
+		return missed;
+	
+	STATS_NODE( oc_ray_stats, level );
+	
+	if ( p->flags & CN_BRICK && level >= NOR_BRICK_LEVEL )
+	{
+		/* Bricks are all-or-nothing: with less detail they are handled like leaves */
+		return traverse_brick( oc->bricks + (size_t) p->child * NOR_BRICK_S3, out_m, out_face, rec_mask, near,
+			tminx, tminy, tminz, tmaxx, tmaxy, tmaxz, max_ray_depth );
+	}
+	else if ( !is_leaf && !( p->flags & CN_BRICK ) && level > 0 )
+	{
+		float tsplitx, tsplity, tsplitz;
+		unsigned valid = p->valid_mask;
+		
+		tsplitx = ( tminx + tmaxx ) * 0.5f;
+		tsplity = ( tminy + tmaxy ) * 0.5f;
+		tsplitz = ( tminz + tmaxz ) * 0.5f;
+		
+		level--;
+		
+		for( n=0; n<8; n++ )
+		{
+			unsigned k = n ^ rec_mask;
+			float a[3], b[3];
+			float hit_depth;
+			
+			if ( !( valid & ( 1 << k ) ) )
+				continue; /* air */
+			
+			#define get_child_interval(r,split,lo,hi) \
+				if ( n & ( 4 >> r ) ) { \
+					a[r] = split; \
+					b[r] = hi; \
+				} else { \
+					a[r] = lo; \
+					b[r] = split; \
+				}
+			
+			get_child_interval( 0, tsplitx, tminx, tmaxx );
+			get_child_interval( 1, tsplity, tminy, tmaxy );
+			get_child_interval( 2, tsplitz, tminz, tmaxz );
+			
+			hit_depth = traversal_func( oc, compact_child( nodes, parent, k ), p->leaf_mask >> k & 1,
+				out_m, out_face, level, rec_mask, a[0], a[1], a[2], b[0], b[1], b[2], max_ray_depth );
+			
+			if ( hit_depth != missed )
+				return hit_depth;
+		}
+	}
+	else if ( p->mat )
+	{
+		*out_m = ( ALLOW_DEBUG_VISUALS && oc_show_travel_depth ) ? ( level + 2 & MATERIAL_BITMASK ) : p->mat;
+		if ( out_face )
+			*out_face = ENTRY_FACE( tminx, tminy, tminz, rec_mask );
+		return near;
+	}
+	
+	return missed;
+}
+
+float oc_traverse_compact( const CompactOctree *oc, uint8 *out_m, uint8 *out_face, float ray_ox, float ray_oy, float ray_oz, float ray_dx, float ray_dy, float ray_dz, float max_ray_depth )
+{
+	int initial_level = oc->root_level - oc_detail_level;
+	float size = oc->size;
+	float tmin[3], tmax[3];
+	unsigned mask = 0;
+	float t0, t1, invd;
+	float out_z;
+	
+	#define compute_interval(n,x,d) do { \
+		mask |= ( 4 >> n ) * ( d < 0 ); \
+		invd = 1.0f / d; \
+		t0 = -x * invd; \
+		t1 = ( size - x ) * invd; \
+		tmin[n] = MIN( t0, t1 ); \
+		tmax[n] = MAX( t0, t1 ); \
+	} while(0)
+	
+	/* Same as in oc_traverse_grid: with a zero direction the slab would be infinite and
+	traverse_brick would divide inf by inf */
+	if ( ray_dx == 0 ) ray_dx = 1e-20f;
+	if ( ray_dy == 0 ) ray_dy = 1e-20f;
+	if ( ray_dz == 0 ) ray_dz = 1e-20f;
+	
+	compute_interval( 0, ray_ox, ray_dx );
+	compute_interval( 1, ray_oy, ray_dy );
+	compute_interval( 2, ray_oz, ray_dz );
+	
+	*out_m = 0;
+	STATS_BEGIN( initial_level );
+	out_z = traversal_func( oc, oc->root, oc->root_is_leaf, out_m, out_face, initial_level, mask, tmin[0], tmin[1], tmin[2], tmax[0], tmax[1], tmax[2], max_ray_depth );
+	return out_z == missed ? max_ray_depth : out_z;
+}
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <math.h>
+#include <emmintrin.h>
+#include "voxels.h"
+#include "types.h"
+#include "render_core.h"
+#include "traversal_stats.h"
+
+#define ALLOW_DEBUG_VISUALS 1
+
+/* Everything that stays the same during the recursion */
+typedef struct Packet
+{
+	__m128 max_depth;
+	__m128 active; /* All bits set for lanes that haven't hit anything yet */
+	float *out_z;
+	uint8 *out_m;
+	uint8 *out_face; /* NULL if not needed */
+	unsigned rec_mask;
+} Packet;
+
+#ifdef TRAVERSAL_STATS
+/* Counts the node test for each active lane. oc_ray_stats points to the counters of 4 rays */
+static void count_packet_stats( __m128 active, __m128 hit, int level )
+{
+	int a = _mm_movemask_ps( active ), h = _mm_movemask_ps( hit );
+	int n;
+	
+	if ( !oc_ray_stats )
+		return;
+	
+	for( n=0; n<4; n++ )
+	{
+		if ( a >> n & 1 ) {
+			STATS_TEST( oc_ray_stats+n, !( h >> n & 1 ) );
+			if ( h >> n & 1 )
+				STATS_NODE( oc_ray_stats+n, level );
+		}
+	}
+}
+#endif
+
+/* Same as traversal_func in oc_traverse.c but for 4 rays at once. All 4 rays must have the same direction signs so that they agree on the child order */
+static void traversal_func( const OctreeNode *parent, Packet *p, int level,
+__m128 tminx, __m128 tminy, __m128 tminz, __m128 tmaxx, __m128 tmaxy, __m128 tmaxz )
+{
+	__m128 near, far, hit;
+	unsigned n;
+	
+	near = _mm_max_ps( _mm_max_ps( tminx, tminy ), tminz );
+	far = _mm_min_ps( _mm_min_ps( tmaxx, tmaxy ), tmaxz );
+	
+	/* Same tests as the scalar version. Written with "not greater than" so that NaN max_depth means infinity */
+	hit = _mm_and_ps( p->active, _mm_cmpngt_ps( near, far ) );
+	hit = _mm_and_ps( hit, _mm_cmpnlt_ps( far, _mm_setzero_ps() ) );
+	hit = _mm_and_ps( hit, _mm_cmpngt_ps( near, p->max_depth ) );
+	
+	#ifdef TRAVERSAL_STATS
+	count_packet_stats( p->active, hit, level );
+	#endif
+	
+	if ( !_mm_movemask_ps( hit ) )
+		return;
+	
+	if ( parent->children && level > 0 )
+	{
+		__m128 tsplitx, tsplity, tsplitz, half = _mm_set1_ps( 0.5f );
+		
+		tsplitx = _mm_mul_ps( _mm_add_ps( tminx, tmaxx ), half );
+		tsplity = _mm_mul_ps( _mm_add_ps( tminy, tmaxy ), half );
+		tsplitz = _mm_mul_ps( _mm_add_ps( tminz, tmaxz ), half );
+		
+		level--;
+		
+		for( n=0; n<8; n++ )
+		{
+			unsigned k = n ^ p->rec_mask;
+			
+			traversal_func( parent->children + k, p, level,
+				( n & 4 ) ? tsplitx : tminx,
+				( n & 2 ) ? tsplity : tminy,
+				( n & 1 ) ? tsplitz : tminz,
+				( n & 4 ) ? tmaxx : tsplitx,
+				( n & 2 ) ? tmaxy : tsplity,
+				( n & 1 ) ? tmaxz : tsplitz );
+			
+			if ( !_mm_movemask_ps( p->active ) )
+				return; /* every ray has hit something */
+		}
+	}
+	else if ( parent->mat )
+	{
+		int bits = _mm_movemask_ps( hit );
+		uint8 m = ( ALLOW_DEBUG_VISUALS && oc_show_travel_depth ) ? ( level + 2 & MATERIAL_BITMASK ) : parent->mat;
+		float z[4], tx[4], ty[4], tz[4];
+		
+		_mm_storeu_ps( z, near );
+		
+		for( n=0; n<4; n++ ) {
+			if ( bits >> n & 1 ) {
+				p->out_m[n] = m;
+				p->out_z[n] = z[n];
+			}
+		}
+		
+		if ( p->out_face )
+		{
+			_mm_storeu_ps( tx, tminx );
+			_mm_storeu_ps( ty, tminy );
+			_mm_storeu_ps( tz, tminz );
+			
+			for( n=0; n<4; n++ ) {
+				if ( bits >> n & 1 )
+					p->out_face[n] = ENTRY_FACE( tx[n], ty[n], tz[n], p->rec_mask );
+			}
+		}
+		
+		p->active = _mm_andnot_ps( hit, p->active );
+	}
+}
+
+/* Smallest node that contains the segments [o, o + d * max_depth] of all active lanes. Short rays (AO) don't need to start from the root */
+static const OctreeNode *find_start_node( const Octree *oc, const __m128 o[3], const __m128 d[3], unsigned lanes, float max_depth, int *out_level, float pos[3] )
+{
+	const OctreeNode *node = &oc->root;
+	int level = oc->root_level;
+	float lo[3], hi[3];
+	int k, n;
+	
+	pos[0] = pos[1] = pos[2] = 0;
+	*out_level = level;
+	
+	/* Also false for NAN */
+	if ( !( max_depth < INFINITY ) )
+		return node;
+	
+	for( k=0; k<3; k++ )
+	{
+		float a[4], b[4];
+		
+		_mm_storeu_ps( a, o[k] );
+		_mm_storeu_ps( b, _mm_add_ps( o[k], _mm_mul_ps( d[k], _mm_set1_ps( max_depth ) ) ) );
+		lo[k] = INFINITY;
+		hi[k] = -INFINITY;
+		
+		for( n=0; n<4; n++ ) {
+			if ( lanes >> n & 1 ) {
+				lo[k] = a[n] < lo[k] ? a[n] : lo[k];
+				lo[k] = b[n] < lo[k] ? b[n] : lo[k];
+				hi[k] = a[n] > hi[k] ? a[n] : hi[k];
+				hi[k] = b[n] > hi[k] ? b[n] : hi[k];
+			}
+		}
+		
+		if ( !( lo[k] >= 0 && hi[k] < oc->size ) )
+			return node;
+	}
+	
+	while( node->children && level > oc_detail_level )
+	{
+		float half = 1 << ( level - 1 );
+		unsigned child = 0;
+		
+		for( k=0; k<3; k++ )
+		{
+			int upper = lo[k] >= pos[k] + half;
+			if ( upper != ( hi[k] >= pos[k] + half ) )
+				return node;
+			child |= ( 4 >> k ) * upper;
+		}
+		
+		for( k=0; k<3; k++ )
+			pos[k] += ( child & 4 >> k ) ? half : 0;
+		
+		node = node->children + child;
+		*out_level = --level;
+	}
+	
+	return node;
+}
+
+int oc_traverse_packet4( const Octree *oc, uint8 out_m[4], float out_z[4], uint8 *out_face, unsigned lanes,
+	const float ox[4], const float oy[4], const float oz[4],
+	const float dx[4], const float dy[4], const float dz[4], float max_ray_depth )
+{
+	__m128 o[3], d[3], invd[3], tmin[3], tmax[3], zero;
+	const OctreeNode *start;
+	float pos[3];
+	int signs[3];
+	int level;
+	Packet p;
+	int k;
+	
+	o[0] = _mm_loadu_ps( ox );
+	o[1] = _mm_loadu_ps( oy );
+	o[2] = _mm_loadu_ps( oz );
+	d[0] = _mm_loadu_ps( dx );
+	d[1] = _mm_loadu_ps( dy );
+	d[2] = _mm_loadu_ps( dz );
+	
+	p.rec_mask = 0;
+	
+	for( k=0; k<3; k++ )
+	{
+		/* The packet diverges if the active rays disagree on the direction signs */
+		signs[k] = _mm_movemask_ps( _mm_cmplt_ps( d[k], _mm_setzero_ps() ) ) & lanes;
+		if ( signs[k] && signs[k] != (int) lanes )
+			return 0;
+		
+		p.rec_mask |= ( 4 >> k ) * !!signs[k];
+		
+		/* Same as in oc_traverse_grid: zero lanes get a tiny direction with the packet's sign.
+		Infinite intervals would turn the split points into NaNs */
+		zero = _mm_cmpeq_ps( d[k], _mm_setzero_ps() );
+		d[k] = _mm_or_ps( _mm_andnot_ps( zero, d[k] ), _mm_and_ps( zero, _mm_set1_ps( signs[k] ? -1e-20f : 1e-20f ) ) );
+		invd[k] = _mm_div_ps( _mm_set1_ps( 1.0f ), d[k] );
+	}
+	
+	start = find_start_node( oc, o, d, lanes, max_ray_depth, &level, pos );
+	
+	for( k=0; k<3; k++ )
+	{
+		__m128 t0, t1;
+		
+		t0 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( pos[k] ), o[k] ), invd[k] );
+		t1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( pos[k] + ( 1 << level ) ), o[k] ), invd[k] );
+		tmin[k] = _mm_min_ps( t0, t1 );
+		tmax[k] = _mm_max_ps( t0, t1 );
+	}
+	
+	for( k=0; k<4; k++ ) {
+		out_m[k] = 0;
+		out_z[k] = max_ray_depth;
+	}
+	
+	p.max_depth = _mm_set1_ps( max_ray_depth );
+	p.active = _mm_castsi128_ps( _mm_set_epi32( -( lanes >> 3 & 1 ), -( lanes >> 2 & 1 ), -( lanes >> 1 & 1 ), -( lanes & 1 ) ) );
+	p.out_z = out_z;
+	p.out_m = out_m;
+	p.out_face = out_face;
+	
+	#ifdef TRAVERSAL_STATS
+	if ( oc_ray_stats ) {
+		for( k=0; k<4; k++ )
+			oc_ray_stats[k].root_level = level - oc_detail_level;
+	}
+	#endif
+	
+	traversal_func( start, &p, level - oc_detail_level, tmin[0], tmin[1], tmin[2], tmax[0], tmax[1], tmax[2] );
+	return 1;
+}
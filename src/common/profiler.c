@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "profiler.h"
+
+const char *const RENDER_STAGE_NAMES[NUM_RENDER_STAGES] = {
+	"raygen", "primary", "shadow", "AO", "shade", "frame"
+};
+
+int enable_profiler = 0;
+
+ProfRing *prof_create_ring( int thread_id )
+{
+	ProfRing *ring = calloc( 1, sizeof(*ring) );
+	
+	if ( ring )
+		ring->thread_id = thread_id;
+	
+	return ring;
+}
+
+void prof_clear_ring( ProfRing *ring )
+{
+	if ( ring )
+		ring->head = 0;
+}
+
+void prof_event( ProfRing *ring, int stage, uint64 t0, uint64 t1, uint32 arg )
+{
+	ProfEvent *e;
+	
+	if ( !enable_profiler || !ring )
+		return;
+	
+	e = ring->events + ( ring->head & ( PROF_RING_SIZE - 1 ) );
+	e->start = t0;
+	e->duration = t1 > t0 ? t1 - t0 : 0;
+	e->stage = stage;
+	e->frame = ring->frame;
+	e->arg = arg;
+	
+	/* Publish the event after it has been written */
+	__sync_synchronize();
+	ring->head++;
+}
+
+/* Index of the oldest event still in the ring and the number of events after it */
+static void get_ring_range( const ProfRing *ring, uint32 *first, uint32 *count )
+{
+	uint32 head = ring->head;
+	*count = head < PROF_RING_SIZE ? head : PROF_RING_SIZE;
+	*first = head - *count;
+}
+
+int prof_write_chrome_trace( const char *filename, ProfRing *const rings[], size_t num_rings )
+{
+	FILE *fp;
+	uint64 t_base = ~(uint64) 0;
+	const char *sep = "";
+	size_t n;
+	uint32 i, first, count;
+	
+	/* Timestamps are written relative to the oldest event */
+	for( n=0; n<num_rings; n++ )
+	{
+		if ( !rings[n] )
+			continue;
+		
+		get_ring_range( rings[n], &first, &count );
+		for( i=0; i<count; i++ ) {
+			const ProfEvent *e = rings[n]->events + ( ( first + i ) & ( PROF_RING_SIZE - 1 ) );
+			if ( e->start < t_base )
+				t_base = e->start;
+		}
+	}
+	
+	fp = fopen( filename, "w" );
+	if ( !fp )
+		return 0;
+	
+	fprintf( fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	
+	for( n=0; n<num_rings; n++ )
+	{
+		const ProfRing *ring = rings[n];
+		
+		if ( !ring )
+			continue;
+		
+		if ( ring->thread_id < 0 )
+			fprintf( fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}", sep );
+		else
+			fprintf( fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"render %d\"}}", sep, ring->thread_id + 1, ring->thread_id );
+		sep = ",\n";
+		
+		get_ring_range( ring, &first, &count );
+		for( i=0; i<count; i++ )
+		{
+			const ProfEvent *e = ring->events + ( ( first + i ) & ( PROF_RING_SIZE - 1 ) );
+			
+			fprintf( fp, "%s{\"name\":\"%s\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%u,\"args\":{\"frame\":%u",
+				sep, RENDER_STAGE_NAMES[e->stage], ring->thread_id + 1,
+				(unsigned long long)( e->start - t_base ), (unsigned) e->duration, (unsigned) e->frame );
+			
+			if ( e->stage == STAGE_SHADE )
+				fprintf( fp, ",\"ao_us\":%u", (unsigned) e->arg );
+			
+			fprintf( fp, "}}" );
+		}
+	}
+	
+	fprintf( fp, "\n]}\n" );
+	return fclose( fp ) == 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+#include <stddef.h>
+#include "types.h"
+
+/* Stages of render_tile plus the frame itself (recorded by the main thread) */
+enum {
+	STAGE_RAYGEN=0,
+	STAGE_PRIMARY,
+	STAGE_SHADOW,
+	STAGE_AO,
+	STAGE_SHADE, /* excludes AO */
+	STAGE_FRAME,
+	NUM_RENDER_STAGES
+};
+
+extern const char *const RENDER_STAGE_NAMES[NUM_RENDER_STAGES];
+
+/* Events are only recorded when this is nonzero */
+extern int enable_profiler;
+
+#define PROF_RING_SIZE 8192 /* must be a power of 2 */
+
+typedef struct ProfEvent {
+	uint64 start; /* get_microsec() */
+	uint32 duration;
+	uint16 stage;
+	uint16 unused;
+	uint32 frame;
+	uint32 arg; /* microseconds of AO inside STAGE_SHADE */
+} ProfEvent;
+
+/* Written by one thread only. The newest PROF_RING_SIZE events are kept.
+Readers should only look at the ring while the writer is idle (between frames) */
+typedef struct ProfRing {
+	ProfEvent events[PROF_RING_SIZE];
+	volatile uint32 head; /* total number of events written */
+	uint32 frame; /* stored in new events. Set by the writer */
+	int thread_id; /* -1 for the main thread */
+} ProfRing;
+
+ProfRing *prof_create_ring( int thread_id );
+void prof_clear_ring( ProfRing *ring );
+
+/* Adds an event if enable_profiler is set. Does nothing if ring is NULL */
+void prof_event( ProfRing *ring, int stage, uint64 t0, uint64 t1, uint32 arg );
+
+/* Writes the events of all rings as Chrome/Perfetto trace JSON (chrome://tracing, ui.perfetto.dev).
+Returns 0 on failure */
+int prof_write_chrome_trace( const char *filename, ProfRing *const rings[], size_t num_rings );
+
+#endif
@@ -1,8 +1,10 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "render_buffers.h"
 
 static void *all_buffers = NULL;
+static size_t capacity = 0; /* Pixels allocated for each buffer. Kept when the buffers shrink */
 
 size_t
 render_resx=0,
@@ -14,68 +16,155 @@ uint32
 
 uint8 *render_output_m = NULL; /* materials */
 float *render_output_z = NULL; /* ray depth (distance to first intersection) */
+uint8 *render_output_face = NULL;
+float *render_reproj_z = NULL;
+float *render_accum = NULL;
+uint16 *render_output_cost = NULL;
+
+uint8 *render_last_m = NULL;
+float *render_last_z = NULL;
+uint8 *render_last_face = NULL;
+uint16 *render_last_cost = NULL;
 
 void swap_render_buffers( void )
 {
 	void *p = render_output_rgba;
 	render_output_rgba = render_output_write;
 	render_output_write = p;
+	
+	p = render_last_m;
+	render_last_m = render_output_m;
+	render_output_m = p;
+	
+	p = render_last_z;
+	render_last_z = render_output_z;
+	render_output_z = p;
+	
+	p = render_last_face;
+	render_last_face = render_output_face;
+	render_output_face = p;
+	
+	p = render_last_cost;
+	render_last_cost = render_output_cost;
+	render_output_cost = p;
 }
 
-int resize_render_buffers( size_t w, size_t h )
+int set_render_buffer_size( size_t w, size_t h )
 {
-	size_t alloc_pixels, total_pixels, s[4];
-	char *all_mem;
-	
 	assert( w % 16 == 0 );
 	
+	if ( !w || !h || w * h + w + 128 > capacity )
+		return 0;
+	
 	render_resx = w;
 	render_resy = h;
-	total_pixels = w * h;
+	return 1;
+}
+
+static void clear_pointers( void )
+{
+	render_output_m = NULL;
+	render_output_z = NULL;
+	render_output_face = NULL;
+	render_output_write = NULL;
+	render_output_rgba = NULL;
+	render_reproj_z = NULL;
+	render_accum = NULL;
+	render_output_cost = NULL;
+	render_last_m = NULL;
+	render_last_z = NULL;
+	render_last_face = NULL;
+	render_last_cost = NULL;
+}
+
+int resize_render_buffers( size_t w, size_t h )
+{
+	size_t alloc_pixels, s[12], total_bytes;
+	char *all_mem;
 	
-	if ( all_buffers ) {
+	assert( w % 16 == 0 );
+	
+	if ( !w || !h )
+	{
 		free( all_buffers );
 		all_buffers = NULL;
+		capacity = 0;
+		render_resx = 0;
+		render_resy = 0;
+		clear_pointers();
+		return 0;
 	}
 	
-	if ( total_pixels )
+	/* Shrinking or growing within the capacity keeps the memory */
+	if ( set_render_buffer_size( w, h ) )
+		return 1;
+	
+	/* Allocate some extra pixels to avoid needing to check bounds in tight pixel processing loops */
+	alloc_pixels = w * h + w + 128;
+	
+	/* A window that is being dragged bigger would otherwise reallocate on every resize event */
+	if ( capacity && alloc_pixels < capacity + capacity / 2 )
+		alloc_pixels = capacity + capacity / 2;
+	
+	/* Pixel buffer sizes. Pad to 16 so that each buffer will be 16-aligned inside all_mem */
+	s[0] = ( alloc_pixels * sizeof( render_output_m[0] ) + 0xF ) & ~0xF;
+	s[1] = ( alloc_pixels * sizeof( render_output_z[0] ) + 0xF ) & ~0xF;
+	s[2] = ( alloc_pixels * sizeof( render_output_write[0] ) + 0xF ) & ~0xF;
+	s[3] = ( alloc_pixels * sizeof( render_output_rgba[0] ) + 0xF ) & ~0xF;
+	s[4] = ( alloc_pixels * sizeof( render_reproj_z[0] ) + 0xF ) & ~0xF;
+	s[5] = ( alloc_pixels * 4 * sizeof( render_accum[0] ) + 0xF ) & ~0xF;
+	s[6] = s[0]; /* render_last_m */
+	s[7] = s[1]; /* render_last_z */
+	s[8] = ( alloc_pixels * sizeof( render_output_face[0] ) + 0xF ) & ~0xF;
+	s[9] = s[8]; /* render_last_face */
+	#ifdef TRAVERSAL_STATS
+	s[10] = ( alloc_pixels * sizeof( render_output_cost[0] ) + 0xF ) & ~0xF;
+	#else
+	s[10] = 0;
+	#endif
+	s[11] = s[10]; /* render_last_cost */
+	
+	/* Extra 16 in case the pointer needs to be adjusted to achieve alignment */
+	total_bytes = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7] + s[8] + s[9] + s[10] + s[11] + 16;
+	all_mem = malloc( total_bytes );
+	
+	/* The old buffers are still usable */
+	if ( !all_mem )
+		return 0;
+	
+	free( all_buffers );
+	
 	{
-		/* Allocate some extra pixels to avoid needing to check bounds in tight pixel processing loops */
-		alloc_pixels = total_pixels + render_resx + 128;
+		/* This integer aligns all_mem to 16 bytes. Only the lowest 16 bits matter so (int) cast is ok */
+		int off = (int) all_mem & 0xF;
+		off *= !!off;
+		
+		all_buffers = all_mem;
+		all_mem += off;
 		
-		/* Pixel buffer sizes. Pad to 16 so that each buffer will be 16-aligned inside all_mem */
-		s[0] = ( alloc_pixels * sizeof( render_output_m[0] ) + 0xF ) & ~0xF;
-		s[1] = ( alloc_pixels * sizeof( render_output_z[0] ) + 0xF ) & ~0xF;
-		s[2] = ( alloc_pixels * sizeof( render_output_write[0] ) + 0xF ) & ~0xF;
-		s[3] = ( alloc_pixels * sizeof( render_output_rgba[0] ) + 0xF ) & ~0xF;
+		assert( (int) all_mem % 16 == 0 );
 		
-		/* Extra 16 in case the pointer needs to be adjusted to achieve alignment */
-		all_mem = malloc( s[0] + s[1] + s[2] + s[3] + 16 );
+		/* Take the page faults here rather than in the render threads during the first frame.
+		(Clearing exactly what malloc returned could get turned into a calloc that touches nothing) */
+		memset( all_mem, 0, total_bytes - 16 );
 		
-		if ( all_mem )
-		{
-			/* This integer aligns all_mem to 16 bytes. Only the lowest 16 bits matter so (int) cast is ok */
-			int off = (int) all_mem & 0xF;
-			off *= !!off;
-			
-			all_buffers = all_mem;
-			all_mem += off;
-			
-			assert( (int) all_mem % 16 == 0 );
-			
-			render_output_m = (void*) all_mem;
-			render_output_z = (void*)( all_mem = all_mem + s[0] );
-			render_output_write = (void*)( all_mem = all_mem + s[1] );
-			render_output_rgba = (void*)( all_mem = all_mem + s[2] );
-			
-			return 1;
-		}
+		capacity = alloc_pixels;
+		render_resx = w;
+		render_resy = h;
+		
+		render_output_m = (void*) all_mem;
+		render_output_z = (void*)( all_mem = all_mem + s[0] );
+		render_output_write = (void*)( all_mem = all_mem + s[1] );
+		render_output_rgba = (void*)( all_mem = all_mem + s[2] );
+		render_reproj_z = (void*)( all_mem = all_mem + s[3] );
+		render_accum = (void*)( all_mem = all_mem + s[4] );
+		render_last_m = (void*)( all_mem = all_mem + s[5] );
+		render_last_z = (void*)( all_mem = all_mem + s[6] );
+		render_output_face = (void*)( all_mem = all_mem + s[7] );
+		render_last_face = (void*)( all_mem = all_mem + s[8] );
+		render_output_cost = s[10] ? (void*)( all_mem = all_mem + s[9] ) : NULL;
+		render_last_cost = s[10] ? (void*)( all_mem + s[10] ) : NULL;
 	}
 	
-	render_output_m = NULL;
-	render_output_z = NULL;
-	render_output_write = NULL;
-	render_output_rgba = NULL;
-	
-	return 0;
+	return 1;
 }
@@ -9,16 +9,31 @@ extern size_t render_resx, render_resy;
 /* Used by render_core.c */
 extern uint8 *render_output_m; /* materials */
 extern float *render_output_z; /* ray depth (distance to first intersection) */
+extern uint8 *render_output_face; /* ENTRY_FACE of the hit voxel (see render_core.h). Undefined where the material is 0 */
+extern float *render_reproj_z; /* previous frame's hits seen from the current camera. 0 where nothing reprojected */
+extern float *render_accum; /* sum of the progressively refined frames. 4 floats per pixel (see render_core.h) */
+extern uint16 *render_output_cost; /* nodes entered by each primary ray. NULL unless built with TRAVERSAL_STATS */
+
+/* The same buffers of the last finished frame. They stay intact while the next frame is rendered */
+extern uint8 *render_last_m;
+extern float *render_last_z;
+extern uint8 *render_last_face;
+extern uint16 *render_last_cost;
 
 /* Pixel buffers. The pointers are aligned to 16 bytes  */
 extern uint32 *render_output_write; /* Write-mostly. This is the "back" buffer */
 extern uint32 *render_output_rgba; /* Read-only. This is the "front" buffer */
 
-/* Interchanges the 2 pointers above */
+/* Interchanges the 2 pointers above. Also interchanges render_output_m/z/face/cost with render_last_m/z/face/cost */
 void swap_render_buffers( void );
 
-/* (Re)Allocates memory. Deallocates memory if w*h == 0. w must be a multiple of 16. Should only be called by resize_render_output()
-Returns zero on failure, nonzero on success. Also returns zero if w==0 or h==0 */
+/* Changes the dimensions without reallocating. The pixels are reinterpreted with the new row length.
+Returns zero if w*h doesn't fit in what resize_render_buffers allocated. w must be a multiple of 16 */
+int set_render_buffer_size( size_t w, size_t h );
+
+/* Sets the dimensions, reallocating only if w*h doesn't fit in the current memory. Deallocates memory if w*h == 0.
+A new allocation leaves room to grow and is cleared right away. w must be a multiple of 16. Should only be called by resize_render_output()
+Returns zero on failure (the old buffers are kept), nonzero on success. Also returns zero if w==0 or h==0 */
 int resize_render_buffers( size_t w, size_t h );
 
 #endif
@@ -8,6 +8,11 @@
 #include "render_buffers.h"
 #include "render_core.h"
 #include "render_threads.h"
+#include "microsec.h"
+#include "voxels_compact.h"
+#include "voxels_distance.h"
+#include "voxels_aocache.h"
+#include "voxels_normals.h"
 #include "mm_math.c"
 
 uint32 materials_rgb[NUM_MATERIALS];
@@ -18,12 +23,31 @@ int enable_shadows = 0;
 int enable_phong = 1;
 int show_normals = 0;
 int show_depth_buffer = 0;
+int show_traversal_cost = 0;
 int enable_aoccl = 0; /* ambient occlusion */
+int enable_ao_cache = 0;
+int ao_sample_count = NUM_AO_SAMPLES;
+int enable_progressive = 0;
+unsigned progressive_frame = 0;
+int enable_checkerboard = 0;
+int enable_voxel_normals = 1;
 int enable_dac_method = 0;
+int traversal_method = TRAVERSE_RECURSIVE;
 
-static float screen_uv_scale[2];
+const char *TRAVERSAL_METHOD_NAMES[NUM_TRAVERSAL_METHODS] = {
+	"recursive",
+	"iterative",
+	"packet",
+	"compact",
+	"DAG",
+	"grid"
+};
+
+float screen_uv_scale[2];
 float screen_uv_min[2];
 static float light_x[4], light_y[4], light_z[4];
+static float unpacked_normals[NUM_NORMALS][3]; /* PNor to vector. Filled by prepare_volume */
+static int unpacked_normals_ready = 0;
 
 void set_light_pos( float x, float y, float z )
 {
@@ -36,24 +60,43 @@ float calc_raydir_z( const Camera *camera ) {
 	return fabs( screen_uv_min[0] ) / tanf( camera->fovx * 0.5f );
 }
 
+static void set_screen_uv( int w, int h )
+{
+	double screen_ratio;
+	
+	screen_ratio = w / (double) h;
+	screen_uv_min[0] = -0.5;
+	screen_uv_scale[0] = 1.0 / w;
+	screen_uv_min[1] = 0.5 / screen_ratio;
+	screen_uv_scale[1] = -1.0 / h / screen_ratio;
+}
+
 void resize_render_output( int w, int h )
 {
-	const int nt = num_render_threads;
-	stop_render_threads();
 	w &= ~0xF;
 	
+	/* The buffers could have been cleared */
+	invalidate_reprojection();
+	reset_progressive();
+	
 	if ( resize_render_buffers( w, h ) )
-	{
-		double screen_ratio;
-		
-		screen_ratio = w / (double) h;
-		screen_uv_min[0] = -0.5;
-		screen_uv_scale[0] = 1.0 / w;
-		screen_uv_min[1] = 0.5 / screen_ratio;
-		screen_uv_scale[1] = -1.0 / h / screen_ratio;
-		
-		start_render_threads( nt );
-	}
+		set_screen_uv( w, h );
+}
+
+int set_render_resolution( int w, int h )
+{
+	w &= ~0xF;
+	
+	if ( w == (int) render_resx && h == (int) render_resy )
+		return 1;
+	
+	if ( w <= 0 || h <= 1 || !set_render_buffer_size( w, h ) )
+		return 0;
+	
+	/* The last frame's depth has a different layout now */
+	invalidate_reprojection();
+	set_screen_uv( w, h );
+	return 1;
 }
 
 void get_primary_ray( Ray *ray, const Camera *c, const Octree *volume, int x, int y )
@@ -71,6 +114,136 @@ void get_primary_ray( Ray *ray, const Camera *c, const Octree *volume, int x, in
 	multiply_vec_mat3f( ray->d, c->eye_to_world, ray->d );
 }
 
+void prepare_volume( Octree *volume )
+{
+	if ( traversal_method == TRAVERSE_COMPACT || traversal_method == TRAVERSE_DAG )
+		oc_update_compact( volume, traversal_method == TRAVERSE_DAG );
+	
+	if ( traversal_method == TRAVERSE_GRID )
+		oc_update_distance_grid( volume );
+	
+	if ( enable_aoccl && enable_ao_cache )
+		oc_update_ao_cache( volume, AO_FALLOFF * volume->size );
+	
+	if ( volume->normals && !unpacked_normals_ready )
+	{
+		int n;
+		for( n=0; n<NUM_NORMALS; n++ )
+			unpack_normal( n, unpacked_normals[n], unpacked_normals[n]+1, unpacked_normals[n]+2 );
+		unpacked_normals_ready = 1;
+	}
+}
+
+/* What the accumulated frames were rendered with */
+static struct {
+	float camera[14]; /* position, eye_to_world, fovx, fovy */
+	const Octree *volume;
+	unsigned revision;
+	size_t resx, resy;
+	float light[3];
+	int settings[11];
+} prev_view;
+static int prev_view_valid = 0;
+static int view_unchanged = 0; /* Same primary rays as the last frame */
+static unsigned checker_parity = 0; /* Pixels where x+y+checker_parity is even get traced */
+
+void reset_progressive( void ) {
+	prev_view_valid = 0;
+}
+
+void prepare_progressive( const Camera *camera, const Octree *volume )
+{
+	int settings[11] = {
+		enable_shadows, enable_phong, enable_aoccl, enable_ao_cache, enable_dac_method,
+		show_normals, show_depth_buffer, oc_show_travel_depth, oc_detail_level, ao_sample_count,
+		enable_voxel_normals
+	};
+	float cam[14];
+	int same;
+	
+	/* Everything that the primary rays depend on */
+	memcpy( cam, camera->pos, 3 * sizeof( float ) );
+	memcpy( cam + 3, camera->eye_to_world, 9 * sizeof( float ) );
+	cam[12] = camera->fovx;
+	cam[13] = camera->fovy;
+	
+	same = prev_view_valid
+		&& !memcmp( prev_view.camera, cam, sizeof( cam ) )
+		&& prev_view.volume == volume
+		&& prev_view.revision == volume->revision
+		&& prev_view.resx == render_resx
+		&& prev_view.resy == render_resy
+		&& prev_view.light[0] == light_x[0]
+		&& prev_view.light[1] == light_y[0]
+		&& prev_view.light[2] == light_z[0]
+		&& !memcmp( prev_view.settings, settings, sizeof( settings ) );
+	
+	view_unchanged = same;
+	checker_parity ^= 1;
+	
+	if ( !enable_progressive || !same )
+		progressive_frame = 0;
+	else if ( progressive_frame < PROGRESSIVE_MAX_FRAMES )
+		progressive_frame++;
+	
+	memcpy( prev_view.camera, cam, sizeof( cam ) );
+	prev_view.volume = volume;
+	prev_view.revision = volume->revision;
+	prev_view.resx = render_resx;
+	prev_view.resy = render_resy;
+	prev_view.light[0] = light_x[0];
+	prev_view.light[1] = light_y[0];
+	prev_view.light[2] = light_z[0];
+	memcpy( prev_view.settings, settings, sizeof( settings ) );
+	prev_view_valid = 1;
+}
+
+/* Traces one ray with the selected traversal method. out_face can be NULL */
+static float trace_ray( const Octree *volume, uint8 *out_m, uint8 *out_face, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth )
+{
+	if ( ( traversal_method == TRAVERSE_COMPACT || traversal_method == TRAVERSE_DAG ) && volume->compact )
+		return oc_traverse_compact( volume->compact, out_m, out_face, ox, oy, oz, dx, dy, dz, max_ray_depth );
+	
+	if ( traversal_method == TRAVERSE_ITERATIVE )
+		return oc_traverse_iter( volume, out_m, out_face, ox, oy, oz, dx, dy, dz, max_ray_depth );
+	
+	if ( traversal_method == TRAVERSE_GRID )
+		return oc_traverse_grid( volume, out_m, out_face, ox, oy, oz, dx, dy, dz, max_ray_depth );
+	
+	return oc_traverse( volume, out_m, out_face, ox, oy, oz, dx, dy, dz, max_ray_depth );
+}
+
+/* Traces rays r..r+3 of SoA buffers. Uses packets when possible. out_face can be NULL */
+static void trace_rays4( const Octree *volume, uint8 *out_m, float *out_z, uint8 *out_face, unsigned lanes,
+	const float *ox, const float *oy, const float *oz,
+	const float *dx, const float *dy, const float *dz, float max_ray_depth )
+{
+	int k;
+	#ifdef TRAVERSAL_STATS
+	TraversalStats *lane_stats = oc_ray_stats;
+	#endif
+	
+	if ( traversal_method == TRAVERSE_PACKET
+		&& oc_traverse_packet4( volume, out_m, out_z, out_face, lanes, ox, oy, oz, dx, dy, dz, max_ray_depth ) )
+		return;
+	
+	/* Divergent packet or some other traversal method */
+	for( k=0; k<4; k++ )
+	{
+		#ifdef TRAVERSAL_STATS
+		if ( lane_stats )
+			oc_ray_stats = lane_stats + k;
+		#endif
+		
+		if ( lanes >> k & 1 )
+			out_z[k] = trace_ray( volume, out_m+k, out_face ? out_face+k : NULL, ox[k], oy[k], oz[k], dx[k], dy[k], dz[k], max_ray_depth );
+	}
+	
+	#ifdef TRAVERSAL_STATS
+	oc_ray_stats = lane_stats;
+	#endif
+}
+
 static void calc_shadow_mat( void* restrict mat_p, void const* restrict shadow_mat_p, __m128i shade_bits )
 {
 	__m128i mat, visible, zero;
@@ -159,30 +332,39 @@ __m128 tlx, __m128 tly, __m128 tlz /* vector to light */
 	return colors;
 }
 
-/* if ( enable_aoccl && !show_normals )
-if ( *(uint32*)(mat_p0+r) == 0 )
-	continue;
-Returns a float in range [0,1]
-*/
-static float get_ao_samples( Octree *volume, float ox, float oy, float oz, float nx1, float ny1, float nz1, float falloff )
+/* Hash of the screen position. Seeds the AO samples of each pixel so that render threads don't share any random state */
+static uint32 hash_pixel( uint32 x, uint32 y )
+{
+	uint32 h = x * 0x8DA6B343u ^ y * 0xD8163841u;
+	h ^= h >> 16;
+	h *= 0x7FEB352Du;
+	h ^= h >> 15;
+	h *= 0x846CA68Bu;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Makes count random directions on the hemisphere around the normal. count must be a multiple of 4.
+The same seed gives the same directions (up to the hemisphere flip) */
+static void gen_ao_dirs( float *dx, float *dy, float *dz, float nx1, float ny1, float nz1, uint32 seed, int count )
 {
-	static uint32 state[4] = {0x09F91102,0x9D74E35B,0xD84156C5,0x635688C0};
-	float dx[NUM_AO_SAMPLES+3&~3], dy[NUM_AO_SAMPLES+3&~3], dz[NUM_AO_SAMPLES+3&~3];
-	float total_z=0;
 	int s;
+	__m128i state;
 	__m128
 	nx = _mm_set1_ps( nx1 ),
 	ny = _mm_set1_ps( ny1 ),
 	nz = _mm_set1_ps( nz1 );
 	
-	for( s=0; s<NUM_AO_SAMPLES; s+=4 )
+	state = _mm_xor_si128( _mm_set1_epi32( seed ), _mm_set_epi32( 0x635688C0, 0xD84156C5, 0x9D74E35B, 0x09F91102 ) );
+	
+	for( s=0; s<count; s+=4 )
 	{
 		__m128 vx, vy, vz, dot, sign_mask;
 		
 		sign_mask = _mm_castsi128_ps( _mm_set1_epi32( 0x80000000 ) );
-		vx = mm_rand( state );
-		vy = mm_rand( state );
-		vz = mm_rand( state );
+		vx = mm_rand( &state );
+		vy = mm_rand( &state );
+		vz = mm_rand( &state );
 		normalize_vec( &vx, &vy, &vz, vx, vy, vz );
 		dot = dot_prod( vx, vy, vz, nx, ny, nz );
 		dot = _mm_and_ps( dot, sign_mask );
@@ -193,64 +375,346 @@ static float get_ao_samples( Octree *volume, float ox, float oy, float oz, float
 		_mm_store_ps( dy+s, vy );
 		_mm_store_ps( dz+s, vz );
 	}
-	for( s=0; s<NUM_AO_SAMPLES; s++ )
+}
+
+/* AO of 4 neighbouring pixels with num_samples (at most NUM_AO_SAMPLES) rays each. Pixels with the same seed use the same sample directions.
+Rays are sorted by direction octant and sample so that each group of 4 goes through trace_rays4
+as one coherent packet. Pixels with zero material are skipped */
+static void get_ao_samples4( Octree *volume, float ao[4], const uint32 seed[4], int num_samples, const uint8 *mat,
+	float const *ox, float const *oy, float const *oz,
+	float const *nx, float const *ny, float const *nz, float falloff, RenderStats *stats )
+{
+	enum { N = 4 * NUM_AO_SAMPLES, PADDED = N + 8 * 3 };
+	float dx[4][NUM_AO_SAMPLES], dy[4][NUM_AO_SAMPLES], dz[4][NUM_AO_SAMPLES];
+	float rox[PADDED], roy[PADDED], roz[PADDED], rdx[PADDED], rdy[PADDED], rdz[PADDED], rz[PADDED];
+	uint8 rm[PADDED], pixel[PADDED], octant[N];
+	size_t count[8] = {0}, first[8], num_rays = 0;
+	const float k = 0.01f;
+	float total[4] = {0, 0, 0, 0};
+	int u, s, o;
+	size_t r;
+	
+	#ifdef TRAVERSAL_STATS
+	TraversalStats ray_stats[4];
+	#endif
+	
+	for( u=0; u<4; u++ )
 	{
-		uint8 m;
-		float z;
-		float k = 0.01f;
+		if ( !mat[u] )
+			continue;
 		
-		z = oc_traverse(
-			volume, &m,
-			ox + k*dx[s],
-			oy + k*dy[s],
-			oz + k*dz[s],
-			dx[s], dy[s], dz[s], falloff );
+		gen_ao_dirs( dx[u], dy[u], dz[u], nx[u], ny[u], nz[u], seed[u], num_samples );
 		
-		total_z += z;
+		for( s=0; s<num_samples; s++ ) {
+			o = ( dx[u][s] < 0 ) << 2 | ( dy[u][s] < 0 ) << 1 | ( dz[u][s] < 0 );
+			octant[s*4+u] = o;
+			count[o]++;
+		}
+	}
+	
+	/* Every octant starts at a multiple of 4 so that packets never mix direction signs */
+	for( o=0, r=0; o<8; o++ ) {
+		first[o] = r;
+		r += count[o] + 3 & ~3;
+		count[o] = 0;
+	}
+	
+	/* Same sample of neighbouring pixels end up next to each other */
+	for( s=0; s<num_samples; s++ ) {
+		for( u=0; u<4; u++ )
+		{
+			if ( !mat[u] )
+				continue;
+			
+			o = octant[s*4+u];
+			r = first[o] + count[o]++;
+			rox[r] = ox[u] + k * dx[u][s];
+			roy[r] = oy[u] + k * dy[u][s];
+			roz[r] = oz[u] + k * dz[u][s];
+			rdx[r] = dx[u][s];
+			rdy[r] = dy[u][s];
+			rdz[r] = dz[u][s];
+			pixel[r] = u;
+		}
+	}
+	
+	for( o=0; o<8; o++ )
+	{
+		for( r=first[o]; r<first[o]+count[o]; r+=4 )
+		{
+			size_t left = first[o] + count[o] - r;
+			unsigned lanes = left < 4 ? ( 1u << left ) - 1 : 0xF;
+			size_t q;
+			
+			/* Unused lanes repeat the first ray */
+			for( q=left; q<4; q++ ) {
+				rox[r+q] = rox[r]; roy[r+q] = roy[r]; roz[r+q] = roz[r];
+				rdx[r+q] = rdx[r]; rdy[r+q] = rdy[r]; rdz[r+q] = rdz[r];
+			}
+			
+			#ifdef TRAVERSAL_STATS
+			memset( ray_stats, 0, sizeof( ray_stats ) );
+			oc_ray_stats = ray_stats;
+			#endif
+			
+			trace_rays4( volume, rm+r, rz+r, NULL, lanes, rox+r, roy+r, roz+r, rdx+r, rdy+r, rdz+r, falloff );
+			
+			#ifdef TRAVERSAL_STATS
+			oc_ray_stats = NULL;
+			add_traversal_stats( stats->traversal + RAY_AO, ray_stats, left < 4 ? left : 4 );
+			#endif
+			
+			for( q=0; q<4 && q<left; q++ )
+				total[pixel[r+q]] += rz[r+q];
+		}
+		num_rays += count[o];
 	}
 	
-	return total_z / ( NUM_AO_SAMPLES * falloff );
+	for( u=0; u<4; u++ )
+		ao[u] = total[u] / ( num_samples * falloff );
+	
+	stats->rays[RAY_AO] += num_rays;
+}
+
+/* Same as get_ao_samples4 but looks up the faces that the pixels see in volume->ao_cache first.
+Misses are traced from the face centres with the face normals and stored */
+static void get_ao_cached( Octree *volume, float ao[4], const uint8 *mat,
+	float const *ox, float const *oy, float const *oz,
+	float const *nx, float const *ny, float const *nz, float falloff, RenderStats *stats )
+{
+	AoCache *cache = volume->ao_cache;
+	const float cell = 1 << cache->detail_level;
+	float fox[4], foy[4], foz[4], fnx[4], fny[4], fnz[4], traced[4];
+	uint64 key[4];
+	const uint32 seed[4] = {0, 0, 0, 0}; /* Every face uses the same directions. Neighbouring faces get no noise between them and their rays form coherent packets */
+	uint8 miss[4] = {0, 0, 0, 0}; /* 1 if traced, 2+v if the face is the same as pixel v's */
+	uint8 todo[4];
+	int u, v, num_misses = 0;
+	
+	for( u=0; u<4; u++ )
+	{
+		float w[3], n[3], f[3] = {0, 0, 0};
+		int c[3], axis, k;
+		uint8 cached;
+		
+		if ( !mat[u] ) {
+			ao[u] = 1.0f;
+			continue;
+		}
+		
+		w[0] = ox[u]; w[1] = oy[u]; w[2] = oz[u];
+		n[0] = nx[u]; n[1] = ny[u]; n[2] = nz[u];
+		axis = fabsf( n[0] ) > fabsf( n[1] ) ? 0 : 1;
+		axis = fabsf( n[2] ) > fabsf( n[axis] ) ? 2 : axis;
+		f[axis] = n[axis] < 0 ? -1.0f : 1.0f;
+		
+		/* The hit point is on the face. Half a cell along the normal is the empty cell in front of it */
+		for( k=0; k<3; k++ )
+			c[k] = (int) floorf( ( w[k] + f[k] * 0.5f * cell ) / cell );
+		
+		key[u] = ao_cache_key( cache, volume, c[0], c[1], c[2], 2 * axis + ( f[axis] > 0 ) );
+		stats->ao_pixels++;
+		
+		if ( key[u] && ao_cache_get( cache, key[u], &cached ) ) {
+			ao[u] = cached * ( 1.0f / 255.0f );
+			stats->ao_cached++;
+			continue;
+		}
+		
+		/* Trace only once per face */
+		for( v=0; v<u; v++ ) {
+			if ( miss[v] && key[v] && key[v] == key[u] )
+				break;
+		}
+		if ( v < u ) {
+			miss[u] = 2 + v;
+			continue;
+		}
+		
+		fox[u] = ( c[0] + 0.5f - 0.5f * f[0] ) * cell;
+		foy[u] = ( c[1] + 0.5f - 0.5f * f[1] ) * cell;
+		foz[u] = ( c[2] + 0.5f - 0.5f * f[2] ) * cell;
+		fnx[u] = f[0];
+		fny[u] = f[1];
+		fnz[u] = f[2];
+		miss[u] = 1;
+		num_misses++;
+	}
+	
+	if ( !num_misses )
+		return;
+	
+	for( u=0; u<4; u++ )
+		todo[u] = miss[u] == 1;
+	
+	get_ao_samples4( volume, traced, seed, NUM_AO_SAMPLES, todo, fox, foy, foz, fnx, fny, fnz, falloff, stats );
+	
+	for( u=0; u<4; u++ )
+	{
+		if ( miss[u] == 1 ) {
+			ao[u] = traced[u];
+			if ( key[u] )
+				ao_cache_put( cache, key[u], (uint8)( traced[u] * 255.0f + 0.5f ) );
+		} else if ( miss[u] > 1 ) {
+			ao[u] = traced[miss[u] - 2];
+		}
+	}
+}
+
+/* Same as get_ao_samples4 but the NUM_AO_SAMPLES rays of every pixel with a material go through oc_traverse_dac as one batch */
+static void get_ao_samples_dac( Octree *volume, DacScratch *dac, float ao[4], const uint32 seed[4], const uint8 *mat,
+	float const *ox, float const *oy, float const *oz,
+	float const *nx, float const *ny, float const *nz, float falloff, RenderStats *stats )
+{
+	enum { N = 4 * NUM_AO_SAMPLES };
+	float rox[N], roy[N], roz[N], rdx[N], rdy[N], rdz[N];
+	float const *o[3], *d[3];
+	const float k = 0.01f;
+	size_t num_rays = 0;
+	int u, s;
+	
+	for( u=0; u<4; u++ )
+	{
+		float *dx = rdx + num_rays;
+		float *dy = rdy + num_rays;
+		float *dz = rdz + num_rays;
+		
+		if ( !mat[u] )
+			continue;
+		
+		gen_ao_dirs( dx, dy, dz, nx[u], ny[u], nz[u], seed[u], NUM_AO_SAMPLES );
+		
+		for( s=0; s<NUM_AO_SAMPLES; s++ ) {
+			rox[num_rays+s] = ox[u] + k*dx[s];
+			roy[num_rays+s] = oy[u] + k*dy[s];
+			roz[num_rays+s] = oz[u] + k*dz[s];
+		}
+		
+		num_rays += NUM_AO_SAMPLES;
+	}
+	
+	ao[0] = ao[1] = ao[2] = ao[3] = 0.0f;
+	
+	if ( !num_rays )
+		return;
+	
+	if ( !reserve_dac_scratch( dac, num_rays ) ) {
+		ao[0] = ao[1] = ao[2] = ao[3] = 1.0f;
+		return;
+	}
+	
+	o[0]=rox; o[1]=roy; o[2]=roz;
+	d[0]=rdx; d[1]=rdy; d[2]=rdz;
+	oc_traverse_dac( volume, dac, num_rays, o, d, dac->aux_mat, dac->aux_z, NULL, falloff );
+	
+	/* The rays of the lit pixels are packed in pixel order */
+	for( u=0, num_rays=0; u<4; u++ )
+	{
+		float total_z = 0;
+		
+		if ( !mat[u] )
+			continue;
+		
+		for( s=0; s<NUM_AO_SAMPLES; s++ )
+			total_z += dac->aux_z[num_rays+s];
+		ao[u] = total_z / ( NUM_AO_SAMPLES * falloff );
+		num_rays += NUM_AO_SAMPLES;
+	}
+	
+	stats->rays[RAY_AO] += num_rays;
+}
+
+/* Unit normals of 4 faces (see ENTRY_FACE). Bytes that aren't faces give zero vectors */
+static void face_to_normal( __m128 *nx, __m128 *ny, __m128 *nz, uint32 faces )
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i f, axis;
+	__m128 sign;
+	
+	f = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( faces ), zero ), zero );
+	axis = _mm_srli_epi32( f, 1 );
+	
+	/* -1 or 1 */
+	sign = _mm_cvtepi32_ps( _mm_sub_epi32( _mm_slli_epi32( _mm_and_si128( f, _mm_set1_epi32( 1 ) ), 1 ), _mm_set1_epi32( 1 ) ) );
+	
+	*nx = _mm_and_ps( sign, _mm_castsi128_ps( _mm_cmpeq_epi32( axis, zero ) ) );
+	*ny = _mm_and_ps( sign, _mm_castsi128_ps( _mm_cmpeq_epi32( axis, _mm_set1_epi32( 1 ) ) ) );
+	*nz = _mm_and_ps( sign, _mm_castsi128_ps( _mm_cmpeq_epi32( axis, _mm_set1_epi32( 2 ) ) ) );
+}
+
+/* Replaces the face normals of the pixels whose voxel has a normal in vn (see voxels_normals.h).
+A stored normal that doesn't point out of the face is ignored. The ray hit a side that the shape doesn't have there */
+static void apply_voxel_normals( const VoxelNormals *vn, __m128 *nx, __m128 *ny, __m128 *nz, const uint8 *mat,
+	const float *wx, const float *wy, const float *wz )
+{
+	float n[3][4];
+	int u, k, found = 0;
+	
+	_mm_storeu_ps( n[0], *nx );
+	_mm_storeu_ps( n[1], *ny );
+	_mm_storeu_ps( n[2], *nz );
+	
+	for( u=0; u<4; u++ )
+	{
+		const float w[3] = {wx[u], wy[u], wz[u]};
+		const float *v;
+		int c[3];
+		PNor p;
+		
+		if ( !mat[u] )
+			continue;
+		
+		/* The hit point is on the face. Half a voxel against the normal is inside the voxel */
+		for( k=0; k<3; k++ )
+			c[k] = (int) floorf( w[k] - 0.5f * n[k][u] );
+		
+		if ( !get_voxel_normal( vn, c[0], c[1], c[2], &p ) )
+			continue;
+		
+		v = unpacked_normals[p];
+		if ( v[0] * n[0][u] + v[1] * n[1][u] + v[2] * n[2][u] <= 0 )
+			continue;
+		
+		for( k=0; k<3; k++ )
+			n[k][u] = v[k];
+		found = 1;
+	}
+	
+	if ( found ) {
+		*nx = _mm_loadu_ps( n[0] );
+		*ny = _mm_loadu_ps( n[1] );
+		*nz = _mm_loadu_ps( n[2] );
+	}
 }
 
 /*
 Inputs:
-	wox_p, woy_p, woz_p    Ray origin
-	ray_dx, ray_dy, ray_dz  Ray direction
-	depth_p                       Ray hit depth
-Outputs:
-	render_output_n[0..2]  World space surface normals
+	x0, y0                 Screen position of the top left pixel. Seeds the AO samples
+	tlx_p, tly_p, tlz_p    Vectors to light
 	wox_p, woy_p, woz_p    World space coordinates of ray intersections (=ray origin + ray direction * depth * depth_offset)
+	mat_p, face_p          Material and ENTRY_FACE of the voxel hit by each primary ray
+	All input buffers are width*height pixels. pixel_p rows are pixel_stride apart
 Note:
-	This function alone takes about 16 ms per frame with 1 thread at 2000x1000 resolution 
+	Pixels are independent of each other. Nothing outside the tile is needed
 */
-static void shade_pixels( size_t first_row, size_t end_row,
+static void shade_pixels( size_t x0, size_t y0, size_t width, size_t height, size_t pixel_stride,
 	float *tlx_p, float *tly_p, float *tlz_p, /* vectors to light */
 	float *wox_p, float *woy_p, float *woz_p, /* world space coords */
-	uint8 const *mat_p, uint32 *pixel_p, Octree *volume )
+	uint8 const *mat_p, uint8 const *face_p, uint32 *pixel_p, Octree *volume, DacScratch *dac, RenderStats *stats )
 {
-	size_t second_last_row = end_row - 1;
 	size_t y, x;
 	const float ao_falloff = AO_FALLOFF * volume->size;
+	const int ao_samples = enable_progressive ? PROGRESSIVE_AO_SAMPLES : ao_sample_count;
+	const VoxelNormals *vn = volume->normals;
+	const int use_voxel_normals = enable_voxel_normals && vn && vn->num_chunks && unpacked_normals_ready && !oc_detail_level;
 	
-	for( y=first_row; y<second_last_row; y++ )
+	for( y=0; y<height; y++ )
 	{
-		/* previous world coords on the left with the highest slot shuffled into the lowest slot
-		Leaving these uninitialized works just fine.
-		The leftmost pixel column won't have proper normals either way
-		*/
-		__m128 lwx_suf, lwy_suf, lwz_suf;
-		
-	PROCESS_SCANLINE:
-		for( x=0; x<render_resx; x+=4 )
+		for( x=0; x<width; x+=4 )
 		{
 			uint32 mats;
-			__m128
-			wx, wy, wz, /* world position */
-			lwx, lwy, lwz, /* world position on the left */
-			bwx, bwy, bwz, /* world position below */
-			ux, uy, uz, /* vector u */
-			vx, vy, vz, /* vector v */
-			nx, ny, nz; /* normal vector */
+			__m128 nx, ny, nz; /* normal vector */
+			__m128 face_nx, face_ny, face_nz; /* AO rays must leave through the face */
 			__m128i rgb; /* pixel color */
 			__m128i sky_mask;
 			
@@ -262,45 +726,19 @@ static void shade_pixels( size_t first_row, size_t end_row,
 			}
 			else
 			{
-				/* World space coords */
-				wx = _mm_load_ps( wox_p );
-				wy = _mm_load_ps( woy_p );
-				wz = _mm_load_ps( woz_p );
-				
-				/* World space coords of the left neighbours */
-				lwx = lwx_suf;
-				lwy = lwy_suf;
-				lwz = lwz_suf;
-				lwx = _mm_move_ss( lwx_suf = _mm_shuffle_ps( wx, wx, 0x93 ), lwx );
-				lwy = _mm_move_ss( lwy_suf = _mm_shuffle_ps( wy, wy, 0x93 ), lwy );
-				lwz = _mm_move_ss( lwz_suf = _mm_shuffle_ps( wz, wz, 0x93 ), lwz );
-				
-				/* World space coords of the neighbours below */
-				bwx = _mm_load_ps( wox_p + render_resx );
-				bwy = _mm_load_ps( woy_p + render_resx );
-				bwz = _mm_load_ps( woz_p + render_resx );
-				
-				/* u = world pos - world pos on the left */
-				ux = _mm_sub_ps( wx, lwx );
-				uy = _mm_sub_ps( wy, lwy );
-				uz = _mm_sub_ps( wz, lwz );
-				
-				/* v = world pos below - world pos */
-				vx = _mm_sub_ps( bwx, wx );
-				vy = _mm_sub_ps( bwy, wy );
-				vz = _mm_sub_ps( bwz, wz );
+				face_to_normal( &face_nx, &face_ny, &face_nz, *(uint32*) face_p );
+				nx = face_nx;
+				ny = face_ny;
+				nz = face_nz;
 				
-				/* cross product: u x v */
-				nx = _mm_sub_ps( _mm_mul_ps( uy, vz ), _mm_mul_ps( uz, vy ) );
-				ny = _mm_sub_ps( _mm_mul_ps( uz, vx ), _mm_mul_ps( ux, vz ) );
-				nz = _mm_sub_ps( _mm_mul_ps( ux, vy ), _mm_mul_ps( uy, vx ) );
-				normalize_vec( &nx, &ny, &nz, nx, ny, nz );
+				if ( use_voxel_normals )
+					apply_voxel_normals( vn, &nx, &ny, &nz, mat_p, wox_p, woy_p, woz_p );
 				
 				/* Compute pixel color */
 				if ( show_normals )
-				{	
+				{
+					/* Sky is masked out below */
 					rgb = normal_to_color( nx, ny, nz );
-					rgb = _mm_andnot_si128( sky_mask, rgb );
 				}
 				else
 				{
@@ -316,14 +754,30 @@ static void shade_pixels( size_t first_row, size_t end_row,
 						if ( enable_aoccl && ENABLE_RAYCAST ) {
 							float ao[4];
 							float fnx[4], fny[4], fnz[4];
+							uint32 seed[4];
+							uint64 t0;
 							int u;
 							
-							_mm_store_ps( fnx, nx );
-							_mm_store_ps( fny, ny );
-							_mm_store_ps( fnz, nz );
-							
+							/* Every pixel has its own directions. Sorting the rays by octant keeps the packets coherent.
+							Progressive refinement picks new directions every frame */
 							for( u=0; u<4; u++ )
-								ao[u] = get_ao_samples( volume, wox_p[u], woy_p[u], woz_p[u], fnx[u], fny[u], fnz[u], ao_falloff );
+								seed[u] = hash_pixel( x0 + x + u, ( y0 + y ) ^ progressive_frame << 16 );
+							
+							t0 = get_microsec();
+							
+							_mm_store_ps( fnx, face_nx );
+							_mm_store_ps( fny, face_ny );
+							_mm_store_ps( fnz, face_nz );
+							
+							if ( enable_ao_cache && volume->ao_cache ) {
+								get_ao_cached( volume, ao, mat_p, wox_p, woy_p, woz_p, fnx, fny, fnz, ao_falloff, stats );
+							} else if ( enable_dac_method & DAC_AO ) {
+								get_ao_samples_dac( volume, dac, ao, seed, mat_p, wox_p, woy_p, woz_p, fnx, fny, fnz, ao_falloff, stats );
+							} else {
+								get_ao_samples4( volume, ao, seed, ao_samples, mat_p, wox_p, woy_p, woz_p, fnx, fny, fnz, ao_falloff, stats );
+							}
+							
+							stats->trace_time[RAY_AO] += get_microsec() - t0;
 							
 							lamb = _mm_load_ps( ao );
 							
@@ -371,31 +825,24 @@ static void shade_pixels( size_t first_row, size_t end_row,
 			
 			pixel_p += 4;
 			mat_p += 4;
+			face_p += 4;
 		}
-	}
-	
-	if ( y == second_last_row ) {
-		/* Now, the very last row. But compute deltas from the row above instead of the row below
-		because the row below belongs to some other thread whose data this thread shouldn't access
-		*/
-		wox_p -= render_resx;
-		woy_p -= render_resx;
-		woz_p -= render_resx;
-		goto PROCESS_SCANLINE;
-		/* PS. no clue why the Y component of the very last row doesn't need to be flipped */
+		
+		pixel_p += pixel_stride - width;
 	}
 }
 
 static void generate_primary_rays(
-	size_t resx,
-	size_t start_row,
-	size_t end_row,
+	size_t x0, size_t y0, /* Top left pixel. x0 must be a multiple of 4 */
+	size_t x1, size_t y1, /* Bottom right pixel + 1 */
+	int checker, /* Only the pixels where x+y+checker_parity is even, packed into rows of (x1-x0)/2 rays */
 	float *ray_ox, float *ray_oy, float *ray_oz,
 	float *ray_dx, float *ray_dy, float *ray_dz,
 	const Camera *camera,
 	float camera_pos_scale )
 {
-	float u0f, duf;
+	const size_t step = checker ? 2 : 1;
+	float duf;
 	__m128 u0, u, v, w, du, dv;
 	__m128 m0, m1, m2, m3, m4, m5, m6, m7, m8;
 	size_t r, y, x;
@@ -405,11 +852,10 @@ static void generate_primary_rays(
 	oy = _mm_set1_ps( camera->pos[1] * camera_pos_scale );
 	oz = _mm_set1_ps( camera->pos[2] * camera_pos_scale );
 	
-	u0f = screen_uv_min[0];
 	duf = screen_uv_scale[0];
-	u0 = _mm_set_ps( u0f + 3*duf, u0f + 2*duf, u0f + duf, u0f );
-	du = _mm_set1_ps( duf*4 );
-	v = _mm_set1_ps( screen_uv_min[1] + start_row * screen_uv_scale[1] );
+	u0 = _mm_set_ps( 3*step*duf, 2*step*duf, step*duf, 0 );
+	du = _mm_set1_ps( duf*4*step );
+	v = _mm_set1_ps( screen_uv_min[1] + y0 * screen_uv_scale[1] );
 	dv = _mm_set1_ps( screen_uv_scale[1] );
 	w = _mm_set1_ps( calc_raydir_z( camera ) );
 	
@@ -423,10 +869,13 @@ static void generate_primary_rays(
 	m7 = _mm_set1_ps( camera->eye_to_world[7] );
 	m8 = _mm_set1_ps( camera->eye_to_world[8] );
 	
-	for( r=0,y=start_row; y<end_row; y++ )
+	for( r=0,y=y0; y<y1; y++ )
 	{
-		u = u0;
-		for( x=0; x<resx; x+=4,r+=4 )
+		/* First pixel of the row */
+		x = checker ? x0 + ( ( y + checker_parity ) & 1 ) : x0;
+		u = _mm_add_ps( u0, _mm_set1_ps( screen_uv_min[0] + x * duf ) );
+		
+		for( x=x0; x<x1; x+=4*step,r+=4 )
 		{
 			__m128 dx, dy, dz,
 			wdx, wdy, wdz;
@@ -455,54 +904,512 @@ static void generate_primary_rays(
 	}
 }
 
-void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t end_row, float *ray_buffer )
+#ifdef TRAVERSAL_STATS
+/* Copies the number of nodes entered by each primary ray of a tile to render_output_cost */
+static void store_traversal_cost( const TraversalStats *s, size_t resx, size_t resy, size_t pixel_seek )
+{
+	uint16 *out_p = render_output_cost + pixel_seek;
+	size_t x, y;
+	
+	for( y=0; y<resy; y++,out_p+=render_resx ) {
+		for( x=0; x<resx; x++,s++ )
+			out_p[x] = s->nodes < 0xFFFF ? s->nodes : 0xFFFF;
+	}
+}
+
+/* Replaces the colors of a tile with the heatmap of render_output_cost */
+static void show_cost_heatmap( size_t resx, size_t resy, size_t pixel_seek )
+{
+	uint32 *out_p = render_output_write + pixel_seek;
+	const uint16 *cost_p = render_output_cost + pixel_seek;
+	size_t x, y;
+	
+	for( y=0; y<resy; y++,out_p+=render_resx,cost_p+=render_resx ) {
+		for( x=0; x<resx; x++ )
+			out_p[x] = heatmap_color( cost_p[x] );
+	}
+}
+#endif
+
+/* Raises the start depths of primary rays to the beam pre-pass result of their 8x8 block.
+Blocks that can't hit anything get INFINITY. Returns the number of rays in such blocks */
+static size_t beam_prepass( const Camera *camera, const Octree *volume, size_t resx, size_t resy,
+	const float *dx, const float *dy, const float *dz, float *start )
+{
+	const float *d[3];
+	float o[3];
+	float margin = 1 << oc_detail_level;
+	size_t bx, by, x, y, skipped = 0;
+	int k;
+	
+	d[0] = dx; d[1] = dy; d[2] = dz;
+	
+	for( k=0; k<3; k++ )
+		o[k] = camera->pos[k] * volume->size;
+	
+	for( by=0; by<resy; by+=BEAM_BLOCK )
+	{
+		size_t y1 = by + BEAM_BLOCK < resy ? by + BEAM_BLOCK : resy;
+		
+		for( bx=0; bx<resx; bx+=BEAM_BLOCK )
+		{
+			size_t x1 = bx + BEAM_BLOCK < resx ? bx + BEAM_BLOCK : resx;
+			float d_min[3], d_max[3], i_min[3], i_max[3];
+			float spread = 0, t;
+			
+			for( k=0; k<3; k++ ) {
+				d_min[k] = i_min[k] = INFINITY;
+				d_max[k] = i_max[k] = -INFINITY;
+			}
+			
+			for( y=by; y<y1; y++ ) {
+				for( x=bx; x<x1; x++ ) {
+					for( k=0; k<3; k++ ) {
+						float c = d[k][ y * resx + x ];
+						d_min[k] = c < d_min[k] ? c : d_min[k];
+						d_max[k] = c > d_max[k] ? c : d_max[k];
+						
+						/* A ray parallel to the axis can have any inverse. Infinities would turn into NaNs in oc_beam.c */
+						if ( fabsf( c ) < 1e-20f ) {
+							i_min[k] = -1e30f;
+							i_max[k] = 1e30f;
+						} else {
+							float i = 1.0f / c;
+							i_min[k] = i < i_min[k] ? i : i_min[k];
+							i_max[k] = i > i_max[k] ? i : i_max[k];
+						}
+					}
+				}
+			}
+			
+			for( k=0; k<3; k++ ) {
+				if ( d_max[k] - d_min[k] > spread )
+					spread = d_max[k] - d_min[k];
+			}
+			
+			t = oc_beam_min_depth( volume, o, i_min, i_max, spread );
+			
+			if ( t < INFINITY ) {
+				/* Small safety margin so that the origin never ends up inside the first voxel */
+				t = t * 0.999f - margin;
+				if ( t <= 0 )
+					continue;
+			} else {
+				skipped += ( x1 - bx ) * ( y1 - by );
+			}
+			
+			for( y=by; y<y1; y++ ) {
+				for( x=bx; x<x1; x++ ) {
+					float *p = start + y * resx + x;
+					if ( t > *p )
+						*p = t;
+				}
+			}
+		}
+	}
+	
+	return skipped;
+}
+
+/* Adds the pixels of the tile to render_accum and replaces them with the average of the frames since the last change.
+Averaging happens in linear space (THE_GAMMA_VALUE is 2). Converged tiles just get the average back */
+static void accumulate_tile( size_t x0, size_t y0, size_t x1, size_t y1 )
+{
+	const unsigned n = progressive_frame < PROGRESSIVE_MAX_FRAMES ? progressive_frame + 1 : PROGRESSIVE_MAX_FRAMES;
+	const __m128 scale = _mm_set1_ps( 1.0f / n );
+	const __m128i zero = _mm_setzero_si128();
+	size_t x, y;
+	
+	for( y=y0; y<y1; y++ )
+	{
+		uint32 *pixel_p = render_output_write + y * render_resx;
+		float *acc_p = render_accum + 4 * y * render_resx;
+		
+		for( x=x0; x<x1; x++ )
+		{
+			__m128i c;
+			__m128 v, sum;
+			
+			if ( progressive_frame < PROGRESSIVE_MAX_FRAMES )
+			{
+				c = _mm_cvtsi32_si128( pixel_p[x] );
+				c = _mm_unpacklo_epi16( _mm_unpacklo_epi8( c, zero ), zero );
+				v = _mm_cvtepi32_ps( c );
+				
+				#if ENABLE_GAMMA_CORRECTION
+				v = _mm_mul_ps( v, v );
+				#endif
+				
+				sum = progressive_frame ? _mm_add_ps( _mm_load_ps( acc_p + 4*x ), v ) : v;
+				_mm_store_ps( acc_p + 4*x, sum );
+			}
+			else
+				sum = _mm_load_ps( acc_p + 4*x );
+			
+			v = _mm_mul_ps( sum, scale );
+			
+			#if ENABLE_GAMMA_CORRECTION
+			v = _mm_sqrt_ps( v );
+			#endif
+			
+			c = _mm_cvtps_epi32( v );
+			c = _mm_packs_epi32( c, c );
+			c = _mm_packus_epi16( c, c );
+			pixel_p[x] = _mm_cvtsi128_si32( c );
+		}
+	}
+}
+
+/* Moves the values of the pixels that a checkerboard frame traces to the front, in the order of generate_primary_rays */
+static void pack_checkerboard( void *values, size_t size, size_t resx, size_t resy, size_t y0 )
+{
+	uint8 *p = values;
+	size_t x, y, r = 0;
+	
+	for( y=0; y<resy; y++ ) {
+		for( x=( y0 + y + checker_parity ) & 1; x<resx; x+=2,r++ )
+			memcpy( p + r * size, p + ( y * resx + x ) * size, size );
+	}
+}
+
+/* Inverse of pack_checkerboard. Backwards so that nothing gets overwritten before it has been moved.
+The pixels that weren't traced are zeroed */
+static void unpack_checkerboard( void *values, size_t size, size_t resx, size_t resy, size_t y0 )
+{
+	uint8 *p = values;
+	size_t x, y = resy, r = resx * resy / 2;
+	
+	while( y-- )
+	{
+		const size_t first = ( y0 + y + checker_parity ) & 1;
+		
+		x = resx;
+		while( x-- )
+		{
+			uint8 *dst = p + ( y * resx + x ) * size;
+			
+			if ( ( x & 1 ) == first )
+				memcpy( dst, p + --r * size, size );
+			else
+				memset( dst, 0, size );
+		}
+	}
+}
+
+/* Converts depth along primary ray d of pixel (x,y) to the inverse of eye space z. see generate_primary_rays.
+d is only about unit length (rsqrt) so the actual length is used */
+static float inv_eye_z( float depth, size_t x, size_t y, float w, float dx, float dy, float dz )
+{
+	float u = screen_uv_min[0] + x * screen_uv_scale[0];
+	float v = screen_uv_min[1] + y * screen_uv_scale[1];
+	return w * sqrtf( ( u*u + v*v + w*w ) / ( dx*dx + dy*dy + dz*dz ) ) / depth;
+}
+
+/* Fills the depth, material and face of the pixels that a checkerboard frame didn't trace.
+While the view stays still the last frame traced exactly these pixels.
+Otherwise each traced neighbour extends its surface by one pixel. 1/z is linear across a plane in screen space,
+so 2 traced pixels in a row give the plane's value at the missing one. The face comes from the same neighbour.
+Where the left and right (or up and down) planes disagree, the change of slope tells which one is in front.
+Across a large gap the plane closer to the reprojected depth wins.
+The rays must be the ones of every pixel again. inv_z is scratch for one float per pixel */
+static void fill_checkerboard( const Camera *camera, float *depth, uint8 *mat, uint8 *face, float *inv_z,
+	const float *ray_dx, const float *ray_dy, const float *ray_dz, size_t x0, size_t y0, size_t resx, size_t resy )
+{
+	static const int dirs[4][2] = {{-1,0}, {1,0}, {0,-1}, {0,1}}; /* left, right, up, down */
+	const float w = calc_raydir_z( camera );
+	const uint8 mat_mask = enable_shadows ? ~0x20 : 0xFF; /* The shadow bit set by calc_shadow_mat */
+	size_t x, y;
+	
+	if ( !view_unchanged )
+	{
+		for( y=0; y<resy; y++ ) {
+			for( x=( y0 + y + checker_parity ) & 1; x<resx; x+=2 ) {
+				const size_t p = y * resx + x;
+				inv_z[p] = mat[p] ? inv_eye_z( depth[p], x0 + x, y0 + y, w, ray_dx[p], ray_dy[p], ray_dz[p] ) : 0;
+			}
+		}
+	}
+	
+	for( y=0; y<resy; y++ )
+	{
+		for( x=( y0 + y + checker_parity + 1 ) & 1; x<resx; x+=2 )
+		{
+			const size_t p = y * resx + x;
+			float ext[4], slope[4], reproj, scale, best_q = 0;
+			int k, best = -1, best_pair = -1;
+			float best_gap = INFINITY;
+			
+			if ( view_unchanged ) {
+				const size_t q = ( y0 + y ) * render_resx + x0 + x;
+				mat[p] = render_last_m[q] & mat_mask;
+				depth[p] = render_last_z[q];
+				face[p] = render_last_face[q];
+				continue;
+			}
+			
+			/* Each neighbour's plane extended to this pixel. 0 if there's no neighbour or it's sky */
+			for( k=0; k<4; k++ )
+			{
+				const long x1 = x + dirs[k][0], y1 = y + dirs[k][1];
+				const long x3 = x + 3 * dirs[k][0], y3 = y + 3 * dirs[k][1];
+				
+				ext[k] = slope[k] = 0;
+				
+				if ( x1 < 0 || y1 < 0 || x1 >= (long) resx || y1 >= (long) resy || !inv_z[ y1 * resx + x1 ] )
+					continue;
+				
+				ext[k] = inv_z[ y1 * resx + x1 ];
+				
+				/* Without a second pixel inside the tile the surface is assumed to face the camera */
+				if ( x3 >= 0 && y3 >= 0 && x3 < (long) resx && y3 < (long) resy && inv_z[ y3 * resx + x3 ] ) {
+					slope[k] = 0.5f * ( ext[k] - inv_z[ y3 * resx + x3 ] );
+					ext[k] += slope[k];
+				}
+			}
+			
+			/* The pair whose planes agree best */
+			for( k=0; k<4; k+=2 ) {
+				if ( ext[k] > 0 && ext[k+1] > 0 ) {
+					float gap = fabsf( ext[k] - ext[k+1] ) / ( ext[k] + ext[k+1] );
+					if ( gap < best_gap ) {
+						best_gap = gap;
+						best_pair = k;
+					}
+				}
+			}
+			
+			reproj = enable_reprojection ? render_reproj_z[ ( y0 + y ) * render_resx + x0 + x ] : 0;
+			scale = inv_eye_z( 1, x0 + x, y0 + y, w, ray_dx[p], ray_dy[p], ray_dz[p] ); /* depth * inverse z */
+			
+			if ( best_pair >= 0 && !( best_gap > CHECKER_MAX_STEP && reproj ) )
+			{
+				/* Slopes are towards this pixel. If the slope decreases across it (in the direction of k+1),
+				the planes form a convex edge and the surface is the plane that is further away (smaller inverse) */
+				k = best_pair;
+				if ( -slope[k+1] < slope[k] )
+					best = ext[k] < ext[k+1] ? k : k+1;
+				else
+					best = ext[k] > ext[k+1] ? k : k+1;
+			}
+			else
+			{
+				/* An edge or a lone neighbour. Prefer the one that agrees with the reprojected depth, the nearest one without it */
+				const float reproj_q = reproj ? scale / reproj : 0;
+				
+				for( k=0; k<4; k++ ) {
+					if ( ext[k] > 0 && ( best < 0
+						|| ( reproj_q ? fabsf( ext[k] - reproj_q ) < fabsf( best_q - reproj_q ) : ext[k] > best_q ) ) ) {
+						best = k;
+						best_q = ext[k];
+					}
+				}
+			}
+			
+			if ( best < 0 ) {
+				/* Surrounded by sky */
+				mat[p] = 0;
+				depth[p] = INFINITY;
+			} else {
+				const size_t q = p + dirs[best][1] * (long) resx + dirs[best][0];
+				mat[p] = mat[q];
+				face[p] = face[q];
+				depth[p] = scale / ext[best];
+			}
+		}
+	}
+}
+
+void render_tile( const Camera *camera, Octree *volume, size_t x0, size_t y0, size_t x1, size_t y1, float *tile_buffer, DacScratch *dac, RenderStats *stats, ProfRing *prof )
 {
 	float *ray_ox, *ray_oy, *ray_oz, *ray_dx, *ray_dy, *ray_dz;
 	
-	size_t r;
-	size_t resx = render_resx;
-	size_t resy = end_row - start_row;
+	size_t r, y;
+	size_t resx = x1 - x0;
+	size_t resy = y1 - y0;
 	size_t num_rays;
+	size_t num_traced; /* primary rays. Half of num_rays with checkerboard rendering */
 	size_t pixel_seek;
+	const int checker = enable_checkerboard;
 	
 	float *depth_p0;
+	float *start_p0; /* start depth of primary rays. INFINITY if the beam pre-pass found nothing */
+	size_t num_reprojected = 0;
+	size_t num_skipped = 0;
+	int use_start;
 	uint8 *mat_p0;
+	uint8 *face_p0; /* ENTRY_FACE of the primary ray hits */
+	
+	uint64 t_start, t_shade, t_end;
+	uint64 ao_time = stats->trace_time[RAY_AO];
 	
+	#ifdef TRAVERSAL_STATS
+	/* Counters of the primary rays and later the shadow rays of this tile */
+	TraversalStats ray_stats[RENDER_TILE_W*RENDER_TILE_H];
+	#endif
+	
+	/* Everything is stored contiguously for the tile and copied to the frame buffers at the end */
 	num_rays = resx * resy;
-	ray_ox = ray_buffer;
+	ray_ox = tile_buffer;
 	ray_oy = ray_ox + num_rays;
 	ray_oz = ray_oy + num_rays;
 	ray_dx = ray_oz + num_rays;
 	ray_dy = ray_dx + num_rays;
 	ray_dz = ray_dy + num_rays;
+	depth_p0 = ray_dz + num_rays;
+	start_p0 = depth_p0 + num_rays;
+	mat_p0 = (uint8*)( start_p0 + num_rays );
+	face_p0 = mat_p0 + num_rays;
+	
+	/* Top left pixel of the tile */
+	pixel_seek = y0 * render_resx + x0;
+	
+	t_start = get_microsec();
+	
+	/* With checkerboard rendering the primary rays and their start depths are packed into rows of resx/2 until fill_checkerboard */
+	num_traced = checker ? num_rays / 2 : num_rays;
+	generate_primary_rays( x0, y0, x1, y1, checker, ray_ox, ray_oy, ray_oz, ray_dx, ray_dy, ray_dz, camera, volume->size );
+	
+	if ( enable_reprojection )
+	{
+		num_reprojected = get_reprojected_depth( start_p0, x0, y0, x1, y1 );
+		
+		if ( checker && num_reprojected ) {
+			pack_checkerboard( start_p0, sizeof( start_p0[0] ), resx, resy, y0 );
+			for( num_reprojected=0,r=0; r<num_traced; r++ )
+				num_reprojected += start_p0[r] > 0;
+		}
+	}
+	else if ( enable_beam_prepass )
+		memset( start_p0, 0, num_traced * sizeof( start_p0[0] ) );
+	
+	if ( enable_beam_prepass )
+	{
+		num_skipped = beam_prepass( camera, volume, checker ? resx / 2 : resx, resy, ray_dx, ray_dy, ray_dz, start_p0 );
+		
+		/* oc_traverse_dac takes all rays of the tile. Empty blocks get culled there quickly anyway */
+		if ( num_skipped && ( enable_dac_method & DAC_PRIMARY ) ) {
+			for( r=0; r<num_traced; r++ ) {
+				if ( !( start_p0[r] < INFINITY ) )
+					start_p0[r] = 0;
+			}
+			num_skipped = 0;
+		}
+	}
 	
-	/* Initialize pixel pointers */
-	pixel_seek = start_row * render_resx;
-	mat_p0 = render_output_m + pixel_seek;
-	depth_p0 = render_output_z + pixel_seek;
+	use_start = num_reprojected || enable_beam_prepass;
 	
-	generate_primary_rays( resx, start_row, end_row, ray_ox, ray_oy, ray_oz, ray_dx, ray_dy, ray_dz, camera, volume->size );
+	/* Move the origins forward. Depth gets corrected after tracing */
+	if ( use_start ) {
+		for( r=0; r<num_traced; r++ ) {
+			if ( start_p0[r] < INFINITY ) {
+				ray_ox[r] += ray_dx[r] * start_p0[r];
+				ray_oy[r] += ray_dy[r] * start_p0[r];
+				ray_oz[r] += ray_dz[r] * start_p0[r];
+			}
+		}
+	}
+	
+	t_shade = get_microsec();
+	stats->stage_time[STAGE_RAYGEN] += t_shade - t_start;
+	prof_event( prof, STAGE_RAYGEN, t_start, t_shade, 0 );
 	
 	if ( ENABLE_RAYCAST ) {
+		uint64 t0 = t_shade;
+		
+		#ifdef TRAVERSAL_STATS
+		memset( ray_stats, 0, sizeof( ray_stats[0] ) * num_traced );
+		oc_ray_stats = ray_stats;
+		#endif
+		
 		/* Trace primary rays */
-		if ( use_dac_method )
+		if ( enable_dac_method & DAC_PRIMARY )
 		{
 			const float *o[3], *d[3];
 			o[0]=ray_ox; o[1]=ray_oy; o[2]=ray_oz;
 			d[0]=ray_dx; d[1]=ray_dy; d[2]=ray_dz;
-			oc_traverse_dac( volume, num_rays, o, d, mat_p0, depth_p0 );
+			oc_traverse_dac( volume, dac, num_traced, o, d, mat_p0, depth_p0, face_p0, INFINITY );
 		} else {
-			for( r=0; r<num_rays; r++ )
+			for( r=0; r<num_traced; r+=4 )
 			{
-				depth_p0[r] =  oc_traverse(
-				volume, mat_p0+r,
-				ray_ox[r], ray_oy[r], ray_oz[r],
-				ray_dx[r], ray_dy[r], ray_dz[r], INFINITY );
+				unsigned lanes = 0xF;
+				int k;
+				
+				if ( num_skipped ) {
+					for( k=0; k<4; k++ ) {
+						if ( !( start_p0[r+k] < INFINITY ) ) {
+							lanes &= ~( 1 << k );
+							mat_p0[r+k] = 0;
+							depth_p0[r+k] = INFINITY;
+						}
+					}
+					if ( !lanes )
+						continue;
+				}
+				
+				#ifdef TRAVERSAL_STATS
+				oc_ray_stats = ray_stats + r;
+				#endif
+				
+				trace_rays4( volume, mat_p0+r, depth_p0+r, face_p0+r, lanes,
+				ray_ox+r, ray_oy+r, ray_oz+r,
+				ray_dx+r, ray_dy+r, ray_dz+r, INFINITY );
 			}
 		}
+		
+		if ( use_start )
+		{
+			float ox = camera->pos[0] * volume->size;
+			float oy = camera->pos[1] * volume->size;
+			float oz = camera->pos[2] * volume->size;
+			
+			for( r=0; r<num_traced; r++ ) {
+				if ( start_p0[r] < INFINITY )
+					depth_p0[r] += start_p0[r];
+				ray_ox[r] = ox;
+				ray_oy[r] = oy;
+				ray_oz[r] = oz;
+			}
+			
+			stats->reprojected += num_reprojected;
+			stats->beam_skipped += num_skipped;
+		}
+		
+		t_shade = get_microsec();
+		
+		#ifdef TRAVERSAL_STATS
+		oc_ray_stats = NULL;
+		add_traversal_stats( stats->traversal + RAY_PRIMARY, ray_stats, num_traced );
+		if ( checker )
+			unpack_checkerboard( ray_stats, sizeof( ray_stats[0] ), resx, resy, y0 );
+		store_traversal_cost( ray_stats, resx, resy, pixel_seek );
+		#endif
+		
+		stats->rays[RAY_PRIMARY] += num_traced;
+		stats->trace_time[RAY_PRIMARY] += t_shade - t0;
+		stats->stage_time[STAGE_PRIMARY] += t_shade - t0;
+		prof_event( prof, STAGE_PRIMARY, t0, t_shade, 0 );
 	}
 	
-	if ( !( enable_shadows || enable_phong || show_normals ) )
+	if ( checker )
+	{
+		/* Back to one ray per pixel for shadows and shading. Counted as ray generation */
+		unpack_checkerboard( depth_p0, sizeof( depth_p0[0] ), resx, resy, y0 );
+		unpack_checkerboard( mat_p0, sizeof( mat_p0[0] ), resx, resy, y0 );
+		unpack_checkerboard( face_p0, sizeof( face_p0[0] ), resx, resy, y0 );
+		generate_primary_rays( x0, y0, x1, y1, 0, ray_ox, ray_oy, ray_oz, ray_dx, ray_dy, ray_dz, camera, volume->size );
+		fill_checkerboard( camera, depth_p0, mat_p0, face_p0, start_p0, ray_dx, ray_dy, ray_dz, x0, y0, resx, resy );
+		
+		t_end = get_microsec();
+		stats->stage_time[STAGE_RAYGEN] += t_end - t_shade;
+		prof_event( prof, STAGE_RAYGEN, t_shade, t_end, 0 );
+		t_shade = t_end;
+	}
+	
+	if ( enable_progressive && progressive_frame >= PROGRESSIVE_MAX_FRAMES )
+	{
+		/* Converged. accumulate_tile puts the final image back */
+	}
+	else if ( !( enable_shadows || enable_phong || show_normals ) )
 	{
 		uint32 *out_p = render_output_write + pixel_seek;
 		
@@ -511,33 +1418,44 @@ void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t
 			__m128 conv = _mm_set1_ps( 255.0f / volume->size );
 			__m128 byte = _mm_set1_ps( 255.0f );
 			
-			for( r=0; r<num_rays; r+=4 )
+			for( r=0,y=0; y<resy; y++,out_p+=render_resx )
 			{
-				__m128 z;
-				__m128i c;
-				
-				z = _mm_load_ps( depth_p0+r );
-				z = _mm_mul_ps( z, conv );
-				z = _mm_min_ps( z, byte );
-				
-				c = _mm_cvtps_epi32( z );
-				c = _mm_or_si128(
-				_mm_or_si128( c, _mm_slli_si128( c, 1 ) ),
-				_mm_or_si128( c, _mm_slli_si128( c, 2 ) ) );
-				
-				_mm_store_si128( (void*)( out_p+r ), c );
+				size_t x;
+				for( x=0; x<resx; x+=4,r+=4 )
+				{
+					__m128 z;
+					__m128i c;
+					
+					z = _mm_load_ps( depth_p0+r );
+					z = _mm_mul_ps( z, conv );
+					z = _mm_min_ps( z, byte );
+					
+					c = _mm_cvtps_epi32( z );
+					c = _mm_or_si128(
+					_mm_or_si128( c, _mm_slli_si128( c, 1 ) ),
+					_mm_or_si128( c, _mm_slli_si128( c, 2 ) ) );
+					
+					_mm_store_si128( (void*)( out_p+x ), c );
+				}
 			}
 		}
 		else
 		{
 			/* Just put the material color to screen */
-			for( r=0; r<num_rays; r++ )
-				out_p[r] = materials_rgb[mat_p0[r]];
+			for( r=0,y=0; y<resy; y++,out_p+=render_resx )
+			{
+				size_t x;
+				for( x=0; x<resx; x++,r++ )
+					out_p[x] = materials_rgb[mat_p0[r]];
+			}
 		}
 	}
 	else
 	{
 		__m128 lx, ly, lz, depth_offset;
+		__m128i rng;
+		uint64 t_shadow = t_shade;
+		const int soft_shadows = enable_progressive && enable_shadows;
 		
 		/* Light origin */
 		lx = _mm_load_ps( light_x );
@@ -547,6 +1465,10 @@ void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t
 		/* Prevents self-occlusion problem with shadows */
 		depth_offset = _mm_set1_ps( 0.001f / 512.0 * ( 1 << volume->root_level ) );
 		
+		/* Light jitter of soft shadows */
+		rng = _mm_xor_si128( _mm_set1_epi32( hash_pixel( x0, y0 ^ progressive_frame << 16 ) ),
+			_mm_set_epi32( 0x2545F491, 0x4F6CDD1D, 0x1B873593, 0x68E31DA4 ) );
+		
 		/* Generate shadow rays */
 		for( r=0; r<num_rays; r+=4 )
 		{
@@ -578,6 +1500,17 @@ void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t
 			dx = _mm_sub_ps( lx, wx );
 			dy = _mm_sub_ps( ly, wy );
 			dz = _mm_sub_ps( lz, wz );
+			
+			if ( soft_shadows )
+			{
+				/* Different point of a small cubical light every frame */
+				const __m128 spread = _mm_set1_ps( SOFT_SHADOW_SPREAD );
+				normalize_vec( &dx, &dy, &dz, dx, dy, dz );
+				dx = _mm_add_ps( dx, _mm_mul_ps( mm_rand( &rng ), spread ) );
+				dy = _mm_add_ps( dy, _mm_mul_ps( mm_rand( &rng ), spread ) );
+				dz = _mm_add_ps( dz, _mm_mul_ps( mm_rand( &rng ), spread ) );
+			}
+			
 			normalize_vec( ray_dx+r, ray_dy+r, ray_dz+r, dx, dy, dz );
 		}
 		
@@ -585,22 +1518,32 @@ void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t
 		{
 			static const uint32 stored_shade_bits[] = {0x20202020, 0x20202020, 0x20202020, 0x20202020};
 			__m128i shade_bits;
+			uint64 t0 = get_microsec();
+			
+			/* Shadow ray setup above counts as part of the shadow stage */
 			
 			shade_bits = _mm_load_si128( (void*) stored_shade_bits );
 			
-			if ( enable_dac_method )
+			/* the sky doesn't receive shadows */
+			for( r=0; r<num_rays; r++ )
+				stats->rays[RAY_SHADOW] += ( mat_p0[r] != 0 );
+			
+			#ifdef TRAVERSAL_STATS
+			memset( ray_stats, 0, sizeof( ray_stats[0] ) * num_rays );
+			oc_ray_stats = ray_stats;
+			#endif
+			
+			if ( ( enable_dac_method & DAC_SHADOW ) && reserve_dac_scratch( dac, num_rays ) )
 			{
 				const float *o[3], *d[3];
-				__m128i *shadow_buf = aligned_alloc( 16, num_rays );
 				
+				/* Sky pixels have infinite origins. Those rays miss everything */
 				o[0]=ray_ox; o[1]=ray_oy; o[2]=ray_oz;
 				d[0]=ray_dx; d[1]=ray_dy; d[2]=ray_dz;
-				oc_traverse_dac( volume, num_rays, o, d, (uint8*) shadow_buf, (float*) depth_p0 );
+				oc_traverse_dac( volume, dac, num_rays, o, d, dac->aux_mat, dac->aux_z, NULL, NAN );
 				
 				for( r=0; r<num_rays; r+=16 )
-					calc_shadow_mat( mat_p0+r, shadow_buf+r, shade_bits );
-				
-				free( shadow_buf );
+					calc_shadow_mat( mat_p0+r, dac->aux_mat+r, shade_bits );
 			}
 			else
 			{
@@ -608,29 +1551,219 @@ void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t
 				for( r=0; r<num_rays; r+=16 )
 				{
 					uint8 shadow_m[16] = {0};
+					float shadow_z[4];
 					int s;
 					
-					for( s=0; s<16; s++ )
+					for( s=0; s<16; s+=4 )
 					{
 						int k = r + s;
+						unsigned lanes = 0;
+						int u;
 						
-						if ( mat_p0[k] == 0 )
-							continue; /* the sky doesn't receive shadows */
+						/* the sky doesn't receive shadows */
+						for( u=0; u<4; u++ )
+							lanes |= ( mat_p0[k+u] != 0 ) << u;
 						
-						oc_traverse(
-						volume, shadow_m+s,
-						ray_ox[k], ray_oy[k], ray_oz[k],
-						ray_dx[k], ray_dy[k], ray_dz[k], NAN );
+						if ( lanes )
+						{
+							#ifdef TRAVERSAL_STATS
+							oc_ray_stats = ray_stats + k;
+							#endif
+							
+							trace_rays4( volume, shadow_m+s, shadow_z, NULL, lanes,
+							ray_ox+k, ray_oy+k, ray_oz+k,
+							ray_dx+k, ray_dy+k, ray_dz+k, NAN );
+						}
 					}
 					
 					calc_shadow_mat( mat_p0+r, shadow_m, shade_bits );
 				}
 			}
+			
+			#ifdef TRAVERSAL_STATS
+			oc_ray_stats = NULL;
+			add_traversal_stats( stats->traversal + RAY_SHADOW, ray_stats, num_rays );
+			#endif
+			
+			t_shade = get_microsec();
+			stats->trace_time[RAY_SHADOW] += t_shade - t0;
+			stats->stage_time[STAGE_SHADOW] += t_shade - t_shadow;
+			prof_event( prof, STAGE_SHADOW, t_shadow, t_shade, 0 );
 		}
 		
-		shade_pixels( start_row, end_row,
+		shade_pixels( x0, y0, resx, resy, render_resx,
 		ray_dx, ray_dy, ray_dz, /* vectors to light */
 		ray_ox, ray_oy, ray_oz, /* world space coords */
-		mat_p0, render_output_write+pixel_seek, volume );
+		mat_p0, face_p0, render_output_write+pixel_seek, volume, dac, stats );
+	}
+	
+	if ( enable_progressive )
+		accumulate_tile( x0, y0, x1, y1 );
+	
+	#ifdef TRAVERSAL_STATS
+	if ( show_traversal_cost )
+		show_cost_heatmap( resx, resy, pixel_seek );
+	#endif
+	
+	/* Copy materials, depth and faces to the frame buffers */
+	for( y=0; y<resy; y++ )
+	{
+		memcpy( render_output_m + pixel_seek + y * render_resx, mat_p0 + y * resx, resx );
+		memcpy( render_output_face + pixel_seek + y * render_resx, face_p0 + y * resx, resx );
+		memcpy( render_output_z + pixel_seek + y * render_resx, depth_p0 + y * resx, resx * sizeof( float ) );
+	}
+	
+	/* AO rays are traced from shade_pixels. Their time is kept separate from shading */
+	t_end = get_microsec();
+	ao_time = stats->trace_time[RAY_AO] - ao_time;
+	stats->stage_time[STAGE_AO] += ao_time;
+	stats->stage_time[STAGE_SHADE] += t_end - t_shade - ao_time;
+	prof_event( prof, STAGE_SHADE, t_shade, t_end, ao_time );
+}
+
+/* Traces the batch with oc_traverse_dac or 4 rays at a time with the selected per-ray traversal. Returns microseconds */
+static uint64 time_traversal( Octree *volume, DacScratch *dac, int use_dac, size_t n,
+	float const *o[3], float const *d[3], uint8 *out_m, float *out_z, float max_ray_depth )
+{
+	uint64 t = get_microsec();
+	size_t r;
+	
+	if ( use_dac )
+		oc_traverse_dac( volume, dac, n, o, d, out_m, out_z, NULL, max_ray_depth );
+	else
+	{
+		for( r=0; r<n; r+=4 )
+			trace_rays4( volume, out_m+r, out_z+r, NULL, 0xF, o[0]+r, o[1]+r, o[2]+r, d[0]+r, d[1]+r, d[2]+r, max_ray_depth );
+	}
+	
+	return get_microsec() - t;
+}
+
+void benchmark_ray_types( const Camera *camera, Octree *volume )
+{
+	static const char *type_names[3] = {"primary", "shadow", "AO"};
+	const size_t n = render_resx * render_resy;
+	const float depth_offset = 0.001f / 512.0 * ( 1 << volume->root_level );
+	const float ao_falloff = AO_FALLOFF * volume->size;
+	float *mem, *prim_o[3], *prim_d[3], *hit[3], *ray_o[3], *ray_d[3], *out_z[2];
+	uint8 *out_m[2];
+	DacScratch dac = {0};
+	size_t num_hits = 0, num_rays = 0, r;
+	int type, k;
+	
+	if ( !n )
+		return;
+	
+	mem = aligned_alloc( 16, sizeof(float) * n * 17 );
+	out_m[0] = aligned_alloc( 16, n * 2 );
+	if ( !mem || !out_m[0] ) {
+		printf( "Error: failed to allocate benchmark buffers\n" );
+		free( mem );
+		free( out_m[0] );
+		return;
+	}
+	
+	for( k=0; k<3; k++ ) {
+		prim_o[k] = mem + k * n;
+		prim_d[k] = mem + ( 3 + k ) * n;
+		hit[k] = mem + ( 6 + k ) * n;
+		ray_o[k] = mem + ( 9 + k ) * n;
+		ray_d[k] = mem + ( 12 + k ) * n;
+	}
+	out_z[0] = mem + 15 * n;
+	out_z[1] = mem + 16 * n;
+	out_m[1] = out_m[0] + n;
+	
+	prepare_volume( volume );
+	generate_primary_rays( 0, 0, render_resx, render_resy, 0, prim_o[0], prim_o[1], prim_o[2], prim_d[0], prim_d[1], prim_d[2], camera, volume->size );
+	
+	printf( "Ray type | rays      | %-9s M rays/s | DAC M rays/s | mismatches\n", TRAVERSAL_METHOD_NAMES[traversal_method] );
+	
+	for( type=0; type<3; type++ )
+	{
+		float const *o[3], *d[3];
+		float max_depth = INFINITY;
+		uint64 t[2];
+		size_t mismatches = 0;
+		int use_dac;
+		
+		if ( type == 0 )
+		{
+			num_rays = n;
+			for( k=0; k<3; k++ ) {
+				o[k] = prim_o[k];
+				d[k] = prim_d[k];
+			}
+		}
+		else if ( type == 1 )
+		{
+			/* Hit points towards the light */
+			for( r=0; r<num_hits; r++ ) {
+				float v[3];
+				for( k=0; k<3; k++ ) {
+					ray_o[k][r] = hit[k][r];
+					v[k] = ( k == 0 ? light_x[0] : k == 1 ? light_y[0] : light_z[0] ) - hit[k][r];
+				}
+				normalize( v );
+				for( k=0; k<3; k++ )
+					ray_d[k][r] = v[k];
+			}
+			num_rays = num_hits & ~3;
+			max_depth = NAN;
+		}
+		else
+		{
+			/* Short rays from every NUM_AO_SAMPLES'th hit point. Hemispheres face the camera */
+			num_rays = 0;
+			for( r=0; r+NUM_AO_SAMPLES<=num_hits; r+=NUM_AO_SAMPLES )
+			{
+				float *dx = ray_d[0] + num_rays, *dy = ray_d[1] + num_rays, *dz = ray_d[2] + num_rays;
+				int s;
+				
+				gen_ao_dirs( dx, dy, dz, -prim_d[0][r], -prim_d[1][r], -prim_d[2][r], hash_pixel( r, 0 ), NUM_AO_SAMPLES );
+				
+				for( s=0; s<NUM_AO_SAMPLES; s++, num_rays++ ) {
+					ray_o[0][num_rays] = hit[0][r] + 0.01f * dx[s];
+					ray_o[1][num_rays] = hit[1][r] + 0.01f * dy[s];
+					ray_o[2][num_rays] = hit[2][r] + 0.01f * dz[s];
+				}
+			}
+			max_depth = ao_falloff;
+		}
+		
+		if ( type != 0 ) {
+			for( k=0; k<3; k++ ) {
+				o[k] = ray_o[k];
+				d[k] = ray_d[k];
+			}
+		}
+		
+		for( use_dac=0; use_dac<2; use_dac++ )
+			t[use_dac] = time_traversal( volume, &dac, use_dac, num_rays, o, d, out_m[use_dac], out_z[use_dac], max_depth );
+		
+		for( r=0; r<num_rays; r++ )
+			mismatches += ( out_m[0][r] != 0 ) != ( out_m[1][r] != 0 );
+		
+		printf( "%-8s | %9u | %18.2f | %12.2f | %u\n", type_names[type], (unsigned) num_rays,
+			num_rays / (double) ( t[0] + 1 ), num_rays / (double) ( t[1] + 1 ), (unsigned) mismatches );
+		
+		if ( type == 0 )
+		{
+			/* Remember primary hit points (and their directions for AO) */
+			for( r=0; r<n; r++ )
+			{
+				if ( !out_m[0][r] )
+					continue;
+				for( k=0; k<3; k++ ) {
+					hit[k][num_hits] = prim_o[k][r] + prim_d[k][r] * ( out_z[0][r] - depth_offset );
+					prim_d[k][num_hits] = prim_d[k][r];
+				}
+				num_hits++;
+			}
+		}
 	}
+	
+	free_dac_scratch( &dac );
+	free( out_m[0] );
+	free( mem );
 }
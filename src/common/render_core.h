@@ -16,9 +16,35 @@
 
 extern int show_normals;
 extern int show_depth_buffer;
+extern int show_traversal_cost; /* Heatmap of nodes entered per primary ray. Needs a TRAVERSAL_STATS build */
 extern int enable_shadows;
 extern int show_normals;
 extern int enable_phong;
+extern int enable_aoccl; /* 0=off, 1=on, 2=show ambient occlusion only */
+extern int enable_ao_cache; /* Reuse the AO of voxel faces between frames. see voxels_aocache.h */
+extern int ao_sample_count; /* AO rays per pixel. Multiple of 4, at most NUM_AO_SAMPLES. The AO cache and DAC always use NUM_AO_SAMPLES */
+extern int enable_dac_method; /* Bitmask of DAC_* ray types that are traced with oc_traverse_dac */
+extern int enable_voxel_normals; /* Light with the normals stored in volume->normals (see voxels_normals.h). Full detail only */
+
+enum {
+	DAC_PRIMARY=1,
+	DAC_SHADOW=2,
+	DAC_AO=4,
+	DAC_ALL=7
+};
+
+/* Traversal used for primary, shadow and AO rays */
+enum {
+	TRAVERSE_RECURSIVE=0, /* oc_traverse */
+	TRAVERSE_ITERATIVE, /* oc_traverse_iter */
+	TRAVERSE_PACKET, /* oc_traverse_packet4 for primary, shadow and AO rays. oc_traverse for divergent packets */
+	TRAVERSE_COMPACT, /* oc_traverse_compact. Builds volume->compact when needed */
+	TRAVERSE_DAG, /* oc_traverse_compact with identical subtrees merged */
+	TRAVERSE_GRID, /* oc_traverse_grid. Builds volume->dist when needed */
+	NUM_TRAVERSAL_METHODS
+};
+extern int traversal_method;
+extern const char *TRAVERSAL_METHOD_NAMES[NUM_TRAVERSAL_METHODS];
 
 extern uint32 materials_rgb[NUM_MATERIALS]; /* rgb colors (any pixel format is ok) */
 extern float materials_diff[NUM_MATERIALS][4]; /* rgb diffuse reflection constants. last component is padding */
@@ -26,33 +52,124 @@ extern float materials_spec[NUM_MATERIALS][4]; /* rgb specular color & exponent
 
 extern float calc_raydir_z( const Camera * );
 extern float screen_uv_min[2];
+extern float screen_uv_scale[2]; /* eye space direction of pixel (x,y) is ( screen_uv_min + (x,y) * screen_uv_scale, calc_raydir_z ) */
 
 void set_light_pos( float x, float y, float z );
 
-/* (Re)allocates memory. Restarts render threads */
+/* Changes the resolution. Memory is only reallocated when the buffers have to grow. The render threads keep running.
+Call between frames */
 void resize_render_output( int w, int h );
 
+/* Renders at a lower resolution without ever reallocating. Call between frames.
+w is rounded down to a multiple of 16. Returns 0 if w x h doesn't fit in what resize_render_output allocated */
+int set_render_resolution( int w, int h );
+
 /* Computes origin & direction of one primary ray. (x,y) are pixel coordinates */
 void get_primary_ray( Ray *ray, const Camera *c, const Octree *volume, int x, int y );
 
-/* Used by render_threads.c */
-#define RENDER_THREAD_MEM_PER_PIXEL (6*sizeof(float)) /* <- ray_buffer gets allocated based on this value */
-void render_part( const Camera *camera, Octree *volume, size_t start_row, size_t end_row, float *ray_buffer );
-
-/* Makes render_output_rgba point to the last frame. The next frame will be rendered into another buffer */
+/* Used by render_threads.c. The frame is split into tiles of at most RENDER_TILE_W x RENDER_TILE_H pixels.
+Tiles on the right edge can be narrower but their width is still a multiple of 16 */
+#define RENDER_TILE_W 32
+#define RENDER_TILE_H 32
+#define RENDER_THREAD_MEM_PER_PIXEL (8*sizeof(float)+2) /* <- tile_buffer gets allocated based on this value */
+struct DacScratch;
+struct RenderStats;
+struct ProfRing;
+void render_tile( const Camera *camera, Octree *volume, size_t x0, size_t y0, size_t x1, size_t y1, float *tile_buffer,
+	struct DacScratch *dac, struct RenderStats *stats, struct ProfRing *prof );
+
+/* Called by begin_volume_rendering before the render threads are woken up. Updates data derived from the volume */
+void prepare_volume( Octree *volume );
+
+/* Temporal reprojection. Primary rays start near where the previous frame's hits reproject to. see reproject.c */
+extern int enable_reprojection;
+void invalidate_reprojection( void ); /* Drops the previous frame. Resizing, LOD, volume changes and edits (through the revision) are noticed automatically */
+void reproject_frame( const Camera *camera, const Octree *volume ); /* Called by begin_volume_rendering. Fills render_reproj_z */
+size_t get_reprojected_depth( float *out, size_t x0, size_t y0, size_t x1, size_t y1 ); /* Start depths of a tile (0=from the camera). Returns how many are nonzero */
+
+/* Progressive refinement. While nothing in the view changes, every frame traces a few new AO samples
+and a jittered shadow ray per pixel and the frames are averaged in render_accum */
+#define PROGRESSIVE_AO_SAMPLES 4 /* per pixel and frame. must be a multiple of 4 */
+#define PROGRESSIVE_MAX_FRAMES 256 /* The image is final after this many frames. Only primary rays are traced after that */
+#define SOFT_SHADOW_SPREAD 0.02f /* Size of the light seen from the scene (radians). Shadows are hard without progressive refinement */
+extern int enable_progressive;
+extern unsigned progressive_frame; /* Frames since the last change. 0 when the accumulation starts over */
+void reset_progressive( void ); /* Call after changing materials. Camera, volume, light, resolution and setting changes are noticed automatically */
+void prepare_progressive( const Camera *camera, const Octree *volume ); /* Called by begin_volume_rendering. Sets progressive_frame and the checkerboard parity */
+
+/* Checkerboard rendering. Every frame traces the primary rays of half the pixels, alternating between frames.
+The other half gets depth and material from the last frame while the view stays still and from the neighbours otherwise.
+Shadows, AO and shading still cover every pixel */
+#define CHECKER_MAX_STEP 0.05f /* Neighbours further apart than this (relative) are not interpolated across */
+extern int enable_checkerboard;
+
+/* Beam pre-pass. Each 8x8 block of primary rays is traced through the octree as one frustum first. see oc_beam.c */
+#define BEAM_BLOCK 8
+extern int enable_beam_prepass;
+/* Lower bound for the hit depth of rays from o with inverse directions within [i_min,i_max]. INFINITY if none can hit.
+spread is the beam width at distance 1. Nodes smaller than the beam are not opened */
+float oc_beam_min_depth( const Octree *oc, const float o[3], const float i_min[3], const float i_max[3], float spread );
+
+/* Makes render_output_rgba and render_last_m/z/face/cost point to the last frame. The next frame will be rendered into other buffers */
 void swap_render_buffers( void );
 
-/* Ray traversal function. see oc_traverse.c. For infinitely long rays, pass NAN as max_ray_depth. Returns ray depth (or max_ray_depth) */
-float oc_traverse( const Octree *oc, uint8 *output_mat, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth );
+/* Face of a voxel that a ray entered, as written to out_face by the traversal functions (NULL if not needed).
+2*axis of the face normal, plus 1 if the normal points to the positive side, i.e. the ray travels towards negative coordinates.
+Same numbering as axis_dir in voxels_aocache.h. tx,ty,tz are the entry distances of the leaf's slabs */
+#define ENTRY_FACE(tx,ty,tz,rec_mask) \
+	( (tx) >= (ty) && (tx) >= (tz) ? ( (rec_mask) >> 2 & 1 ) : ( (ty) >= (tz) ? 2 + ( (rec_mask) >> 1 & 1 ) : 4 + ( (rec_mask) & 1 ) ) )
 
-/* Divide-And-Conquer version. Didn't turn out to be fast at all.
-see oc_traverse2.c */
+/* Ray traversal function. see oc_traverse.c. For infinitely long rays, pass NAN as max_ray_depth. Returns ray depth (or max_ray_depth) */
+float oc_traverse( const Octree *oc, uint8 *output_mat, uint8 *out_face, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth );
+
+/* Same as oc_traverse but iterative and visits only the child nodes that the ray crosses. see oc_traverse.c */
+float oc_traverse_iter( const Octree *oc, uint8 *output_mat, uint8 *out_face, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth );
+
+/* Same as oc_traverse but leaps over empty space with oc->dist first. Falls back to oc_traverse without it. see oc_traverse.c */
+float oc_traverse_grid( const Octree *oc, uint8 *output_mat, uint8 *out_face, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth );
+
+/* Traces 4 rays with one walk through the octree. see oc_traverse_packet.c
+Only rays whose bit is set in lanes are traced, but all 4 outputs are written. Inputs don't need to be aligned.
+Returns 0 without tracing anything if the traced rays don't all have the same direction signs.
+Short rays start from the smallest node that contains all of them instead of the root */
+int oc_traverse_packet4( const Octree *oc, uint8 out_m[4], float out_z[4], uint8 *out_face, unsigned lanes,
+	const float ox[4], const float oy[4], const float oz[4],
+	const float dx[4], const float dy[4], const float dz[4], float max_ray_depth );
+
+/* Same as oc_traverse but uses the flattened octree. see oc_traverse_compact.c */
+struct CompactOctree;
+float oc_traverse_compact( const struct CompactOctree *oc, uint8 *output_mat, uint8 *out_face, float ox, float oy, float oz, float dx, float dy, float dz, float max_ray_depth );
+
+/* Memory used by oc_traverse_dac. Each thread keeps its own and reuses it between frames. Zero-initialize before first use */
+typedef struct DacScratch
+{
+	uint32 *ids; /* Id lists of all recursion levels */
+	float *inv_d; /* 1/ray direction, SoA */
+	uint8 *aux_mat; /* Outputs for shadow and AO rays */
+	float *aux_z;
+	size_t capacity; /* Rays */
+} DacScratch;
+
+/* Returns 0 if out of memory */
+int reserve_dac_scratch( DacScratch *s, size_t ray_count );
+void free_dac_scratch( DacScratch *s );
+
+/* Divide-And-Conquer version. Traces a whole batch of rays at once, splitting the batch at every node.
+Whole subsets of rays get rejected with interval arithmetic before testing individual rays.
+Outputs the same things as oc_traverse. out_face can be NULL. see oc_traverse2.c */
 void oc_traverse_dac( const Octree oc[1],
+	DacScratch *scratch,
 	size_t ray_count,
 	float const *ray_o[3],
 	float const *ray_d[3],
 	uint8 out_mat[],
-	float out_depth[] );
+	float out_depth[],
+	uint8 out_face[],
+	float max_ray_depth );
+
+/* Traces primary, shadow and AO rays of one frame with both oc_traverse_dac and the selected per-ray traversal
+and prints the timings. Uses render_resx*render_resy rays. Render threads must be idle */
+void benchmark_ray_types( const Camera *camera, Octree *volume );
 
 
 void project_world_to_screen( float scr[2], const Camera *c, float px, float py, float pz, float res_x, float res_y );
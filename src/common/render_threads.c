@@ -8,17 +8,33 @@
 #include "threads.h"
 #include "microsec.h"
 
+/* Memory of one render thread. Allocated by the thread on first use and reused by the thread that replaces it */
+typedef struct ThreadScratch
+{
+	float *tile_buffer; /* temporary buffer for ray origins & directions, depth and materials of one tile */
+	DacScratch dac; /* grows on first use */
+} ThreadScratch;
+
 typedef struct SlaveThreadParams
 {
 	int id; /* 0, 1, 2, 3, .. */
 	Thread thread;
+	RenderStats stats; /* Reset by begin_volume_rendering */
+	ProfRing *prof; /* prof_rings[id+1] */
+	ThreadScratch *scratch; /* thread_scratch[id] */
 } SlaveThreadParams;
 
 #define MAX_RENDER_THREADS 64
 static SlaveThreadParams threads[MAX_RENDER_THREADS];
+static ThreadScratch thread_scratch[MAX_RENDER_THREADS]; /* Kept when the threads are restarted */
 int num_render_threads = 0;
 
+/* Profiler event rings. [0] is for the main thread, [n+1] for render thread n.
+Kept when the threads are restarted so that a trace can span a resize */
+static ProfRing *prof_rings[MAX_RENDER_THREADS+1];
+
 static Mutex render_state_mutex = MUTEX_INITIALIZER;
+static Cond render_state_cond = COND_INITIALIZER; /* Broadcast when a new frame begins or when threads should exit */
 
 /* *********************************************** */
 /* All of this is associated with render_state_mutex */
@@ -31,6 +47,7 @@ static volatile enum {
 typedef uint64 FrameID;
 volatile FrameID current_frame_id = INITIAL_FRAME_ID;
 static const struct Camera *the_camera = NULL;
+static struct Camera frame_camera; /* Copy of the camera of the frame being rendered. the_camera points here */
 static struct Octree *the_volume = NULL;
 /* *********************************************** */
 
@@ -38,21 +55,59 @@ static Mutex finished_parts_mutex = MUTEX_INITIALIZER;
 static Cond finished_parts_cond = COND_INITIALIZER;
 static volatile int finished_parts = 0; /* Associated with finished_parts_mutex */
 
+/* Tile queue. Threads take the next tile with an atomic increment until all tiles are taken.
+Reset by begin_volume_rendering while the workers are asleep */
+static volatile int next_tile = 0;
+static int num_tiles_x = 0, num_tiles = 0;
+
+/* Computes the pixel rectangle of tile n. Tiles on the right and bottom edges get cropped */
+static void get_tile_rect( int n, size_t *x0, size_t *y0, size_t *x1, size_t *y1 )
+{
+	size_t tx = n % num_tiles_x;
+	size_t ty = n / num_tiles_x;
+	
+	*x0 = tx * RENDER_TILE_W;
+	*x1 = *x0 + RENDER_TILE_W;
+	*y0 = ty * RENDER_TILE_H;
+	*y1 = *y0 + RENDER_TILE_H;
+	
+	if ( *x1 > render_resx )
+		*x1 = render_resx;
+	if ( *y1 > render_resy )
+		*y1 = render_resy;
+}
+
+/* Renders tiles until there are none left */
+static void render_tiles( const Camera *camera, Octree *volume, float *tile_buffer, DacScratch *dac, RenderStats *stats, ProfRing *prof )
+{
+	for( ;; )
+	{
+		int n = __sync_fetch_and_add( &next_tile, 1 );
+		size_t x0, y0, x1, y1;
+		
+		if ( n >= num_tiles )
+			break;
+		
+		get_tile_rect( n, &x0, &y0, &x1, &y1 );
+		render_tile( camera, volume, x0, y0, x1, y1, tile_buffer, dac, stats, prof );
+	}
+}
+
 static void *render_thread_func( void *p )
 {
-	const SlaveThreadParams * const volatile self = p;
+	SlaveThreadParams *self = p;
 	FrameID my_old_frame_id = INITIAL_FRAME_ID;
 	int running = 1;
-	size_t start_row, end_row, ray_buffer_size;
-	float *ray_buffer; /* temporary buffer for ray origins & directions */
-	
-	start_row = self->id * render_resy / num_render_threads;
-	end_row = ( self->id + 1 ) * render_resy / num_render_threads;
-	ray_buffer_size = RENDER_THREAD_MEM_PER_PIXEL * ( end_row - start_row ) * render_resx;
-	ray_buffer = aligned_alloc( 16, ray_buffer_size );
-	if ( !ray_buffer ) {
-		printf( "Error: Failed to allocate ray buffer (%u KiB)\n", (unsigned)(ray_buffer_size>>10) );
-		return NULL;
+	ThreadScratch *scratch = self->scratch;
+	
+	if ( !scratch->tile_buffer )
+	{
+		size_t tile_buffer_size = RENDER_THREAD_MEM_PER_PIXEL * RENDER_TILE_W * RENDER_TILE_H;
+		scratch->tile_buffer = aligned_alloc( 16, tile_buffer_size );
+		if ( !scratch->tile_buffer ) {
+			printf( "Error: Failed to allocate tile buffer (%u KiB)\n", (unsigned)(tile_buffer_size>>10) );
+			return NULL;
+		}
 	}
 	
 	while( running )
@@ -64,6 +119,10 @@ static void *render_thread_func( void *p )
 		
 		mutex_lock( &render_state_mutex );
 		{
+			/* Sleep until there's a new frame to render */
+			while( render_state == R_RENDER && current_frame_id == my_old_frame_id )
+				cond_wait( &render_state_cond, &render_state_mutex );
+			
 			/* Get local copies of the global variables */
 			my_render_state = render_state;
 			my_current_frame_id = current_frame_id;
@@ -79,8 +138,14 @@ static void *render_thread_func( void *p )
 					We don't want to render the same thing twice. */
 				if ( my_old_frame_id != my_current_frame_id )
 				{
+					uint64 t0 = get_microsec();
+					
+					if ( self->prof )
+						self->prof->frame = my_current_frame_id;
+					
 					/* Do some heavy number crunching, recursion and memory I/O */
-					render_part( my_cam, my_vol, start_row, end_row, ray_buffer );
+					render_tiles( my_cam, my_vol, scratch->tile_buffer, &scratch->dac, &self->stats, self->prof );
+					self->stats.busy_time = get_microsec() - t0;
 					
 					/* Job finished - notify main thread */
 					mutex_lock( &finished_parts_mutex );
@@ -105,7 +170,6 @@ static void *render_thread_func( void *p )
 		}
 	}
 	
-	free( ray_buffer );
 	return NULL;
 }
 
@@ -118,7 +182,9 @@ void stop_render_threads( void )
 		return;
 	}
 	
+	mutex_lock( &render_state_mutex );
 	render_state = R_EXIT;
+	cond_broadcast( &render_state_cond );
 	mutex_unlock( &render_state_mutex );
 	
 	/* Wait until all threads have terminated */
@@ -137,6 +203,7 @@ void start_render_threads( int count )
 	static int has_init = 0;
 	if ( !has_init ) {
 		mutex_init( &render_state_mutex );
+		cond_init( &render_state_cond );
 		mutex_init( &finished_parts_mutex );
 		cond_init( &finished_parts_cond );
 		has_init = 1;
@@ -151,50 +218,112 @@ void start_render_threads( int count )
 		stop_render_threads();
 	}
 	
+	/* The workers sleep until begin_volume_rendering wakes them up */
 	num_render_threads = count;
 	render_state = R_RENDER;
 	current_frame_id = INITIAL_FRAME_ID;
 	finished_parts = 0;
 	
-	/* Keep this mutex hostage whenever workers aren't supposed to do anything */
-	mutex_lock( &render_state_mutex );
+	for( n=0; n<=num_render_threads; n++ ) {
+		if ( !prof_rings[n] )
+			prof_rings[n] = prof_create_ring( n - 1 );
+	}
 	
 	for( n=0; n<num_render_threads; n++ ) {
 		threads[n].id = n;
+		threads[n].prof = prof_rings[n+1];
+		threads[n].scratch = thread_scratch + n;
 		thread_create( &threads[n].thread, render_thread_func, (void*)(threads+n) );
 	}
 }
 
+void free_render_scratch( void )
+{
+	int n;
+	
+	for( n=num_render_threads; n<MAX_RENDER_THREADS; n++ ) {
+		free_dac_scratch( &thread_scratch[n].dac );
+		free( thread_scratch[n].tile_buffer );
+		thread_scratch[n].tile_buffer = NULL;
+	}
+}
+
 static uint64 frame_start_time = 0;
 void begin_volume_rendering( const struct Camera *camera, struct Octree *volume )
 {
+	int n;
+	
 	/* No threads, can't render */
 	if ( num_render_threads <= 0 )
 		return;
 	
+	/* Workers are asleep so it's safe to rebuild acceleration data here */
+	prepare_volume( volume );
+	
+	/* The previous frame's depth is still intact */
+	reproject_frame( camera, volume );
+	prepare_progressive( camera, volume );
+	
+	num_tiles_x = ( render_resx + RENDER_TILE_W - 1 ) / RENDER_TILE_W;
+	num_tiles = num_tiles_x * ( ( render_resy + RENDER_TILE_H - 1 ) / RENDER_TILE_H );
+	next_tile = 0;
+	
+	for( n=0; n<num_render_threads; n++ )
+		memset( &threads[n].stats, 0, sizeof( threads[n].stats ) );
+	
+	/* Held until end_volume_rendering waits on finished_parts_cond */
 	mutex_lock( &finished_parts_mutex );
-	current_frame_id++;
-	the_camera = camera;
-	the_volume = volume;
 	finished_parts = 0;
 	
 	frame_start_time = get_microsec();
 	
-	/* Release the hostage */
+	/* Wake up the workers */
+	mutex_lock( &render_state_mutex );
+	current_frame_id++;
+	frame_camera = *camera;
+	the_camera = &frame_camera;
+	the_volume = volume;
+	cond_broadcast( &render_state_cond );
 	mutex_unlock( &render_state_mutex );
 }
 
-static size_t get_total_rays( void )
+static void sum_stats( RayPerfInfo *info )
 {
-	size_t n = render_resx * render_resy;
-	
-	if ( enable_shadows )
-		n <<= 1;
+	RenderStats *total = &info->stats;
+	int n, k;
 	
-	if ( enable_aoccl )
-		n *= NUM_AO_SAMPLES;
+	memset( total, 0, sizeof(*total) );
+	info->min_busy_time = ~(uint64) 0;
+	info->max_busy_time = 0;
+	info->slowest_thread = 0;
 	
-	return n;
+	for( n=0; n<num_render_threads; n++ )
+	{
+		const RenderStats *s = &threads[n].stats;
+		
+		for( k=0; k<NUM_RAY_TYPES; k++ ) {
+			total->rays[k] += s->rays[k];
+			total->trace_time[k] += s->trace_time[k];
+			add_traversal_totals( total->traversal + k, s->traversal + k );
+		}
+		
+		for( k=0; k<NUM_RENDER_STAGES; k++ )
+			total->stage_time[k] += s->stage_time[k];
+		
+		total->busy_time += s->busy_time;
+		total->reprojected += s->reprojected;
+		total->beam_skipped += s->beam_skipped;
+		total->ao_pixels += s->ao_pixels;
+		total->ao_cached += s->ao_cached;
+		
+		if ( s->busy_time < info->min_busy_time )
+			info->min_busy_time = s->busy_time;
+		
+		if ( s->busy_time > info->max_busy_time ) {
+			info->max_busy_time = s->busy_time;
+			info->slowest_thread = n;
+		}
+	}
 }
 
 void end_volume_rendering( RayPerfInfo info[1] )
@@ -210,14 +339,32 @@ void end_volume_rendering( RayPerfInfo info[1] )
 	}
 	mutex_unlock( &finished_parts_mutex );
 	
-	/* Freeze workers */
-	mutex_lock( &render_state_mutex );
+	/* All workers are now asleep, waiting for the next frame */
+	
+	if ( prof_rings[0] ) {
+		prof_rings[0]->frame = current_frame_id;
+		prof_event( prof_rings[0], STAGE_FRAME, frame_start_time, get_microsec(), 0 );
+	}
 	
 	if ( info )
 	{
 		uint64_t t = get_microsec();
 		info->frame_time = t > frame_start_time ? ( t - frame_start_time ) : 0;
-		info->rays_per_frame = get_total_rays();
+		sum_stats( info );
+		info->stats.stage_time[STAGE_FRAME] = info->frame_time;
+		info->rays_per_frame = info->stats.rays[RAY_PRIMARY] + info->stats.rays[RAY_SHADOW] + info->stats.rays[RAY_AO];
 		info->rays_per_sec = info->frame_time ? ( 1000000 * info->rays_per_frame + 500000 ) / info->frame_time : 0;
 	}
 }
+
+void clear_render_trace( void )
+{
+	int n;
+	for( n=0; n<=MAX_RENDER_THREADS; n++ )
+		prof_clear_ring( prof_rings[n] );
+}
+
+int write_render_trace( const char *filename )
+{
+	return prof_write_chrome_trace( filename, prof_rings, MAX_RENDER_THREADS+1 );
+}
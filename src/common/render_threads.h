@@ -1,14 +1,38 @@
 #ifndef _RENDER_THREADS_H
 #define _RENDER_THREADS_H
 #include "types.h"
+#include "profiler.h"
+#include "traversal_stats.h"
 
 struct Camera;
 struct Octree;
 
+enum {
+	RAY_PRIMARY=0,
+	RAY_SHADOW,
+	RAY_AO,
+	NUM_RAY_TYPES
+};
+
+/* Counters of one render thread. Added up by render_tile */
+typedef struct RenderStats {
+	uint64 rays[NUM_RAY_TYPES];
+	uint64 trace_time[NUM_RAY_TYPES]; /* microseconds spent tracing rays of each type */
+	uint64 stage_time[NUM_RENDER_STAGES]; /* microseconds spent in each stage of render_tile */
+	uint64 busy_time; /* microseconds from waking up to finishing the last tile */
+	uint64 reprojected; /* primary rays that started from a reprojected depth */
+	uint64 beam_skipped; /* primary rays not traced because the beam pre-pass found nothing in their block */
+	uint64 ao_pixels, ao_cached; /* pixels that needed AO with enable_ao_cache and how many of them found it in the cache */
+	TraversalTotals traversal[NUM_RAY_TYPES]; /* Only with TRAVERSAL_STATS. AO rays are counted unless they go through oc_traverse_dac */
+} RenderStats;
+
 typedef struct {
 	uint64 frame_time; /* microseconds */
 	uint64 rays_per_frame;
 	uint64 rays_per_sec;
+	RenderStats stats; /* Sum over all threads */
+	uint64 min_busy_time, max_busy_time; /* fastest and slowest thread */
+	int slowest_thread;
 } RayPerfInfo;
 
 extern int num_render_threads;
@@ -21,7 +45,17 @@ void start_render_threads( int N );
 /* Does nothing if no threads are running. Stalls until all threads are dead */
 void stop_render_threads( void );
 
-void begin_volume_rendering( const struct Camera *camera, struct Octree *volume ); /* signals the worker threads to begin rendering a frame */
+/* Frees the tile buffers and DAC scratch that stopped threads left for their successors. The running threads keep theirs */
+void free_render_scratch( void );
+
+/* Signals the worker threads to begin rendering a frame. The camera is copied so the caller can move it while the frame renders.
+The volume, materials and render settings must not change until end_volume_rendering returns */
+void begin_volume_rendering( const struct Camera *camera, struct Octree *volume );
 void end_volume_rendering( RayPerfInfo info[1] ); /* waits and returns only when the entire frame has been rendered. if info!=NULL then performance data is written there */
 
+/* Stage events are recorded while enable_profiler is set (profiler.h). Call these between frames.
+Only the newest PROF_RING_SIZE events of each thread are kept */
+void clear_render_trace( void );
+int write_render_trace( const char *filename ); /* Chrome trace JSON. Returns 0 on failure */
+
 #endif
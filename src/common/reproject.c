@@ -0,0 +1,236 @@
+#include <string.h>
+#include <math.h>
+#include "render_buffers.h"
+#include "render_core.h"
+
+/* Temporal reprojection of primary ray hits.
+The hits of the previous frame (render_last_z) are moved to where they are seen from the new camera.
+Primary rays then start a little before the reprojected depth instead of at the camera, skipping the empty space in front.
+Pixels without a complete 3x3 neighbourhood of reprojected hits (disocclusions, screen edges, sky) are traced from the camera.
+A start depth is only used if the part of the ray that it skips was seen as empty by the previous frame: points along it
+must project in front of the previous depths. Gaps of a magnified surface that got filled with depths of the background
+behind it fail this, and so does everything when the camera moved behind a surface that the previous frame saw.
+Points outside the previous view are checked against the voxels themselves.
+A few rows are always traced from the camera so that anything the reprojection can't know about gets picked up within REFRESH_PERIOD frames */
+
+#define REFRESH_PERIOD 8
+#define START_MARGIN_REL 0.02f /* fraction of the reprojected depth */
+#define START_MARGIN_ABS 2.0f /* voxels at the current detail level */
+#define CHECK_SAMPLES 4 /* Points checked along the skipped part of each ray. The last one is the start point */
+
+#define MIN(a,b) ((a)<(b)?(a):(b))
+
+int enable_reprojection = 0;
+
+static Camera prev_camera;
+static const Octree *prev_volume = NULL;
+static unsigned prev_revision = 0;
+static int prev_detail_level = 0;
+static int prev_valid = 0;
+static unsigned refresh_phase = 0;
+static float start_margin_abs = START_MARGIN_ABS;
+
+/* The views of reproject_frame for get_reprojected_depth. Positions are in voxels */
+static float last_eye_to_world[9], last_w, last_znear;
+static float cur_eye_to_world[9], cur_w;
+static float cur_from_last[3]; /* Current camera position relative to the previous one */
+static float last_pos[3];
+static const Octree *cur_volume;
+
+void invalidate_reprojection( void ) {
+	prev_valid = 0;
+}
+
+/* Keeps the nearest depth */
+static void splat( int x, int y, float z )
+{
+	if ( x >= 0 && y >= 0 && x < (int) render_resx && y < (int) render_resy )
+	{
+		float *p = render_reproj_z + y * render_resx + x;
+		if ( *p == 0 || z < *p )
+			*p = z;
+	}
+}
+
+/* Whether the previous frame saw point q (relative to the previous camera) as empty space.
+The nearest of the 2x2 depths around its projection is used so that surfaces between the pixel centres count.
+Points that it didn't see (off screen or behind the camera) are looked up in the volume instead */
+static int seen_empty( const float q[3] )
+{
+	const float *m = last_eye_to_world;
+	const float *z;
+	float e[3], near;
+	int k, x, y;
+	
+	/* eye_to_world is a rotation so its inverse is the transpose */
+	for( k=0; k<3; k++ )
+		e[k] = m[k] * q[0] + m[k+3] * q[1] + m[k+6] * q[2];
+	
+	if ( e[2] <= last_znear )
+		goto unseen;
+	
+	x = floorf( ( e[0] / e[2] * last_w - screen_uv_min[0] ) / screen_uv_scale[0] );
+	y = floorf( ( e[1] / e[2] * last_w - screen_uv_min[1] ) / screen_uv_scale[1] );
+	
+	if ( x < 0 || y < 0 || x + 1 >= (int) render_resx || y + 1 >= (int) render_resy )
+		goto unseen;
+	
+	z = render_last_z + y * render_resx + x;
+	near = MIN( MIN( z[0], z[1] ), MIN( z[render_resx], z[render_resx+1] ) );
+	
+	return q[0]*q[0] + q[1]*q[1] + q[2]*q[2] < near * near;
+
+unseen:
+	return !oc_get_voxel( cur_volume, floorf( last_pos[0] + q[0] ), floorf( last_pos[1] + q[1] ), floorf( last_pos[2] + q[2] ) );
+}
+
+void reproject_frame( const Camera *camera, const Octree *volume )
+{
+	const float *m0 = prev_camera.eye_to_world;
+	const float *m1 = camera->eye_to_world;
+	const float size = volume->size;
+	float w0, w1;
+	float o0[3], o1[3];
+	size_t x, y;
+	int k;
+	
+	memset( render_reproj_z, 0, render_resx * render_resy * sizeof( render_reproj_z[0] ) );
+	
+	if ( !enable_reprojection || !prev_valid || prev_volume != volume || prev_revision != volume->revision || prev_detail_level != oc_detail_level )
+		goto done;
+	
+	w0 = calc_raydir_z( &prev_camera );
+	w1 = calc_raydir_z( camera );
+	
+	for( k=0; k<3; k++ ) {
+		o0[k] = prev_camera.pos[k] * size;
+		o1[k] = camera->pos[k] * size;
+		cur_from_last[k] = o1[k] - o0[k];
+		last_pos[k] = o0[k];
+	}
+	
+	cur_volume = volume;
+	
+	memcpy( last_eye_to_world, m0, sizeof( last_eye_to_world ) );
+	memcpy( cur_eye_to_world, m1, sizeof( cur_eye_to_world ) );
+	last_w = w0;
+	cur_w = w1;
+	last_znear = ZNEAR * size;
+	
+	/* Every ray starts at the camera. A camera inside a solid voxel sees nothing that can be validated */
+	if ( !seen_empty( cur_from_last ) )
+		goto done;
+	
+	for( y=0; y<render_resy; y++ )
+	{
+		const float v = screen_uv_min[1] + y * screen_uv_scale[1];
+		const uint8 *mat_p = render_last_m + y * render_resx;
+		const float *z_p = render_last_z + y * render_resx;
+		
+		for( x=0; x<render_resx; x++ )
+		{
+			float u, d[3], e[3], p[3], len, sx, sy, z;
+			
+			if ( !mat_p[x] || !( z_p[x] < INFINITY ) )
+				continue;
+			
+			/* Primary ray of the previous frame. Same as generate_primary_rays */
+			u = screen_uv_min[0] + x * screen_uv_scale[0];
+			len = 1.0f / sqrtf( u*u + v*v + w0*w0 );
+			for( k=0; k<3; k++ ) {
+				d[k] = ( m0[3*k] * u + m0[3*k+1] * v + m0[3*k+2] * w0 ) * len;
+				p[k] = o0[k] + d[k] * z_p[x] - o1[k];
+			}
+			
+			/* To the eye space of the new camera. eye_to_world is a rotation so its inverse is the transpose */
+			for( k=0; k<3; k++ )
+				e[k] = m1[k] * p[0] + m1[k+3] * p[1] + m1[k+6] * p[2];
+			
+			if ( e[2] <= ZNEAR * size )
+				continue;
+			
+			sx = floorf( ( e[0] / e[2] * w1 - screen_uv_min[0] ) / screen_uv_scale[0] );
+			sy = floorf( ( e[1] / e[2] * w1 - screen_uv_min[1] ) / screen_uv_scale[1] );
+			z = sqrtf( p[0]*p[0] + p[1]*p[1] + p[2]*p[2] );
+			
+			/* 2x2 footprint covers most of the gaps when surfaces get closer */
+			splat( sx, sy, z );
+			splat( sx + 1, sy, z );
+			splat( sx, sy + 1, z );
+			splat( sx + 1, sy + 1, z );
+		}
+	}
+
+done:
+	prev_camera = *camera;
+	prev_volume = volume;
+	prev_revision = volume->revision;
+	prev_detail_level = oc_detail_level;
+	prev_valid = 1;
+	refresh_phase = ( refresh_phase + 1 ) % REFRESH_PERIOD;
+	start_margin_abs = START_MARGIN_ABS * ( 1 << oc_detail_level );
+}
+
+size_t get_reprojected_depth( float *out, size_t x0, size_t y0, size_t x1, size_t y1 )
+{
+	size_t x, y, count = 0;
+	
+	for( y=y0; y<y1; y++ )
+	{
+		const float v = screen_uv_min[1] + y * screen_uv_scale[1];
+		int refresh = ( y % REFRESH_PERIOD ) == refresh_phase;
+		
+		for( x=x0; x<x1; x++,out++ )
+		{
+			const float *m = cur_eye_to_world;
+			float t = INFINITY, u, d[3], len;
+			int i, j, k;
+			
+			*out = 0;
+			
+			if ( refresh || x == 0 || y == 0 || x + 1 == render_resx || y + 1 == render_resy )
+				continue;
+			
+			/* Nearest depth in the 3x3 neighbourhood. A hole anywhere means a possible disocclusion */
+			for( j=-1; j<=1; j++ ) {
+				const float *p = render_reproj_z + ( y + j ) * render_resx + x;
+				for( i=-1; i<=1; i++ ) {
+					if ( p[i] == 0 )
+						t = 0;
+					else if ( p[i] < t )
+						t = p[i];
+				}
+			}
+			
+			t = t * ( 1.0f - START_MARGIN_REL ) - start_margin_abs;
+			
+			if ( !( t > 0 ) )
+				continue;
+			
+			/* Primary ray of this frame. Same as generate_primary_rays */
+			u = screen_uv_min[0] + x * screen_uv_scale[0];
+			len = 1.0f / sqrtf( u*u + v*v + cur_w*cur_w );
+			for( k=0; k<3; k++ )
+				d[k] = ( m[3*k] * u + m[3*k+1] * v + m[3*k+2] * cur_w ) * len;
+			
+			/* The skipped part must have been empty space in the previous frame */
+			for( j=1; j<=CHECK_SAMPLES; j++ )
+			{
+				float q[3], f = t * j / CHECK_SAMPLES;
+				
+				for( k=0; k<3; k++ )
+					q[k] = cur_from_last[k] + d[k] * f;
+				
+				if ( !seen_empty( q ) )
+					break;
+			}
+			
+			if ( j > CHECK_SAMPLES ) {
+				*out = t;
+				count++;
+			}
+		}
+	}
+	
+	return count;
+}
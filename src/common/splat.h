@@ -3,7 +3,7 @@
 
 /* todo:
 - improve the interface to render buffers (render_core.c, render_threads.c)
-- move the low-level raycasting loops into their own modules from render_core.c:render_part()
+- move the low-level raycasting loops into their own modules from render_core.c:render_tile()
 - eliminate global variables or group into structs
 - simple rasterizer that can draw polygons, rectangles and circles (start with 32bit, add support for other bit depths later)
 - treat voxels as cubes, project to screen space and draw as 4-6 sided polygons
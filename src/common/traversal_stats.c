@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include "traversal_stats.h"
+#include "render_buffers.h"
+
+int heatmap_scale = 128;
+
+void add_traversal_stats( TraversalTotals *t, const TraversalStats *s, size_t count )
+{
+	size_t n;
+	
+	for( n=0; n<count; n++ )
+	{
+		/* Rays that weren't traced (sky pixels for shadows) have no tests */
+		if ( !s[n].aabb_tests )
+			continue;
+		
+		t->rays++;
+		t->nodes += s[n].nodes;
+		t->aabb_tests += s[n].aabb_tests;
+		t->early_outs += s[n].early_outs;
+		t->depth_sum += s[n].max_depth;
+		
+		if ( s[n].max_depth > t->max_depth )
+			t->max_depth = s[n].max_depth;
+	}
+}
+
+void add_traversal_totals( TraversalTotals *t, const TraversalTotals *s )
+{
+	t->rays += s->rays;
+	t->nodes += s->nodes;
+	t->aabb_tests += s->aabb_tests;
+	t->early_outs += s->early_outs;
+	t->depth_sum += s->depth_sum;
+	
+	if ( s->max_depth > t->max_depth )
+		t->max_depth = s->max_depth;
+}
+
+/* Black, blue, green, yellow, red, white */
+uint32 heatmap_color( uint32 n )
+{
+	static const uint8 ramp[6][3] = {
+		{0,0,0}, {0,0,255}, {0,255,0}, {255,255,0}, {255,0,0}, {255,255,255}
+	};
+	uint32 x, i, f, c = 0;
+	int k;
+	
+	x = heatmap_scale > 0 ? n * 5 * 256 / heatmap_scale : 0;
+	if ( x >= 5 * 256 )
+		return 0xFFFFFF;
+	
+	i = x >> 8;
+	f = x & 0xFF;
+	
+	for( k=0; k<3; k++ )
+		c = c << 8 | ( ( ramp[i][k] * ( 256 - f ) + ramp[i+1][k] * f ) >> 8 );
+	
+	return c;
+}
+
+int write_heatmap_ppm( const char *filename )
+{
+	FILE *fp;
+	size_t x, y;
+	
+	if ( !render_last_cost )
+		return 0;
+	
+	fp = fopen( filename, "wb" );
+	if ( !fp )
+		return 0;
+	
+	fprintf( fp, "P6\n%u %u\n255\n", (unsigned) render_resx, (unsigned) render_resy );
+	
+	for( y=0; y<render_resy; y++ )
+	{
+		for( x=0; x<render_resx; x++ )
+		{
+			uint32 c = heatmap_color( render_last_cost[ y * render_resx + x ] );
+			fputc( c >> 16 & 0xFF, fp );
+			fputc( c >> 8 & 0xFF, fp );
+			fputc( c & 0xFF, fp );
+		}
+	}
+	
+	return fclose( fp ) == 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _TRAVERSAL_STATS_H
+#define _TRAVERSAL_STATS_H
+#include <stddef.h>
+#include "types.h"
+
+/* Traversal cost counters. Only collected in statistics builds (scons stats=1 defines TRAVERSAL_STATS).
+Counting slows traversal down so don't compare frame times against a normal build */
+
+typedef struct TraversalStats {
+	uint32 nodes; /* nodes entered */
+	uint32 aabb_tests; /* ray-node interval tests */
+	uint32 early_outs; /* tests that rejected the node: missed, behind the ray or beyond max_ray_depth */
+	uint16 max_depth; /* deepest node entered. Levels below the root */
+	uint16 root_level; /* level where traversal started. Set by the traversal function */
+} TraversalStats;
+
+/* Sums of TraversalStats over many rays */
+typedef struct TraversalTotals {
+	uint64 rays;
+	uint64 nodes;
+	uint64 aabb_tests;
+	uint64 early_outs;
+	uint64 depth_sum; /* sum of max_depth */
+	uint32 max_depth;
+} TraversalTotals;
+
+void add_traversal_stats( TraversalTotals *t, const TraversalStats *s, size_t count );
+void add_traversal_totals( TraversalTotals *t, const TraversalTotals *s );
+
+#define HEATMAP_FILE "heatmap.ppm"
+
+/* Nodes per primary ray that get the hottest color */
+extern int heatmap_scale;
+
+/* 0x00RRGGBB color of a primary ray that entered n nodes */
+uint32 heatmap_color( uint32 n );
+
+/* Writes render_last_cost as colors. Returns 0 on failure or if this isn't a statistics build */
+int write_heatmap_ppm( const char *filename );
+
+#ifdef TRAVERSAL_STATS
+
+/* Counters of the ray that this thread is tracing. NULL to not count.
+oc_traverse_packet4 and oc_traverse_dac treat it as an array with one element per ray */
+extern __thread TraversalStats *oc_ray_stats;
+
+#define STATS_BEGIN(level) do { \
+	if ( oc_ray_stats ) oc_ray_stats->root_level = (level); \
+} while(0)
+
+#define STATS_TEST(s,rejected) do { \
+	if ( s ) { \
+		(s)->aabb_tests++; \
+		(s)->early_outs += !!(rejected); \
+	} \
+} while(0)
+
+#define STATS_NODE(s,level) do { \
+	if ( s ) { \
+		int d_ = (s)->root_level - (level); \
+		(s)->nodes++; \
+		if ( d_ > (s)->max_depth ) (s)->max_depth = d_; \
+	} \
+} while(0)
+
+#else
+
+#define STATS_BEGIN(level)
+#define STATS_TEST(s,rejected)
+#define STATS_NODE(s,level)
+
+#endif
+
+#endif
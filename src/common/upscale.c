@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <emmintrin.h>
+#include "upscale.h"
+
+/* Rows are first scaled horizontally into 16-bit channels. Each destination row then blends 2 of those.
+Weights are 8-bit fractions so that every sum of products fits in 16 bits, rounding included */
+
+static size_t scratch_w = 0;
+static uint32 *col_x = NULL; /* Left source pixel of each destination column */
+static uint16 *col_w = NULL; /* 4 weights of the left pixel and 4 of the right one per column */
+static uint16 *rows[2] = {NULL, NULL}; /* Horizontally scaled source rows. 4 channels per pixel */
+static size_t row_y[2]; /* Which source rows rows[] hold */
+
+static int reserve( size_t dw )
+{
+	if ( dw <= scratch_w )
+		return 1;
+	
+	free( col_x );
+	free( col_w );
+	free( rows[0] );
+	free( rows[1] );
+	
+	col_x = malloc( dw * sizeof( col_x[0] ) );
+	col_w = malloc( dw * 8 * sizeof( col_w[0] ) );
+	rows[0] = malloc( ( dw + 1 ) * 4 * sizeof( rows[0][0] ) );
+	rows[1] = malloc( ( dw + 1 ) * 4 * sizeof( rows[1][0] ) );
+	
+	if ( !col_x || !col_w || !rows[0] || !rows[1] ) {
+		scratch_w = 0;
+		return 0;
+	}
+	
+	scratch_w = dw;
+	return 1;
+}
+
+/* Position of the destination pixel centre in the source. Returns the first of the 2 source pixels and the weight of the second (0..256) */
+static size_t source_pos( size_t d, size_t dn, size_t sn, unsigned *w )
+{
+	float s = ( d + 0.5f ) * sn / dn - 0.5f;
+	size_t i;
+	
+	if ( s <= 0 ) {
+		*w = 0;
+		return 0;
+	}
+	
+	i = s;
+	if ( i >= sn - 1 ) {
+		*w = 256;
+		return sn - 2;
+	}
+	
+	*w = ( s - i ) * 256 + 0.5f;
+	return i;
+}
+
+static void scale_row( uint16 *out, const uint32 *src, size_t dw )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16( 128 );
+	size_t x;
+	
+	for( x=0; x<dw; x++ )
+	{
+		__m128i ab = _mm_loadl_epi64( (const void*)( src + col_x[x] ) );
+		__m128i w = _mm_loadu_si128( (const void*)( col_w + 8*x ) );
+		
+		ab = _mm_unpacklo_epi8( ab, zero );
+		ab = _mm_mullo_epi16( ab, w );
+		ab = _mm_add_epi16( ab, _mm_srli_si128( ab, 8 ) );
+		ab = _mm_srli_epi16( _mm_add_epi16( ab, half ), 8 );
+		_mm_storel_epi64( (void*)( out + 4*x ), ab );
+	}
+}
+
+static const uint16 *get_row( size_t y, const uint32 *src, size_t src_stride, size_t dw )
+{
+	int k = y & 1;
+	
+	if ( row_y[k] != y ) {
+		scale_row( rows[k], src + y * src_stride, dw );
+		row_y[k] = y;
+	}
+	
+	return rows[k];
+}
+
+int upscale_bilinear( uint32 *dst, size_t dw, size_t dh, size_t dst_pitch,
+	const uint32 *src, size_t sw, size_t sh, size_t src_stride )
+{
+	const __m128i half = _mm_set1_epi16( 128 );
+	size_t x, y;
+	
+	if ( !reserve( dw ) )
+		return 0;
+	
+	for( x=0; x<dw; x++ )
+	{
+		unsigned w;
+		int k;
+		
+		col_x[x] = source_pos( x, dw, sw, &w );
+		for( k=0; k<4; k++ ) {
+			col_w[8*x+k] = 256 - w;
+			col_w[8*x+4+k] = w;
+		}
+	}
+	
+	row_y[0] = row_y[1] = ~(size_t) 0;
+	
+	for( y=0; y<dh; y++ )
+	{
+		uint32 *out = (uint32*)( (char*) dst + y * dst_pitch );
+		const uint16 *r0, *r1;
+		unsigned w;
+		size_t sy;
+		__m128i w0, w1;
+		
+		sy = source_pos( y, dh, sh, &w );
+		r0 = get_row( sy, src, src_stride, dw );
+		r1 = get_row( sy + 1, src, src_stride, dw );
+		w0 = _mm_set1_epi16( 256 - w );
+		w1 = _mm_set1_epi16( w );
+		
+		/* 2 pixels at a time. An odd last pixel reads one past the end of the rows, which is allocated */
+		for( x=0; x<dw; x+=2 )
+		{
+			__m128i a = _mm_loadu_si128( (const void*)( r0 + 4*x ) );
+			__m128i b = _mm_loadu_si128( (const void*)( r1 + 4*x ) );
+			__m128i c;
+			
+			c = _mm_add_epi16( _mm_mullo_epi16( a, w0 ), _mm_mullo_epi16( b, w1 ) );
+			c = _mm_srli_epi16( _mm_add_epi16( c, half ), 8 );
+			c = _mm_packus_epi16( c, c );
+			
+			if ( x + 1 < dw )
+				_mm_storel_epi64( (void*)( out + x ), c );
+			else
+				out[x] = _mm_cvtsi128_si32( c );
+		}
+	}
+	
+	return 1;
+}
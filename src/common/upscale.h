@@ -0,0 +1,13 @@
+#ifndef _UPSCALE_H
+#define _UPSCALE_H
+#include <stddef.h>
+#include "types.h"
+
+/* Bilinear upscaling of 32-bit pixels. Shows frames rendered below the screen resolution.
+src is sw x sh pixels with rows src_stride pixels apart. dst is dw x dh pixels with rows dst_pitch bytes apart.
+sw and sh must be at least 2. Keeps scratch memory between calls so only one thread should use it.
+Returns 0 if out of memory */
+int upscale_bilinear( uint32 *dst, size_t dw, size_t dh, size_t dst_pitch,
+	const uint32 *src, size_t sw, size_t sh, size_t src_stride );
+
+#endif
@@ -6,6 +6,10 @@
 
 #define VOXEL_INTERNALS 1
 #include "voxels.h"
+#include "voxels_compact.h"
+#include "voxels_distance.h"
+#include "voxels_aocache.h"
+#include "voxels_normals.h"
 
 Octree *oc_init( int toplevel )
 {
@@ -43,18 +47,68 @@ static uint64 get_morton_code( uint64 x, uint64 y, uint64 z )
 	return a;
 }
 
+/* Releases every child block at once. No need to walk the tree */
+static void free_slabs( Octree *oc )
+{
+	OctreeSlab *slab = oc->slabs;
+	
+	while( slab )
+	{
+		OctreeSlab *next = slab->next;
+		free( slab->blocks );
+		free( slab );
+		slab = next;
+	}
+	
+	oc->slabs = NULL;
+	oc->slab_used = 0;
+	oc->free_blocks = NULL;
+	oc->root.children = NULL;
+	oc->num_nodes = 1;
+}
+
 void oc_free( Octree *oc )
 {
-	oc_collapse_node( oc, &oc->root );
-	assert( oc->num_nodes == 1 );
+	free_slabs( oc );
+	oc_free_compact( oc->compact );
+	oc_free_distance_grid( oc->dist );
+	oc_free_ao_cache( oc->ao_cache );
+	oc_free_normals( oc->normals );
 	free( oc );
 }
 
 void oc_clear( Octree *oc, int m )
 {
-	oc_collapse_node( oc, &oc->root );
-	assert( oc->num_nodes == 1 );
+	free_slabs( oc );
+	if ( oc->normals )
+		oc_clear_normals( oc->normals );
 	oc->root.mat = m;
+	oc->revision++;
+}
+
+int oc_get_voxel( const Octree *oc, int x, int y, int z )
+{
+	const OctreeNode *node = &oc->root;
+	int level = oc->root_level;
+	
+	if ( (unsigned) x >= (unsigned) oc->size || (unsigned) y >= (unsigned) oc->size || (unsigned) z >= (unsigned) oc->size )
+		return 0;
+	
+	while( node->children && level > oc_detail_level )
+	{
+		level--;
+		node = node->children + ( ( x >> level & 1 ) << 2 | ( y >> level & 1 ) << 1 | ( z >> level & 1 ) );
+	}
+	
+	return node->mat;
+}
+
+void oc_mark_dirty( Octree *oc, const aabb3f *box )
+{
+	if ( oc->dist )
+		distance_grid_mark_dirty( oc->dist, oc->revision, box );
+	if ( oc->ao_cache )
+		ao_cache_mark_dirty( oc->ao_cache, oc->revision, box );
 }
 
 
@@ -72,31 +126,80 @@ const int OC_RECURSION_MASK[8][3] = {
 };
 #undef X
 
+static OctreeNode *alloc_block( Octree *oc )
+{
+	OctreeNode *block = oc->free_blocks;
+	OctreeSlab *slab;
+	
+	if ( block )
+	{
+		/* Reuse a block that some collapsed node gave back */
+		oc->free_blocks = block->children;
+		return block;
+	}
+	
+	slab = oc->slabs;
+	
+	if ( !slab || oc->slab_used == OC_SLAB_BLOCKS )
+	{
+		/* Newest slab is full (or there are no slabs yet) */
+		slab = malloc( sizeof(OctreeSlab) );
+		if ( !slab )
+			return NULL;
+		
+		slab->blocks = aligned_alloc( 64, OC_SLAB_BLOCKS * 8 * sizeof(OctreeNode) );
+		if ( !slab->blocks ) {
+			free( slab );
+			return NULL;
+		}
+		
+		slab->next = oc->slabs;
+		oc->slabs = slab;
+		oc->slab_used = 0;
+	}
+	
+	/* Hand out blocks in address order so that nodes created together stay close in memory */
+	return slab->blocks + 8 * oc->slab_used++;
+}
+
 void oc_expand_node( Octree *oc, OctreeNode *node )
 {
-	int n;
-	uint8 m;
+	OctreeNode *children;
+	int n, m;
 	
 	if ( node->children )
 		return;
 	
-	node->children = calloc( 8, sizeof(OctreeNode) );
-	oc->num_nodes += 8;
+	children = alloc_block( oc );
+	if ( !children ) {
+		printf( "Error: failed to allocate octree nodes\n" );
+		abort();
+	}
 	
 	m = node->mat;
-	for( n=0; n<8; n++ )
-		node->children[n].mat = m;
+	for( n=0; n<8; n++ ) {
+		children[n].children = NULL;
+		children[n].mat = m;
+	}
+	
+	node->children = children;
+	oc->num_nodes += 8;
 }
 
 void oc_collapse_node( Octree *oc, OctreeNode *node )
 {
 	if ( node->children )
 	{
+		OctreeNode *block = node->children;
 		int n;
+		
 		for( n=0; n<8; n++ )
-			oc_collapse_node( oc, &node->children[n] );
+			oc_collapse_node( oc, &block[n] );
+		
+		/* Push the block to the free list */
+		block->children = oc->free_blocks;
+		oc->free_blocks = block;
 		
-		free( node->children );
 		node->children = NULL;
 		oc->num_nodes -= 8;
 	}
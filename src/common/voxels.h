@@ -7,12 +7,18 @@
 #include "aabb.h"
 #include "materials.h"
 
-/* Side length of a normal vector chunk */
-#define NOR_BRICK_S 8
+/* Side length of a dense voxel brick (also meant for normal vector chunks).
+Compact octrees can store the lowest levels as bricks, see voxels_compact.h */
+#define NOR_BRICK_LEVEL 3
+#define NOR_BRICK_S (1<<NOR_BRICK_LEVEL)
 #define NOR_BRICK_S2 (NOR_BRICK_S*NOR_BRICK_S)
 #define NOR_BRICK_S3 (NOR_BRICK_S*NOR_BRICK_S2)
 
 struct OctreeNode;
+struct CompactOctree;
+struct DistanceGrid;
+struct AoCache;
+struct VoxelNormals;
 typedef struct OctreeNode
 {
 	/* Pointer to 8 child nodes (NULL for leaf nodes) */
@@ -24,29 +30,53 @@ typedef struct OctreeNode
 	int mat;
 } OctreeNode;
 
+/* Child nodes are allocated in blocks of 8 from large slabs owned by the octree */
+#define OC_SLAB_BLOCKS 4096 /* 8-child blocks per slab (512 KiB) */
+
+typedef struct OctreeSlab
+{
+	struct OctreeSlab *next;
+	OctreeNode *blocks; /* OC_SLAB_BLOCKS * 8 nodes, 64-byte aligned */
+} OctreeSlab;
+
 typedef struct Octree
 {
 	unsigned num_nodes; /* All nodes including root node. Should never be 0. */
 	int size; /* Bounding box size for root node; 1 << root_level */
 	int root_level; /* Highest (root) octree level */
 	OctreeNode root;
+	
+	/* Child block allocator. Newest slab is first in the list */
+	OctreeSlab *slabs;
+	unsigned slab_used; /* Blocks handed out from the newest slab */
+	OctreeNode *free_blocks; /* Released blocks. Linked through the first node's children pointer */
+	
+	unsigned revision; /* Incremented by every modification. Tells when derived data is out of date */
+	struct CompactOctree *compact; /* Flattened copy for traversal (see voxels_compact.h) or NULL */
+	struct DistanceGrid *dist; /* Empty space skipping (see voxels_distance.h) or NULL */
+	struct AoCache *ao_cache; /* Ambient occlusion of voxel faces (see voxels_aocache.h) or NULL */
+	struct VoxelNormals *normals; /* Surface normals written by CSG (see voxels_normals.h) or NULL */
 } Octree;
 
 #ifdef VOXEL_INTERNALS
 extern const int OC_RECURSION_MASK[8][3];
-void oc_expand_node( Octree *oc, OctreeNode *node ); /* Allocate child nodes if NULL */
-void oc_collapse_node( Octree *oc, OctreeNode *node ); /* Delete child nodes if have any */
+void oc_expand_node( Octree *oc, OctreeNode *node ); /* Allocate child nodes if NULL. O(1) */
+void oc_collapse_node( Octree *oc, OctreeNode *node ); /* Delete child nodes if have any. Blocks go back to the octree's free list */
 void get_node_bounds( aabb3f *bounds, const vec3i pos, int size );
 int get_mode_material( OctreeNode *node );
+void oc_mark_dirty( Octree *oc, const aabb3f *box ); /* Called after modifying a region (in voxels). Tells the derived data what to update */
 #endif
 
-/* Memory management */
+/* Memory management. oc_free and oc_clear release all slabs at once */
 Octree *oc_init( int toplevel );
 void oc_free( Octree *oc );
 void oc_clear( Octree *oc, int m );
+int oc_get_voxel( const Octree *oc, int x, int y, int z ); /* Material as seen by the traversals at oc_detail_level. 0 outside the volume */
 
 /* Use 0 to disable and 1 to enable */
 extern int oc_show_travel_depth; /* Replaces material with travel depth. Won't exceed MAX_MATERIALS */
 extern int oc_detail_level; /* Maximum recursion level. Used for global LOD. Use 0 for full detail  */
+extern int oc_use_bricks; /* Compact octrees store nodes at NOR_BRICK_LEVEL as dense bricks */
+extern int oc_verbose; /* Print statistics when the compact octree or the distance grid is rebuilt */
 
 #endif
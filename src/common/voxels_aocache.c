@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "voxels_aocache.h"
+
+/* Entry bits:
+	63     valid (part of the key, so that no key is 0)
+	43..58 x
+	27..42 y
+	11..26 z
+	8..10  axis_dir
+	0..7   ao */
+#define AOC_SIZE ( 1u << AOC_SIZE_LOG2 )
+#define KEY_VALID ( (uint64) 1 << 55 )
+#define COORD_MASK ( ( 1u << AOC_MAX_LEVEL ) - 1 )
+
+static size_t slot_of( uint64 key )
+{
+	return ( key * 0x9E3779B97F4A7C15ull ) >> ( 64 - AOC_SIZE_LOG2 );
+}
+
+static void clear_all( AoCache *c )
+{
+	memset( c->entries, 0, sizeof( c->entries[0] ) * AOC_SIZE );
+}
+
+/* Empties slot n and moves the rest of its cluster back so that the chains stay unbroken for ao_cache_get.
+An entry fills the hole if the hole is between its home slot and where it is now */
+static void remove_entry( AoCache *c, size_t n )
+{
+	const size_t mask = AOC_SIZE - 1;
+	size_t hole = n, j;
+	
+	for( j=( n + 1 ) & mask; j != n && c->entries[j]; j=( j + 1 ) & mask )
+	{
+		size_t home = slot_of( c->entries[j] >> 8 );
+		
+		if ( ( ( j - home ) & mask ) >= ( ( j - hole ) & mask ) ) {
+			c->entries[hole] = c->entries[j];
+			hole = j;
+		}
+	}
+	
+	c->entries[hole] = 0;
+}
+
+/* Drops the values of faces whose cell is within c->radius of the dirty box */
+static void clear_dirty( AoCache *c )
+{
+	const float cell = 1 << c->detail_level;
+	float lo[3], hi[3];
+	size_t n;
+	int k;
+	
+	for( k=0; k<3; k++ ) {
+		lo[k] = c->dirty_min[k] - c->radius - cell;
+		hi[k] = c->dirty_max[k] + c->radius;
+	}
+	
+	for( n=0; n<AOC_SIZE; )
+	{
+		uint64 e = c->entries[n];
+		float x, y, z;
+		
+		x = ( e >> 43 & COORD_MASK ) * cell;
+		y = ( e >> 27 & COORD_MASK ) * cell;
+		z = ( e >> 11 & COORD_MASK ) * cell;
+		
+		/* Slot n may get another entry of the cluster, so it is checked again */
+		if ( e && x >= lo[0] && x <= hi[0] && y >= lo[1] && y <= hi[1] && z >= lo[2] && z <= hi[2] )
+			remove_entry( c, n );
+		else
+			n++;
+	}
+}
+
+AoCache *oc_update_ao_cache( Octree *oc, float radius )
+{
+	AoCache *c = oc->ao_cache;
+	
+	if ( !c )
+	{
+		c = calloc( 1, sizeof(*c) );
+		if ( !c )
+			return NULL;
+		
+		c->entries = calloc( AOC_SIZE, sizeof( c->entries[0] ) );
+		if ( !c->entries ) {
+			free( c );
+			return NULL;
+		}
+		
+		c->detail_level = oc_detail_level;
+		c->radius = radius;
+		c->revision = c->dirty_revision = oc->revision;
+		oc->ao_cache = c;
+	}
+	
+	if ( c->detail_level != oc_detail_level || c->radius != radius || c->dirty_revision != oc->revision ) {
+		/* Different geometry or an edit that wasn't recorded */
+		clear_all( c );
+	} else if ( c->revision != oc->revision && c->dirty_min[0] <= c->dirty_max[0] ) {
+		clear_dirty( c );
+	}
+	
+	c->detail_level = oc_detail_level;
+	c->radius = radius;
+	c->revision = c->dirty_revision = oc->revision;
+	c->dirty_min[0] = c->dirty_min[1] = c->dirty_min[2] = INFINITY;
+	c->dirty_max[0] = c->dirty_max[1] = c->dirty_max[2] = -INFINITY;
+	return c;
+}
+
+void oc_free_ao_cache( AoCache *c )
+{
+	if ( c ) {
+		free( c->entries );
+		free( c );
+	}
+}
+
+void ao_cache_mark_dirty( AoCache *c, unsigned revision, const aabb3f *box )
+{
+	int k;
+	
+	/* An edit was missed. The next update clears everything anyway */
+	if ( c->dirty_revision + 1 != revision )
+		return;
+	
+	for( k=0; k<3; k++ ) {
+		c->dirty_min[k] = box->min[k] < c->dirty_min[k] ? box->min[k] : c->dirty_min[k];
+		c->dirty_max[k] = box->max[k] > c->dirty_max[k] ? box->max[k] : c->dirty_max[k];
+	}
+	
+	c->dirty_revision = revision;
+}
+
+uint64 ao_cache_key( const AoCache *c, const Octree *oc, int x, int y, int z, int axis_dir )
+{
+	int cells = oc->size >> c->detail_level;
+	
+	if ( x < 0 || y < 0 || z < 0 || x >= cells || y >= cells || z >= cells || oc->root_level > AOC_MAX_LEVEL )
+		return 0;
+	
+	return KEY_VALID | (uint64) x << 35 | (uint64) y << 19 | (uint64) z << 3 | axis_dir;
+}
+
+int ao_cache_get( const AoCache *c, uint64 key, uint8 *ao )
+{
+	size_t slot = slot_of( key );
+	int p;
+	
+	for( p=0; p<AOC_MAX_PROBES; p++ )
+	{
+		uint64 e = __atomic_load_n( c->entries + ( ( slot + p ) & ( AOC_SIZE - 1 ) ), __ATOMIC_RELAXED );
+		
+		if ( !e )
+			return 0;
+		
+		if ( e >> 8 == key ) {
+			*ao = e & 0xFF;
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+void ao_cache_put( AoCache *c, uint64 key, uint8 ao )
+{
+	uint64 e = key << 8 | ao;
+	size_t slot = slot_of( key );
+	int p;
+	
+	for( p=0; p<AOC_MAX_PROBES; p++ )
+	{
+		uint64 *s = c->entries + ( ( slot + p ) & ( AOC_SIZE - 1 ) );
+		uint64 old = __atomic_load_n( s, __ATOMIC_RELAXED );
+		
+		if ( old >> 8 == key )
+			return;
+		
+		if ( !old && __sync_bool_compare_and_swap( s, 0, e ) )
+			return;
+	}
+	
+	/* Full. Replace the first entry of the chain */
+	__atomic_store_n( c->entries + slot, e, __ATOMIC_RELAXED );
+}
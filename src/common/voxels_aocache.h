@@ -0,0 +1,45 @@
+#pragma once
+#ifndef _VOXELS_AOCACHE_H
+#define _VOXELS_AOCACHE_H
+#include "types.h"
+#include "aabb.h"
+#include "voxels.h"
+
+/* Ambient occlusion of voxel faces. Filled by the render threads the first time a face is seen
+and reused by later frames until an edit nearby drops it.
+A face is identified by the empty cell in front of it and the direction from that cell to the solid voxel.
+Cells are 2^detail_level voxels so that LOD leaves get one value per face.
+The table is shared by all render threads and never locked. A lookup can miss a value that another
+thread is storing at the same time, which only means that the value gets computed twice */
+#define AOC_SIZE_LOG2 20 /* 1M entries, 8 MiB */
+#define AOC_MAX_PROBES 8
+#define AOC_MAX_LEVEL 16 /* Cell coordinates are stored with this many bits */
+
+typedef struct AoCache
+{
+	uint64 *entries; /* Valid bit, key and value (see voxels_aocache.c). 0 is an empty slot */
+	int detail_level; /* oc_detail_level of the cached values */
+	float radius; /* How far from an edit the values can change (voxels) */
+	unsigned revision; /* Octree.revision at the time of the last update */
+	
+	/* Union of the boxes edited since the last update. Empty if min > max.
+	Covers every edit up to dirty_revision. Anything newer clears the whole cache */
+	float dirty_min[3], dirty_max[3];
+	unsigned dirty_revision;
+} AoCache;
+
+/* Brings oc->ao_cache up to date for the current oc_detail_level. Drops the values within radius of edited regions.
+Call while the render threads are idle. Returns oc->ao_cache or NULL if out of memory */
+AoCache *oc_update_ao_cache( Octree *oc, float radius );
+void oc_free_ao_cache( AoCache *c );
+void ao_cache_mark_dirty( AoCache *c, unsigned revision, const aabb3f *box );
+
+/* Face of cell (x,y,z). axis_dir is 2*axis, plus 1 if the solid voxel is on the negative side.
+Returns 0 (nothing gets cached) if the cell is outside the volume */
+uint64 ao_cache_key( const AoCache *c, const Octree *oc, int x, int y, int z, int axis_dir );
+
+/* Returns 1 and sets *ao if the face is cached. ao is 0 (fully occluded) .. 255 (open) */
+int ao_cache_get( const AoCache *c, uint64 key, uint8 *ao );
+void ao_cache_put( AoCache *c, uint64 key, uint8 ao );
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "voxels.h"
+#include "voxels_compact.h"
+
+int oc_use_bricks = 0;
+int oc_verbose = 0;
+
+typedef struct Builder
+{
+	CompactNode *nodes;
+	size_t count;
+	size_t tree_count; /* Would-be node count without sharing */
+	
+	/* Hash table of already emitted groups (for DAG only). Entries are start<<3|(len-1). Empty entries are ~0 */
+	uint64 *table;
+	size_t table_mask;
+	
+	/* Brick storage. The hash table is only used for DAGs */
+	int use_bricks;
+	uint8 *bricks;
+	size_t num_bricks, max_bricks;
+	uint64 *brick_table;
+	size_t brick_table_mask;
+} Builder;
+
+#define EMPTY_ENTRY (~(uint64)0)
+
+static uint32 hash_bytes( const uint8 *p, size_t len )
+{
+	uint32 h = 2166136261u;
+	size_t n;
+	for( n=0; n<len; n++ )
+		h = ( h ^ p[n] ) * 16777619u;
+	return h ^ h >> 15;
+}
+
+static uint32 hash_group( CompactNode const *group, int len )
+{
+	uint32 h = 2166136261u;
+	int n;
+	
+	for( n=0; n<len; n++ )
+	{
+		const CompactNode *c = group + n;
+		h = ( h ^ c->valid_mask ) * 16777619u;
+		h = ( h ^ c->leaf_mask ) * 16777619u;
+		h = ( h ^ c->mat ) * 16777619u;
+		h = ( h ^ c->flags ) * 16777619u;
+		if ( c->valid_mask || c->flags & CN_BRICK )
+			h = ( h ^ (uint32) c->child ) * 16777619u;
+	}
+	
+	return h ^ h >> 15;
+}
+
+/* Compares an emitted group (relative offsets) to a new group (absolute indices) */
+static int group_equals( const Builder *b, size_t start, CompactNode const *group, int len )
+{
+	int n;
+	
+	for( n=0; n<len; n++ )
+	{
+		const CompactNode *a = b->nodes + start + n;
+		const CompactNode *c = group + n;
+		
+		if ( a->valid_mask != c->valid_mask || a->leaf_mask != c->leaf_mask || a->mat != c->mat || a->flags != c->flags )
+			return 0;
+		
+		if ( a->valid_mask && (int64) start + n + a->child != c->child )
+			return 0;
+		
+		if ( a->flags & CN_BRICK && a->child != c->child )
+			return 0;
+	}
+	
+	return 1;
+}
+
+/* Appends a group of sibling nodes. Their child fields are absolute indices and get converted to relative offsets here.
+If an identical group already exists (DAG only), returns its index instead */
+static size_t push_group( Builder *b, CompactNode const *group, int len )
+{
+	size_t start = b->count;
+	uint64 *entry = NULL;
+	int n;
+	
+	b->tree_count += len;
+	
+	if ( b->table )
+	{
+		size_t i = hash_group( group, len ) & b->table_mask;
+		
+		for( ;; i = ( i + 1 ) & b->table_mask )
+		{
+			entry = b->table + i;
+			
+			if ( *entry == EMPTY_ENTRY )
+				break;
+			
+			if ( (int)( *entry & 7 ) + 1 == len && group_equals( b, *entry >> 3, group, len ) )
+				return *entry >> 3; /* Share the existing subtree */
+		}
+		
+		*entry = (uint64) start << 3 | ( len - 1 );
+	}
+	
+	for( n=0; n<len; n++ )
+	{
+		CompactNode c = group[n];
+		if ( c.valid_mask )
+			c.child -= start + n;
+		b->nodes[start+n] = c;
+	}
+	
+	b->count += len;
+	return start;
+}
+
+static void fill_brick( uint8 *brick, const OctreeNode *node, int x0, int y0, int z0, int size )
+{
+	if ( node->children )
+	{
+		int n;
+		size >>= 1;
+		for( n=0; n<8; n++ )
+			fill_brick( brick, node->children + n, x0 + ( n >> 2 ) * size, y0 + ( n >> 1 & 1 ) * size, z0 + ( n & 1 ) * size, size );
+	}
+	else
+	{
+		int x, y, z;
+		for( x=x0; x<x0+size; x++ ) {
+			for( y=y0; y<y0+size; y++ ) {
+				for( z=z0; z<z0+size; z++ )
+					brick[ x * NOR_BRICK_S2 + y * NOR_BRICK_S + z ] = node->mat;
+			}
+		}
+	}
+}
+
+/* Returns the brick index. Identical bricks are shared when building a DAG */
+static int32 push_brick( Builder *b, const OctreeNode *node )
+{
+	uint8 *brick;
+	uint64 *entry = NULL;
+	
+	if ( b->num_bricks == b->max_bricks )
+	{
+		size_t n = b->max_bricks ? 2 * b->max_bricks : 256;
+		uint8 *p = realloc( b->bricks, n * NOR_BRICK_S3 );
+		if ( !p ) {
+			printf( "Error: failed to allocate bricks\n" );
+			abort();
+		}
+		b->bricks = p;
+		b->max_bricks = n;
+	}
+	
+	brick = b->bricks + b->num_bricks * NOR_BRICK_S3;
+	fill_brick( brick, node, 0, 0, 0, NOR_BRICK_S );
+	
+	if ( b->brick_table )
+	{
+		size_t i = hash_bytes( brick, NOR_BRICK_S3 ) & b->brick_table_mask;
+		
+		for( ;; i = ( i + 1 ) & b->brick_table_mask )
+		{
+			entry = b->brick_table + i;
+			
+			if ( *entry == EMPTY_ENTRY )
+				break;
+			
+			if ( !memcmp( b->bricks + *entry * NOR_BRICK_S3, brick, NOR_BRICK_S3 ) )
+				return *entry;
+		}
+		
+		*entry = b->num_bricks;
+	}
+	
+	return b->num_bricks++;
+}
+
+/* Depth first (children before parents). Returns the record of the node with an absolute child index */
+static CompactNode build_node( Builder *b, const OctreeNode *node, int level )
+{
+	CompactNode c = {0};
+	c.mat = node->mat;
+	
+	if ( node->children && b->use_bricks && level == NOR_BRICK_LEVEL )
+	{
+		c.flags = CN_BRICK;
+		c.child = push_brick( b, node );
+	}
+	else if ( node->children )
+	{
+		CompactNode group[8];
+		int len = 0;
+		int k;
+		
+		for( k=0; k<8; k++ )
+		{
+			const OctreeNode *child = node->children + k;
+			
+			if ( !child->children && !child->mat )
+				continue; /* air */
+			
+			c.valid_mask |= 1 << k;
+			if ( !child->children )
+				c.leaf_mask |= 1 << k;
+			
+			group[len++] = build_node( b, child, level - 1 );
+		}
+		
+		if ( len )
+			c.child = push_group( b, group, len );
+	}
+	
+	return c;
+}
+
+static uint64 *alloc_table( size_t max_entries, size_t *mask )
+{
+	/* Keep the table at most half full */
+	size_t table_size = 16;
+	uint64 *table;
+	
+	while( table_size < 2 * max_entries )
+		table_size <<= 1;
+	
+	table = malloc( table_size * sizeof( table[0] ) );
+	if ( table )
+		memset( table, 0xFF, table_size * sizeof( table[0] ) );
+	
+	*mask = table_size - 1;
+	return table;
+}
+
+static CompactOctree *build( const Octree *oc, int dag, int use_bricks )
+{
+	CompactOctree *c;
+	CompactNode root;
+	Builder b = {0};
+	
+	c = calloc( 1, sizeof(*c) );
+	if ( !c )
+		return NULL;
+	
+	/* Never more nodes than in the source octree */
+	b.nodes = malloc( oc->num_nodes * sizeof(CompactNode) );
+	if ( !b.nodes ) {
+		free( c );
+		return NULL;
+	}
+	
+	b.use_bricks = use_bricks && oc->root_level > NOR_BRICK_LEVEL;
+	
+	if ( dag )
+	{
+		/* At most one group (or brick) per non-leaf node */
+		b.table = alloc_table( oc->num_nodes / 8 + 1, &b.table_mask );
+		if ( b.use_bricks )
+			b.brick_table = alloc_table( oc->num_nodes / 8 + 1, &b.brick_table_mask );
+		
+		if ( !b.table || ( b.use_bricks && !b.brick_table ) ) {
+			free( b.table );
+			free( b.brick_table );
+			free( b.nodes );
+			free( c );
+			return NULL;
+		}
+	}
+	
+	root = build_node( &b, &oc->root, oc->root_level );
+	c->root = push_group( &b, &root, 1 );
+	assert( b.count <= oc->num_nodes );
+	free( b.table );
+	free( b.brick_table );
+	
+	c->nodes = realloc( b.nodes, b.count * sizeof(CompactNode) );
+	if ( !c->nodes )
+		c->nodes = b.nodes;
+	
+	c->num_nodes = b.count;
+	c->num_tree_nodes = b.tree_count;
+	c->is_dag = dag;
+	c->has_bricks = use_bricks;
+	c->bricks = b.num_bricks ? realloc( b.bricks, b.num_bricks * NOR_BRICK_S3 ) : NULL;
+	c->num_bricks = b.num_bricks;
+	if ( !c->bricks )
+		c->bricks = b.bricks;
+	c->root_is_leaf = ( oc->root.children == NULL );
+	c->size = oc->size;
+	c->root_level = oc->root_level;
+	c->revision = oc->revision;
+	
+	return c;
+}
+
+CompactOctree *oc_build_compact( const Octree *oc ) {
+	return build( oc, 0, oc_use_bricks );
+}
+
+CompactOctree *oc_build_dag( const Octree *oc ) {
+	return build( oc, 1, oc_use_bricks );
+}
+
+void oc_free_compact( CompactOctree *c )
+{
+	if ( c ) {
+		free( c->nodes );
+		free( c->bricks );
+		free( c );
+	}
+}
+
+CompactOctree *oc_update_compact( Octree *oc, int dag )
+{
+	CompactOctree *c = oc->compact;
+	
+	if ( c && c->revision == oc->revision && c->is_dag == !!dag && c->has_bricks == !!oc_use_bricks )
+		return c;
+	
+	oc_free_compact( c );
+	oc->compact = c = build( oc, !!dag, !!oc_use_bricks );
+	
+	if ( c && oc_verbose ) {
+		printf( "%s: %u nodes, %u bricks, %u KiB (as a tree: %u nodes, %u KiB. pointer octree: %u nodes, %u KiB)\n",
+			dag ? "Octree DAG" : "Compact octree",
+			(unsigned) c->num_nodes,
+			(unsigned) c->num_bricks,
+			(unsigned)( ( c->num_nodes * sizeof(CompactNode) + c->num_bricks * NOR_BRICK_S3 ) >> 10 ),
+			(unsigned) c->num_tree_nodes,
+			(unsigned)( c->num_tree_nodes * sizeof(CompactNode) >> 10 ),
+			oc->num_nodes,
+			(unsigned)( oc->num_nodes * sizeof(OctreeNode) >> 10 ) );
+	}
+	
+	return c;
+}
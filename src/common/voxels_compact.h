@@ -0,0 +1,54 @@
+#pragma once
+#ifndef _VOXELS_COMPACT_H
+#define _VOXELS_COMPACT_H
+#include <stddef.h>
+#include "types.h"
+#include "voxels.h"
+
+/* A read-only, pointerless copy of an Octree. Used only for ray traversal.
+Empty (material 0) leaves are not stored at all. The stored children of a node
+sit next to each other in the node array, in child index order.
+When built with oc_build_dag, identical subtrees are stored only once and
+several parents may point to the same children (a directed acyclic graph).
+When built with oc_use_bricks, non-leaf nodes at NOR_BRICK_LEVEL are replaced by
+NOR_BRICK_S^3 arrays of materials (indexed x*S*S + y*S + z) */
+typedef struct CompactNode
+{
+	int32 child; /* Offset from this node to its first stored child. Brick index for bricks. Meaningless otherwise */
+	uint8 valid_mask; /* Bit k is set if child k is stored */
+	uint8 leaf_mask; /* Bit k is set if child k is a leaf */
+	uint8 mat; /* Same as OctreeNode.mat */
+	uint8 flags; /* CN_* */
+} CompactNode;
+
+#define CN_BRICK 1 /* The node is a brick. Does not have child nodes */
+
+typedef struct CompactOctree
+{
+	CompactNode *nodes;
+	size_t num_nodes;
+	size_t root; /* Index of the root node */
+	int root_is_leaf;
+	int size; /* Same as Octree.size */
+	int root_level; /* Same as Octree.root_level */
+	unsigned revision; /* Octree.revision at the time of building */
+	int is_dag; /* Built by oc_build_dag */
+	size_t num_tree_nodes; /* How many nodes there would be without subtree sharing */
+	int has_bricks; /* Built with oc_use_bricks */
+	uint8 *bricks; /* NOR_BRICK_S3 bytes per brick */
+	size_t num_bricks;
+} CompactOctree;
+
+/* Returns the index of stored child k of node i. Bit k of the valid_mask must be set */
+#define compact_child(nodes,i,k) \
+	( (i) + (nodes)[i].child + __builtin_popcount( (nodes)[i].valid_mask & ( ( 1u << (k) ) - 1 ) ) )
+
+/* Returns NULL if out of memory */
+CompactOctree *oc_build_compact( const Octree *oc );
+CompactOctree *oc_build_dag( const Octree *oc ); /* Hashes subtrees bottom-up and merges identical ones */
+void oc_free_compact( CompactOctree *c );
+
+/* Rebuilds oc->compact if it is missing, out of date or of the wrong kind (DAG/bricks). Returns oc->compact */
+CompactOctree *oc_update_compact( Octree *oc, int dag );
+
+#endif
@@ -4,6 +4,7 @@
 #define VOXEL_INTERNALS 1
 #include "voxels.h"
 #include "voxels_csg.h"
+#include "voxels_normals.h"
 
 typedef int (*CSG_Function)( const aabb3f *, const void * );
 typedef void (*Normal_Function)( float nor[3], const void *, float px, float py, float pz );
@@ -11,7 +12,7 @@ typedef void (*Normal_Function)( float nor[3], const void *, float px, float py,
 typedef struct CSG_Object
 {
 	CSG_Function overlaps_aabb; /* Must not be NULL. Returns NO_TOUCH, INSIDE or OVERLAP, depending on how the AABB collides the object */
-	Normal_Function calc_normal; /* Computes a normal vector */
+	Normal_Function calc_normal; /* Computes a normal vector. NULL if the face normals are exact anyway */
 	void const *data;
 	int material;
 } CSG_Object;
@@ -39,19 +40,24 @@ static int csg_operation( Octree *oc, OctreeNode *node, int level, const vec3i n
 		/* The node is completely inside the CSG object */
 		oc_collapse_node( oc, node );
 		node->mat = mat;
-		/*
-		fill_normals( oc, &node_bounds, csg_obj, mat );
-		*/
+		
+		/* None of its voxels can be on the surface. Empty neighbours would touch the object too */
+		clear_voxel_normals( oc, node_pos, size );
 		return mat;
 	}
 	
 	if ( level == 0 )
 	{
-		/*
-		float n[3];
-		get_normal( n, &node_bounds, csg_obj, mat );
-		set_voxel_normal( oc, node_pos[0], node_pos[1], node_pos[2], n[0], n[1], n[2] );
-		*/
+		if ( mat && !node->mat && csg_obj->calc_normal )
+		{
+			/* A new surface voxel. Normal at its centre.
+			Voxels that were already solid belong to the old surface where the shape cuts into it */
+			float n[3];
+			csg_obj->calc_normal( n, csg_obj->data, node_pos[0] + 0.5f, node_pos[1] + 0.5f, node_pos[2] + 0.5f );
+			set_voxel_normal( oc, node_pos[0], node_pos[1], node_pos[2], n[0], n[1], n[2] );
+		}
+		else
+			clear_voxel_normals( oc, node_pos, 1 );
 		
 		/* Leaf node and overlaps the CSG object. Mark as solid.
 		And since this is a leaf node it does not need to be collapsed */
@@ -113,43 +119,25 @@ static void calc_sphere_normal( float nor[3], const Sphere *s, float x, float y,
 	nor[2] = z;
 }
 
-static void calc_box_normal( float nor[3], const aabb3f *box, float x, float y, float z )
-{
-	x = fabs( x - ( box->min[0] + box->max[0] ) * 0.5f );
-	y = fabs( y - ( box->min[1] + box->max[1] ) * 0.5f );
-	z = fabs( z - ( box->min[2] + box->max[2] ) * 0.5f );
-	
-	if ( x > z ) {
-		nor[2] = 0;
-		if ( x > y ) {
-			nor[0] = x < 0 ? -1 : 1;
-			nor[1] = 0;
-		} else {
-			nor[0] = 0;
-			nor[1] = y < 0 ? -1 : 1;
-		}
-	} else {
-		nor[0] = 0;
-		if ( y > z ) {
-			nor[1] = y < 0 ? -1 : 1;
-			nor[2] = 0;
-		} else {
-			nor[1] = 0;
-			nor[2] = z < 0 ? -1 : 1;
-		}
-	}
-}
-
 void csg_sphere( Octree *oc, const Sphere *sph, int mat )
 {
 	const vec3i root_pos = {0, 0, 0};
 	CSG_Object ob;
+	aabb3f box;
+	int k;
 	
 	ob.overlaps_aabb = (CSG_Function) aabb_sphere_overlap;
 	ob.calc_normal = (Normal_Function) calc_sphere_normal;
 	ob.data = sph;
 	ob.material = mat;
 	csg_operation( oc, &oc->root, oc->root_level, root_pos, &ob );
+	oc->revision++;
+	
+	for( k=0; k<3; k++ ) {
+		box.min[k] = sph->o[k] - sph->r;
+		box.max[k] = sph->o[k] + sph->r;
+	}
+	oc_mark_dirty( oc, &box );
 }
 
 void csg_box( Octree *oc, const aabb3f *box, int mat )
@@ -158,8 +146,10 @@ void csg_box( Octree *oc, const aabb3f *box, int mat )
 	CSG_Object ob;
 	
 	ob.overlaps_aabb = (CSG_Function) aabb_aabb_overlap;
-	ob.calc_normal = (Normal_Function) calc_box_normal;
+	ob.calc_normal = NULL; /* Every visible voxel face of a box is parallel to a face of the box */
 	ob.data = box;
 	ob.material = mat;
 	csg_operation( oc, &oc->root, oc->root_level, root_pos, &ob );
+	oc->revision++;
+	oc_mark_dirty( oc, box );
 }
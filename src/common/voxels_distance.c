@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "voxels_distance.h"
+
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/* Marks the cells of [lo,hi) that a node covers as empty (DG_MAX_DIST) or not (0) */
+static void fill_cells( DistanceGrid *g, const OctreeNode *node, int level, const int pos[3], const int lo[3], const int hi[3] )
+{
+	int c0[3], c1[3];
+	int k, x, y, z;
+	
+	for( k=0; k<3; k++ ) {
+		int a = pos[k] >> g->cell_level;
+		int b = a + ( 1 << ( level - g->cell_level ) );
+		c0[k] = MAX( a, lo[k] );
+		c1[k] = MIN( b, hi[k] );
+		if ( c0[k] >= c1[k] )
+			return;
+	}
+	
+	if ( node->children && level > g->cell_level )
+	{
+		int half = 1 << ( level - 1 );
+		int n;
+		
+		for( n=0; n<8; n++ ) {
+			int p[3];
+			p[0] = pos[0] + ( n >> 2 & 1 ) * half;
+			p[1] = pos[1] + ( n >> 1 & 1 ) * half;
+			p[2] = pos[2] + ( n & 1 ) * half;
+			fill_cells( g, node->children + n, level - 1, p, lo, hi );
+		}
+		return;
+	}
+	
+	for( x=c0[0]; x<c1[0]; x++ ) {
+		for( y=c0[1]; y<c1[1]; y++ ) {
+			uint8 *p = g->dist + ( x * g->res + y ) * g->res;
+			for( z=c0[2]; z<c1[2]; z++ )
+				p[z] = ( node->children || node->mat ) ? 0 : DG_MAX_DIST;
+		}
+	}
+}
+
+/* Two pass chamfer transform with the 3x3x3 neighbourhood. Exact for the max norm */
+static void chamfer( uint8 *d, const int n[3] )
+{
+	const int sy = n[2], sx = n[1] * n[2];
+	int pass, x, y, z, i, j, k;
+	
+	for( pass=0; pass<2; pass++ )
+	{
+		/* Forward pass looks at the neighbours that come earlier in memory, backward pass at the later ones */
+		int s = pass ? -1 : 1;
+		int x0 = pass ? n[0]-1 : 0;
+		int y0 = pass ? n[1]-1 : 0;
+		int z0 = pass ? n[2]-1 : 0;
+		
+		for( x=x0; x>=0 && x<n[0]; x+=s ) {
+			for( y=y0; y>=0 && y<n[1]; y+=s ) {
+				for( z=z0; z>=0 && z<n[2]; z+=s )
+				{
+					uint8 *p = d + x * sx + y * sy + z;
+					int v = *p;
+					
+					if ( !v )
+						continue;
+					
+					for( i=-1; i<=0; i++ ) {
+						int nx = x + i * s;
+						if ( nx < 0 || nx >= n[0] )
+							continue;
+						for( j=-1; j<=1; j++ ) {
+							int ny = y + j * s;
+							if ( ny < 0 || ny >= n[1] || ( !i && j > 0 ) )
+								continue;
+							for( k=-1; k<=1; k++ ) {
+								int nz = z + k * s;
+								if ( nz < 0 || nz >= n[2] || ( !i && !j && k >= 0 ) )
+									continue;
+								v = MIN( v, d[ nx * sx + ny * sy + nz ] + 1 );
+							}
+						}
+					}
+					
+					*p = v;
+				}
+			}
+		}
+	}
+}
+
+/* Recomputes the cells [lo,hi) from the octree and the distances of everything within DG_MAX_DIST of them */
+static int update_region( DistanceGrid *g, const Octree *oc, const int lo[3], const int hi[3] )
+{
+	const int root_pos[3] = {0, 0, 0};
+	int a0[3], a1[3], b0[3], b1[3], n[3];
+	uint8 *tmp;
+	int k, x, y;
+	
+	fill_cells( g, &oc->root, oc->root_level, root_pos, lo, hi );
+	
+	/* Distances can change in A. They depend on the cells in B */
+	for( k=0; k<3; k++ ) {
+		a0[k] = MAX( lo[k] - DG_MAX_DIST, 0 );
+		a1[k] = MIN( hi[k] + DG_MAX_DIST, g->res );
+		b0[k] = MAX( a0[k] - DG_MAX_DIST, 0 );
+		b1[k] = MIN( a1[k] + DG_MAX_DIST, g->res );
+		n[k] = b1[k] - b0[k];
+	}
+	
+	tmp = malloc( (size_t) n[0] * n[1] * n[2] );
+	if ( !tmp )
+		return 0;
+	
+	for( x=0; x<n[0]; x++ ) {
+		for( y=0; y<n[1]; y++ ) {
+			const uint8 *src = g->dist + ( ( b0[0] + x ) * g->res + b0[1] + y ) * g->res + b0[2];
+			uint8 *dst = tmp + ( x * n[1] + y ) * n[2];
+			for( k=0; k<n[2]; k++ )
+				dst[k] = src[k] ? DG_MAX_DIST : 0;
+		}
+	}
+	
+	chamfer( tmp, n );
+	
+	for( x=a0[0]; x<a1[0]; x++ ) {
+		for( y=a0[1]; y<a1[1]; y++ ) {
+			memcpy( g->dist + ( x * g->res + y ) * g->res + a0[2],
+				tmp + ( ( x - b0[0] ) * n[1] + y - b0[1] ) * n[2] + a0[2] - b0[2],
+				a1[2] - a0[2] );
+		}
+	}
+	
+	free( tmp );
+	return 1;
+}
+
+static DistanceGrid *build( const Octree *oc )
+{
+	const int lo[3] = {0, 0, 0};
+	int hi[3];
+	DistanceGrid *g;
+	size_t num_cells, n, occupied = 0;
+	
+	g = calloc( 1, sizeof(*g) );
+	if ( !g )
+		return NULL;
+	
+	g->cell_level = MAX( DG_MIN_CELL_LEVEL, oc->root_level - DG_MAX_RES_LEVEL );
+	g->cell_level = MIN( g->cell_level, oc->root_level );
+	g->res = 1 << ( oc->root_level - g->cell_level );
+	
+	num_cells = (size_t) g->res * g->res * g->res;
+	g->dist = malloc( num_cells );
+	hi[0] = hi[1] = hi[2] = g->res;
+	
+	if ( !g->dist || !update_region( g, oc, lo, hi ) ) {
+		oc_free_distance_grid( g );
+		return NULL;
+	}
+	
+	if ( oc_verbose )
+	{
+		for( n=0; n<num_cells; n++ )
+			occupied += !g->dist[n];
+		
+		printf( "Distance grid: %d^3 cells of %d^3 voxels, %u%% not empty\n",
+			g->res, 1 << g->cell_level, (unsigned)( 100 * occupied / num_cells ) );
+	}
+	
+	return g;
+}
+
+void oc_free_distance_grid( DistanceGrid *g )
+{
+	if ( g ) {
+		free( g->dist );
+		free( g );
+	}
+}
+
+DistanceGrid *oc_update_distance_grid( Octree *oc )
+{
+	DistanceGrid *g = oc->dist;
+	
+	if ( g && g->revision == oc->revision )
+		return g;
+	
+	if ( g && g->dirty_revision == oc->revision )
+	{
+		int hi[3], empty = 0, k;
+		
+		for( k=0; k<3; k++ ) {
+			hi[k] = g->dirty_max[k] + 1;
+			empty |= g->dirty_min[k] >= hi[k];
+		}
+		
+		if ( empty || update_region( g, oc, g->dirty_min, hi ) )
+			goto done;
+	}
+	
+	oc_free_distance_grid( g );
+	oc->dist = g = build( oc );
+	if ( !g )
+		return NULL;
+
+done:
+	g->revision = g->dirty_revision = oc->revision;
+	g->dirty_min[0] = g->dirty_min[1] = g->dirty_min[2] = g->res;
+	g->dirty_max[0] = g->dirty_max[1] = g->dirty_max[2] = -1;
+	return g;
+}
+
+void distance_grid_mark_dirty( DistanceGrid *g, unsigned revision, const aabb3f *box )
+{
+	int k;
+	
+	/* An edit was missed. The next update rebuilds everything anyway */
+	if ( g->dirty_revision + 1 != revision )
+		return;
+	
+	for( k=0; k<3; k++ ) {
+		int a = (int) floorf( box->min[k] ) >> g->cell_level;
+		int b = (int) floorf( box->max[k] ) >> g->cell_level;
+		g->dirty_min[k] = MIN( g->dirty_min[k], MAX( a, 0 ) );
+		g->dirty_max[k] = MAX( g->dirty_max[k], MIN( b, g->res - 1 ) );
+	}
+	
+	g->dirty_revision = revision;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef _VOXELS_DISTANCE_H
+#define _VOXELS_DISTANCE_H
+#include "types.h"
+#include "aabb.h"
+#include "voxels.h"
+
+/* Coarse chessboard distance field of an Octree. Used by oc_traverse_grid to leap over empty space.
+The volume is split into cells of 2^cell_level voxels. dist holds the distance (in cells, max norm)
+from each cell to the nearest non-empty cell, capped at DG_MAX_DIST. 0 means the cell is not empty.
+Cells are indexed x*res*res + y*res + z like bricks */
+#define DG_MIN_CELL_LEVEL NOR_BRICK_LEVEL /* 8^3 voxels */
+#define DG_MAX_RES_LEVEL 7 /* at most 128^3 cells */
+#define DG_MAX_DIST 31 /* Also how far an edit can change distances */
+
+typedef struct DistanceGrid
+{
+	uint8 *dist;
+	int res; /* cells per side */
+	int cell_level;
+	unsigned revision; /* Octree.revision at the time of the last update */
+	
+	/* Cells touched by edits since the last update (inclusive). Empty if min > max.
+	Covers every edit up to dirty_revision. Anything newer forces a full rebuild */
+	int dirty_min[3], dirty_max[3];
+	unsigned dirty_revision;
+} DistanceGrid;
+
+/* Brings oc->dist up to date. Only the cells near edited regions are recomputed when possible.
+Returns oc->dist or NULL if out of memory */
+DistanceGrid *oc_update_distance_grid( Octree *oc );
+void oc_free_distance_grid( DistanceGrid *g );
+
+/* Called by oc_mark_dirty. revision is the Octree.revision after the edit */
+void distance_grid_mark_dirty( DistanceGrid *g, unsigned revision, const aabb3f *box );
+
+#endif
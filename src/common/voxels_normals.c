@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include "voxels_normals.h"
+
+#define LOCAL_MASK ( NOR_BRICK_S - 1 )
+
+static size_t slot_of( const VoxelNormals *vn, int cx, int cy, int cz )
+{
+	uint64 key = (uint64)(uint32) cx << 42 ^ (uint64)(uint32) cy << 21 ^ (uint32) cz;
+	return ( key * 0x9E3779B97F4A7C15ull ) >> 32 & ( vn->table_size - 1 );
+}
+
+static NormalChunk *find_chunk( const VoxelNormals *vn, int cx, int cy, int cz )
+{
+	size_t slot = slot_of( vn, cx, cy, cz );
+	NormalChunk *c;
+	
+	while( ( c = vn->table[slot] ) != NULL )
+	{
+		if ( c->pos[0] == cx && c->pos[1] == cy && c->pos[2] == cz )
+			return c;
+		slot = ( slot + 1 ) & ( vn->table_size - 1 );
+	}
+	
+	return NULL;
+}
+
+static void insert_chunk( VoxelNormals *vn, NormalChunk *c )
+{
+	size_t slot = slot_of( vn, c->pos[0], c->pos[1], c->pos[2] );
+	
+	while( vn->table[slot] )
+		slot = ( slot + 1 ) & ( vn->table_size - 1 );
+	
+	vn->table[slot] = c;
+}
+
+/* Returns 0 if out of memory. The old table is kept then */
+static int grow_table( VoxelNormals *vn, size_t new_size )
+{
+	NormalChunk **old = vn->table;
+	size_t old_size = vn->table_size, n;
+	
+	vn->table = calloc( new_size, sizeof( vn->table[0] ) );
+	if ( !vn->table ) {
+		vn->table = old;
+		return 0;
+	}
+	
+	vn->table_size = new_size;
+	
+	for( n=0; n<old_size; n++ ) {
+		if ( old[n] )
+			insert_chunk( vn, old[n] );
+	}
+	
+	free( old );
+	return 1;
+}
+
+VoxelNormals *oc_enable_normals( Octree *oc )
+{
+	VoxelNormals *vn = oc->normals;
+	
+	if ( vn )
+		return vn;
+	
+	vn = calloc( 1, sizeof(*vn) );
+	if ( !vn )
+		return NULL;
+	
+	if ( !grow_table( vn, (size_t) 1 << VN_MIN_TABLE_LOG2 ) ) {
+		free( vn );
+		return NULL;
+	}
+	
+	oc->normals = vn;
+	return vn;
+}
+
+void oc_clear_normals( VoxelNormals *vn )
+{
+	size_t n;
+	
+	for( n=0; n<vn->table_size; n++ ) {
+		free( vn->table[n] );
+		vn->table[n] = NULL;
+	}
+	
+	vn->num_chunks = 0;
+}
+
+void oc_free_normals( VoxelNormals *vn )
+{
+	if ( vn ) {
+		oc_clear_normals( vn );
+		free( vn->table );
+		free( vn );
+	}
+}
+
+void set_voxel_normal( Octree *oc, int x, int y, int z, float nx, float ny, float nz )
+{
+	VoxelNormals *vn = oc->normals;
+	NormalChunk *c;
+	int i;
+	
+	if ( !vn )
+		return;
+	
+	c = find_chunk( vn, x >> NOR_BRICK_LEVEL, y >> NOR_BRICK_LEVEL, z >> NOR_BRICK_LEVEL );
+	
+	if ( !c )
+	{
+		/* Keep the table at most half full so that probe chains stay short */
+		if ( 2 * ( vn->num_chunks + 1 ) > vn->table_size && !grow_table( vn, 2 * vn->table_size ) )
+			return;
+		
+		c = calloc( 1, sizeof(*c) );
+		if ( !c )
+			return;
+		
+		c->pos[0] = x >> NOR_BRICK_LEVEL;
+		c->pos[1] = y >> NOR_BRICK_LEVEL;
+		c->pos[2] = z >> NOR_BRICK_LEVEL;
+		insert_chunk( vn, c );
+		vn->num_chunks++;
+	}
+	
+	i = ( x & LOCAL_MASK ) * NOR_BRICK_S2 + ( y & LOCAL_MASK ) * NOR_BRICK_S + ( z & LOCAL_MASK );
+	c->nor[i] = pack_normal( nx, ny, nz );
+	c->has[i >> 6] |= (uint64) 1 << ( i & 63 );
+}
+
+/* Clears the bits of the voxels of chunk c that are within [lo,hi) */
+static void clear_chunk( NormalChunk *c, const int lo[3], const int hi[3] )
+{
+	int b[3], e[3], x, y, z, k;
+	
+	for( k=0; k<3; k++ ) {
+		int base = c->pos[k] << NOR_BRICK_LEVEL;
+		b[k] = lo[k] > base ? lo[k] - base : 0;
+		e[k] = hi[k] < base + NOR_BRICK_S ? hi[k] - base : NOR_BRICK_S;
+		if ( b[k] >= e[k] )
+			return;
+	}
+	
+	if ( !b[0] && !b[1] && !b[2] && e[0] == NOR_BRICK_S && e[1] == NOR_BRICK_S && e[2] == NOR_BRICK_S ) {
+		memset( c->has, 0, sizeof( c->has ) );
+		return;
+	}
+	
+	for( x=b[0]; x<e[0]; x++ ) {
+		for( y=b[1]; y<e[1]; y++ ) {
+			for( z=b[2]; z<e[2]; z++ ) {
+				int i = x * NOR_BRICK_S2 + y * NOR_BRICK_S + z;
+				c->has[i >> 6] &= ~( (uint64) 1 << ( i & 63 ) );
+			}
+		}
+	}
+}
+
+void clear_voxel_normals( Octree *oc, const vec3i pos, int size )
+{
+	VoxelNormals *vn = oc->normals;
+	int lo[3], hi[3], c0[3], c1[3];
+	size_t num_positions = 1, n;
+	int k;
+	
+	if ( !vn || !vn->num_chunks )
+		return;
+	
+	for( k=0; k<3; k++ ) {
+		lo[k] = pos[k];
+		hi[k] = pos[k] + size;
+		c0[k] = lo[k] >> NOR_BRICK_LEVEL;
+		c1[k] = ( hi[k] - 1 ) >> NOR_BRICK_LEVEL;
+		num_positions *= c1[k] - c0[k] + 1;
+	}
+	
+	if ( num_positions > vn->table_size )
+	{
+		/* Large regions: visit the chunks that exist instead of every position */
+		for( n=0; n<vn->table_size; n++ ) {
+			if ( vn->table[n] )
+				clear_chunk( vn->table[n], lo, hi );
+		}
+	}
+	else
+	{
+		int cx, cy, cz;
+		
+		for( cx=c0[0]; cx<=c1[0]; cx++ ) {
+			for( cy=c0[1]; cy<=c1[1]; cy++ ) {
+				for( cz=c0[2]; cz<=c1[2]; cz++ ) {
+					NormalChunk *c = find_chunk( vn, cx, cy, cz );
+					if ( c )
+						clear_chunk( c, lo, hi );
+				}
+			}
+		}
+	}
+}
+
+int get_voxel_normal( const VoxelNormals *vn, int x, int y, int z, PNor *n )
+{
+	const NormalChunk *c = find_chunk( vn, x >> NOR_BRICK_LEVEL, y >> NOR_BRICK_LEVEL, z >> NOR_BRICK_LEVEL );
+	int i;
+	
+	if ( !c )
+		return 0;
+	
+	i = ( x & LOCAL_MASK ) * NOR_BRICK_S2 + ( y & LOCAL_MASK ) * NOR_BRICK_S + ( z & LOCAL_MASK );
+	
+	if ( !( c->has[i >> 6] >> ( i & 63 ) & 1 ) )
+		return 0;
+	
+	*n = c->nor[i];
+	return 1;
+}
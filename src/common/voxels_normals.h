@@ -0,0 +1,44 @@
+#pragma once
+#ifndef _VOXELS_NORMALS_H
+#define _VOXELS_NORMALS_H
+#include "types.h"
+#include "vector.h"
+#include "normals.h"
+#include "voxels.h"
+
+/* Surface normals of single voxels. An optional channel next to the materials that the CSG operations fill
+(see voxels_csg.c). Empty voxels that the surface of an added shape fills get the shape's normal. Other voxels have none
+and are shaded with the normal of the face that the ray hit.
+Normals are kept in chunks of NOR_BRICK_S^3 voxels (indexed x*S*S + y*S + z like bricks) that are only
+allocated where some voxel has a normal. The chunks are found through a hash table keyed by chunk position.
+Edits must happen while the render threads are idle. Lookups don't lock anything */
+#define VN_MIN_TABLE_LOG2 10
+
+typedef struct NormalChunk
+{
+	int pos[3]; /* Voxel coordinates >> NOR_BRICK_LEVEL */
+	uint64 has[NOR_BRICK_S3/64]; /* Bit per voxel that has a normal */
+	PNor nor[NOR_BRICK_S3];
+} NormalChunk;
+
+typedef struct VoxelNormals
+{
+	NormalChunk **table; /* Open addressing. NULL is an empty slot */
+	size_t table_size; /* Power of 2. Grows when half full */
+	size_t num_chunks; /* Chunks aren't freed when they become empty. oc_clear frees them all */
+} VoxelNormals;
+
+/* Creates oc->normals if it doesn't exist. Only edits made after this store normals.
+Returns oc->normals or NULL if out of memory */
+VoxelNormals *oc_enable_normals( Octree *oc );
+void oc_free_normals( VoxelNormals *vn );
+void oc_clear_normals( VoxelNormals *vn ); /* Removes every normal */
+
+/* Both do nothing if oc->normals is NULL. (nx,ny,nz) must be unit length */
+void set_voxel_normal( Octree *oc, int x, int y, int z, float nx, float ny, float nz );
+void clear_voxel_normals( Octree *oc, const vec3i pos, int size ); /* Cube of size^3 voxels starting at pos */
+
+/* Returns 1 and sets *n if voxel (x,y,z) has a normal. Coordinates outside the volume have none */
+int get_voxel_normal( const VoxelNormals *vn, int x, int y, int z, PNor *n );
+
+#endif
@@ -0,0 +1,166 @@
+#include <string.h>
+#include <math.h>
+#include "render_buffers.h"
+#include "render_core.h"
+#include "render_threads.h"
+#include "voxrender.h"
+
+/* render_resx must be a multiple of 16. Wider buffers get cropped when copying */
+static size_t padded_width( int w ) {
+	return ( w + 15 ) & ~15;
+}
+
+/* Waits for the frame in flight. Afterwards it's the last finished frame (render_output_rgba, render_last_*) */
+static int finish_frame( VoxRender *vr )
+{
+	if ( !vr->in_flight )
+		return 0;
+	
+	end_volume_rendering( &vr->perf );
+	swap_render_buffers();
+	vr->in_flight = 0;
+	return 1;
+}
+
+int voxrender_resize( VoxRender *vr, int width, int height )
+{
+	if ( width <= 0 || height <= 0 )
+		return 0;
+	
+	/* The buffers of the frame in flight are about to be freed */
+	finish_frame( vr );
+	
+	vr->width = width;
+	vr->height = height;
+	
+	resize_render_output( padded_width( width ), height );
+	
+	if ( render_resx != padded_width( width ) || render_resy != (size_t) height )
+		return 0;
+	
+	/* Only the first resize after init or shutdown starts the threads */
+	if ( num_render_threads != vr->num_threads )
+		start_render_threads( vr->num_threads );
+	
+	return 1;
+}
+
+int voxrender_init( VoxRender *vr, int width, int height, int num_threads )
+{
+	memset( vr, 0, sizeof(*vr) );
+	
+	vr->num_threads = num_threads > 0 ? num_threads : 1;
+	vr->phong = 1;
+	vr->voxel_normals = 1;
+	vr->light_pos[0] = 1000;
+	vr->light_pos[1] = 800;
+	vr->light_pos[2] = -300;
+	
+	vr->camera.pos[0] = 0.5f;
+	vr->camera.pos[1] = 0.5f;
+	vr->camera.pos[2] = -1.0f;
+	set_projection( &vr->camera, M_PI / 3, width / (float) height );
+	update_camera_matrix( &vr->camera );
+	
+	return voxrender_resize( vr, width, height );
+}
+
+static void copy_rows( void *dst, size_t dst_stride, const void *src, size_t src_stride, size_t row_bytes, size_t rows )
+{
+	size_t y;
+	for( y=0; y<rows; y++ )
+		memcpy( (uint8*) dst + y * dst_stride, (const uint8*) src + y * src_stride, row_bytes );
+}
+
+/* Copies the last finished frame to the outputs */
+static void copy_outputs( VoxRender *vr )
+{
+	size_t w = vr->width, h = vr->height;
+	
+	if ( vr->out_rgb )
+		copy_rows( vr->out_rgb, vr->out_stride * 4, render_output_rgba, render_resx * 4, w * 4, h );
+	if ( vr->out_depth )
+		copy_rows( vr->out_depth, vr->out_stride * sizeof(float), render_last_z, render_resx * sizeof(float), w * sizeof(float), h );
+	if ( vr->out_mat )
+		copy_rows( vr->out_mat, vr->out_stride, render_last_m, render_resx, w, h );
+}
+
+int voxrender_frame( VoxRender *vr )
+{
+	size_t h = vr->height;
+	int finished;
+	
+	if ( !vr->volume )
+		return 0;
+	
+	if ( render_resx != padded_width( vr->width ) || render_resy != h || num_render_threads <= 0 ) {
+		if ( !voxrender_resize( vr, vr->width, vr->height ) )
+			return 0;
+	}
+	
+	/* The workers read the settings below */
+	finished = finish_frame( vr );
+	
+	enable_shadows = vr->shadows;
+	enable_phong = vr->phong;
+	enable_aoccl = vr->aoccl;
+	enable_ao_cache = vr->ao_cache;
+	enable_progressive = vr->progressive;
+	enable_checkerboard = vr->checkerboard;
+	enable_voxel_normals = vr->voxel_normals;
+	enable_dac_method = vr->dac_method;
+	traversal_method = vr->traversal_method;
+	enable_reprojection = vr->reprojection;
+	enable_beam_prepass = vr->beam_prepass;
+	set_light_pos( vr->light_pos[0], vr->light_pos[1], vr->light_pos[2] );
+	
+	begin_volume_rendering( &vr->camera, vr->volume );
+	vr->in_flight = 1;
+	
+	if ( !vr->pipelined )
+		finished = finish_frame( vr );
+	
+	/* Overlaps with the rendering of the next frame when pipelined */
+	if ( finished )
+		copy_outputs( vr );
+	
+	return finished;
+}
+
+int voxrender_finish( VoxRender *vr )
+{
+	if ( !finish_frame( vr ) )
+		return 0;
+	
+	copy_outputs( vr );
+	return 1;
+}
+
+void voxrender_shutdown( VoxRender *vr )
+{
+	finish_frame( vr );
+	stop_render_threads();
+	free_render_scratch();
+	resize_render_buffers( 0, 0 );
+	vr->num_threads = 0;
+}
+
+void voxrender_set_material( int m, uint8 r, uint8 g, uint8 b )
+{
+	const float gamma = ENABLE_GAMMA_CORRECTION ? THE_GAMMA_VALUE : 1;
+	
+	if ( m <= 0 || m >= NUM_MATERIALS )
+		return;
+	
+	materials_diff[m][0] = pow( r / 255.0f, gamma );
+	materials_diff[m][1] = pow( g / 255.0f, gamma );
+	materials_diff[m][2] = pow( b / 255.0f, gamma );
+	materials_spec[m][0] = 1;
+	materials_spec[m][1] = 1;
+	materials_spec[m][2] = 1;
+	materials_spec[m][3] = 1;
+	materials_rgb[m] = (uint32) r << 16 | g << 8 | b;
+	
+	/* Accumulated frames have the old color */
+	reset_progressive();
+}
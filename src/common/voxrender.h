@@ -0,0 +1,73 @@
+#pragma once
+#ifndef _VOXRENDER_H
+#define _VOXRENDER_H
+#include <stddef.h>
+#include "types.h"
+#include "camera.h"
+#include "voxels.h"
+#include "render_threads.h"
+
+/* Offscreen rendering without SDL. Built as libvoxrender.
+The renderer core keeps its state in globals (render_buffers.h, render_core.h),
+so only one VoxRender should be active at a time */
+typedef struct VoxRender
+{
+	/* Set by voxrender_init. Use voxrender_resize to change */
+	int width, height;
+	int num_threads;
+	
+	/* Scene. The caller updates these before each frame. camera.pos is in volume units (0..1) */
+	Camera camera;
+	Octree *volume;
+	float light_pos[3];
+	
+	/* Same as the globals in render_core.h */
+	int shadows;
+	int phong;
+	int aoccl;
+	int ao_cache;
+	int progressive;
+	int checkerboard;
+	int voxel_normals;
+	int dac_method;
+	int traversal_method;
+	int reprojection;
+	int beam_prepass;
+	
+	/* voxrender_frame returns while the frame is still being rendered. Its results come out of the next call.
+	Call voxrender_finish before changing the volume or materials */
+	int pipelined;
+	int in_flight; /* A pipelined frame is being rendered. Managed by voxrender */
+	
+	/* Caller provided outputs. Rows are out_stride pixels apart. NULL outputs are not written */
+	uint32 *out_rgb; /* 0x00RRGGBB */
+	float *out_depth;
+	uint8 *out_mat;
+	size_t out_stride;
+	
+	/* Timing of the last finished frame. A pipelined frame is timed from its start until it is collected */
+	RayPerfInfo perf;
+} VoxRender;
+
+/* Sets defaults, allocates render buffers and starts num_threads (at least 1) render threads.
+Returns 0 on failure */
+int voxrender_init( VoxRender *vr, int width, int height, int num_threads );
+
+/* Returns 0 on failure */
+int voxrender_resize( VoxRender *vr, int width, int height );
+
+/* Renders one frame and copies it to the outputs. Returns 0 if there's nothing to render.
+Pipelined: starts rendering the frame and copies the previous one to the outputs instead.
+Returns 1 if there was a previous frame, else 0 */
+int voxrender_frame( VoxRender *vr );
+
+/* Waits for the pipelined frame being rendered and copies it to the outputs. Returns 0 if there was none */
+int voxrender_finish( VoxRender *vr );
+
+/* Stops the threads and frees the render buffers. Doesn't touch the volume */
+void voxrender_shutdown( VoxRender *vr );
+
+/* Sets material m (0..NUM_MATERIALS-1). Materials are black until set. Material 0 is air and stays black */
+void voxrender_set_material( int m, uint8 r, uint8 g, uint8 b );
+
+#endif
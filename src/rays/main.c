@@ -11,6 +11,7 @@
 #include "voxels.h"
 #include "voxels_io.h"
 #include "voxels_csg.h"
+#include "voxels_normals.h"
 #include "city.h"
 
 #include "camera.h"
@@ -22,6 +23,8 @@
 #include "rasterizer.h"
 #include "world_gen.h"
 #include "microsec.h"
+#include "dynres.h"
+#include "upscale.h"
 
 #include "oc_rasterizer.h"
 
@@ -29,6 +32,7 @@
 #define DEFAULT_RESY 600
 #define DEFAULT_OCTREE_DEPTH 9
 #define DEFAULT_THREADS 6
+#define DEFAULT_FRAME_BUDGET 33 /* ms. For dynamic resolution */
 
 #define DEFAULT_FOV radians(65)
 #define FOV_INCR radians(5)
@@ -47,7 +51,19 @@ static int mouse_y = 0;
 
 static SDL_Surface *screen = NULL;
 static int benchmark_mode = 0;
-static int upscale_shift = 0;
+
+/* Render resolution relative to the window. The render buffers are always allocated for the whole window */
+enum {
+	RES_FULL=0,
+	RES_HALF,
+	RES_DYNAMIC, /* Keeps frames within frame_budget. see dynres.h */
+	NUM_RES_MODES
+};
+static const char *const RES_MODE_NAMES[NUM_RES_MODES] = {"full", "half", "dynamic"};
+static int res_mode = RES_FULL;
+static DynRes dynres;
+static uint64 frame_budget = DEFAULT_FRAME_BUDGET * 1000; /* microseconds */
+static size_t shown_w = 0, shown_h = 0; /* Size of the frame in render_output_rgba */
 
 static float light_a1 = 0;
 static float light_a2 = 0;
@@ -57,6 +73,51 @@ static int moving_light = 0;
 static Octree *the_volume = NULL;
 static Camera the_camera;
 
+/* Camera path recording (F12). One line per frame, read by voxbench.bin -path= */
+#define CAMERA_PATH_FILE "camera_path.txt"
+static FILE *camera_path_file = NULL;
+
+static void toggle_camera_path_recording( void )
+{
+	if ( camera_path_file ) {
+		fclose( camera_path_file );
+		camera_path_file = NULL;
+		printf( "Stopped recording camera path\n" );
+		return;
+	}
+	
+	camera_path_file = fopen( CAMERA_PATH_FILE, "w" );
+	if ( !camera_path_file ) {
+		printf( "Error: Failed to open %s\n", CAMERA_PATH_FILE );
+		return;
+	}
+	
+	fprintf( camera_path_file, "# x y z yaw pitch\n" );
+	printf( "Recording camera path to %s\n", CAMERA_PATH_FILE );
+}
+
+#define RENDER_TRACE_FILE "render_trace.json"
+
+/* Starts recording render stage events or writes the recorded events to RENDER_TRACE_FILE */
+static void toggle_profiler( void )
+{
+	enable_profiler = !enable_profiler;
+	
+	if ( enable_profiler ) {
+		clear_render_trace();
+		printf( "Profiling render stages\n" );
+	} else if ( write_render_trace( RENDER_TRACE_FILE ) )
+		printf( "Wrote %s (open in chrome://tracing or ui.perfetto.dev)\n", RENDER_TRACE_FILE );
+	else
+		printf( "Error: Failed to write %s\n", RENDER_TRACE_FILE );
+}
+
+static void record_camera_path( const Camera *c )
+{
+	if ( camera_path_file )
+		fprintf( camera_path_file, "%f %f %f %f %f\n", c->pos[0], c->pos[1], c->pos[2], c->yaw, c->pitch );
+}
+
 static void get_light_pos( float p[3] )
 {
 	float x, y, z;
@@ -86,11 +147,28 @@ static void update_light_pos( void )
 
 static void quit( /* any number of arguments */ )
 {
+	if ( camera_path_file )
+		fclose( camera_path_file );
 	stop_render_threads();
 	SDL_Quit();
 	exit(0);
 }
 
+/* Sets the render resolution of res_mode. Dynamic resolution starts over from the whole window */
+static void apply_res_mode( void )
+{
+	int w = screen->w, h = screen->h;
+	
+	if ( res_mode == RES_HALF ) {
+		w >>= 1;
+		h >>= 1;
+	}
+	
+	dynres_init( &dynres, frame_budget );
+	ao_sample_count = NUM_AO_SAMPLES;
+	set_render_resolution( w, h );
+}
+
 static void resize( int w, int h, int extra_flags )
 {
 	int flags;
@@ -108,7 +186,12 @@ static void resize( int w, int h, int extra_flags )
 		exit(0);
 	}
 	
-	resize_render_output( w >> upscale_shift, h >> upscale_shift );
+	resize_render_output( w, h );
+	apply_res_mode();
+	
+	/* The old frame is gone */
+	shown_w = render_resx;
+	shown_h = render_resy;
 }
 
 static void setup_test_scene( Octree *volume )
@@ -117,6 +200,9 @@ static void setup_test_scene( Octree *volume )
 	aabb3f box;
 	int n;
 	
+	/* Spheres drawn with the brush get smooth normals */
+	oc_enable_normals( volume );
+	
 	#if 1
 	oc_clear( the_volume, 0 );
 	generate_city( volume );
@@ -163,7 +249,7 @@ static void shoot( int win_x, int win_y, int m )
 	y = win_y / (float) screen->h * render_resy;
 	
 	get_primary_ray( &ray, &the_camera, the_volume, x, y );
-	depth = oc_traverse( the_volume, &mat, ray.o[0], ray.o[1], ray.o[2], ray.d[0], ray.d[1], ray.d[2], NAN );
+	depth = oc_traverse( the_volume, &mat, NULL, ray.o[0], ray.o[1], ray.o[2], ray.d[0], ray.d[1], ray.d[2], NAN );
 	
 	if ( mat != 0 )
 	{
@@ -448,7 +534,15 @@ static void draw_text_overlay( SDL_Surface *surf, RayPerfInfo perf, Camera *came
 		"Depth: %d/%d\n"
 		"Nodes: %u\n"
 		"Mat=%d\n"
-		"DAC=%d\n"
+		"DAC: %s%s%s\n"
+		"Traversal: %s%s\n"
+		"Reprojection: %s (%u%%)\n"
+		"Beam pre-pass: %s (%u%% skipped)\n"
+		"AO cache: %s (%u%% hits)\n"
+		"Progressive: %s (%u frames)\n"
+		"Checkerboard: %s\n"
+		"Voxel normals: %s (%u chunks)\n"
+		"Resolution: %s (%d AO rays)\n"
 		"(%.2f,%.2f,%.2f)"
 		"(%.2f,%.2f,%.2f)"
 		,
@@ -457,7 +551,24 @@ static void draw_text_overlay( SDL_Surface *surf, RayPerfInfo perf, Camera *came
 		(int) the_volume->root_level,
 		the_volume->num_nodes,
 		brush_mat,
-		enable_dac_method,
+		enable_dac_method & DAC_PRIMARY ? "primary " : "",
+		enable_dac_method & DAC_SHADOW ? "shadow " : "",
+		enable_dac_method & DAC_AO ? "AO" : "",
+		TRAVERSAL_METHOD_NAMES[traversal_method],
+		oc_use_bricks ? "+bricks" : "",
+		enable_reprojection ? "on" : "off",
+		(unsigned)( perf.stats.rays[RAY_PRIMARY] ? 100 * perf.stats.reprojected / perf.stats.rays[RAY_PRIMARY] : 0 ),
+		enable_beam_prepass ? "on" : "off",
+		(unsigned)( perf.stats.rays[RAY_PRIMARY] ? 100 * perf.stats.beam_skipped / perf.stats.rays[RAY_PRIMARY] : 0 ),
+		enable_ao_cache ? "on" : "off",
+		(unsigned)( perf.stats.ao_pixels ? 100 * perf.stats.ao_cached / perf.stats.ao_pixels : 0 ),
+		enable_progressive ? "on" : "off",
+		enable_progressive ? progressive_frame + 1 : 0,
+		enable_checkerboard ? "on" : "off",
+		enable_voxel_normals ? "on" : "off",
+		the_volume->normals ? (unsigned) the_volume->normals->num_chunks : 0,
+		RES_MODE_NAMES[res_mode],
+		enable_progressive ? PROGRESSIVE_AO_SAMPLES : ao_sample_count,
 		camera->pos[0],
 		camera->pos[1],
 		camera->pos[2],
@@ -474,6 +585,43 @@ static void draw_text_overlay( SDL_Surface *surf, RayPerfInfo perf, Camera *came
 	
 	draw_text( surf, surf->w - strlen(buf) * GLYPH_W, surf->h - GLYPH_H, buf );
 	
+	#ifdef TRAVERSAL_STATS
+	{
+		/* Per ray averages. Shadow rays from sky pixels aren't counted */
+		const TraversalTotals *pt = perf.stats.traversal + RAY_PRIMARY;
+		const TraversalTotals *st = perf.stats.traversal + RAY_SHADOW;
+		double pr = pt->rays ? pt->rays : 1, sr = st->rays ? st->rays : 1;
+		
+		draw_text_f( surf, 0, surf->h - 3*GLYPH_H,
+			"Primary: nodes %.1f tests %.1f early-outs %.1f depth %.1f/%u\n"
+			"Shadow:  nodes %.1f tests %.1f early-outs %.1f depth %.1f/%u\n",
+			pt->nodes / pr, pt->aabb_tests / pr, pt->early_outs / pr, pt->depth_sum / pr, (unsigned) pt->max_depth,
+			st->nodes / sr, st->aabb_tests / sr, st->early_outs / sr, st->depth_sum / sr, (unsigned) st->max_depth );
+	}
+	#endif
+	
+	if ( enable_profiler )
+	{
+		/* Stage times are summed over all threads */
+		char *p = buf;
+		int k;
+		
+		for( k=0; k<STAGE_FRAME; k++ ) {
+			p += sprintf( p, "%s:%3u.%u ", RENDER_STAGE_NAMES[k],
+				(unsigned)( perf.stats.stage_time[k] / 1000 ), (unsigned)( perf.stats.stage_time[k] / 100 % 10 ) );
+		}
+		
+		draw_text( surf, surf->w - strlen(buf) * GLYPH_W, surf->h - 3*GLYPH_H, buf );
+		
+		snprintf( buf, sizeof(buf), "REC %s|thread ms: min %u.%u max %u.%u (#%d) ",
+			RENDER_TRACE_FILE,
+			(unsigned)( perf.min_busy_time / 1000 ), (unsigned)( perf.min_busy_time / 100 % 10 ),
+			(unsigned)( perf.max_busy_time / 1000 ), (unsigned)( perf.max_busy_time / 100 % 10 ),
+			perf.slowest_thread );
+		
+		draw_text( surf, surf->w - strlen(buf) * GLYPH_W, surf->h - 2*GLYPH_H, buf );
+	}
+	
 	graph.bounds.x = surf->w - graph.bounds.w - 3;
 	graph.bounds.y = 50;
 	
@@ -542,33 +690,6 @@ static void load_materials( SDL_PixelFormat *format )
 	printf( "Ok\n" );
 }
 
-static void blit2x( uint32 *dst, uint32 *src, size_t w, size_t h, size_t dst_pitch )
-{
-	float *dst0, *dst1;
-	size_t y, x;
-	
-	dst_pitch >>= 2;
-	dst0 = (float*) dst;
-	dst1 = dst0 + dst_pitch;
-	dst_pitch <<= 1;
-	
-	for( y=0; y<h; y++ ) {
-		for( x=0; x<w; x+=4,src+=4 ) {
-			__m128 a, b;
-			a = _mm_load_ps( (void*) src );
-			b = _mm_unpackhi_ps( a, a );
-			a = _mm_unpacklo_ps( a, a );
-			_mm_store_ps( dst0+2*x+4, b );
-			_mm_store_ps( dst1+2*x+4, b );
-			_mm_store_ps( dst0+2*x, a );
-			_mm_store_ps( dst1+2*x, a );
-			/* SDL better align the memory or else... */
-		}
-		dst0 += dst_pitch;
-		dst1 += dst_pitch;
-	}
-}
-
 static const char HELP_TEXT[] = \
 "Usage:\n"
 "    rays.bin [options]\n"
@@ -577,7 +698,9 @@ static const char HELP_TEXT[] = \
 "  -res=WxH    Window size\n"
 "  -d=N        Set maximum octree depth\n"
 "  -t=N        Rendering threads (0=single thread)\n"
-"  -bench      Run benchmark\n"
+"  -budget=MS  Frame time that dynamic resolution aims for (default 33)\n"
+"  -bench      Compare DAC and per-ray traversal for primary, shadow and AO rays, then exit\n"
+"  -v          Print statistics whenever the compact octree or distance grid is rebuilt\n"
 "Key mappings:\n"
 "  1,2,3,4,5: set brush radius\n"
 "  F1: dump octree to file\n"
@@ -585,17 +708,28 @@ static const char HELP_TEXT[] = \
 "  F3: reset camera\n"
 "  F4: regenerate the volume\n"
 "  F5: toggle fullscreen\n"
-"  F6: switch shading modes\n"
+"  F6: switch shading modes (shaded, octree depth, normals, traversal cost heatmap with stats=1)\n"
 "  F7,f8: adjust octree traversal depth\n"
 "  F9,f10: adjust field of view\n"
 "  F11: toggle shadows\n"
+"  F12: start/stop recording the camera path to " CAMERA_PATH_FILE " (for voxbench.bin -path=)\n"
 "  Space: grab cursor\n"
 "  P: enable phong\n"
-"  U: enable 2x upscaling\n"
+"  U: render resolution (full, half, dynamic within the frame time budget)\n"
 "  Y: show depth buffer\n"
 "  O: enable ambient occlusion\n"
-"  I: toggle traversal method\n"
+"  J: reuse the ambient occlusion of voxel faces between frames\n"
+"  V: refine AO and soft shadows over frames while the view stays still\n"
+"  X: checkerboard rendering (half the primary rays per frame)\n"
+"  N: light brush spheres with the normals stored per voxel instead of the face normals\n"
+"  I: cycle ray types traced with the DAC method (bitmask: 1=primary, 2=shadow, 4=AO)\n"
+"  T: cycle octree traversal/layout (recursive, iterative, packet, compact, DAG, distance grid)\n"
+"  B: store the lowest compact octree levels as bricks\n"
+"  C: start primary rays from the previous frame's reprojected hits\n"
+"  G: start primary rays where the beam of their 8x8 block first meets the octree\n"
 "  L: move light (hold)\n"
+"  H: save the traversal cost heatmap to " HEATMAP_FILE " (stats=1 builds)\n"
+"  R: start/stop profiling render stages. Stopping writes " RENDER_TRACE_FILE " (Chrome trace)\n"
 "  ESC: quit\n";
 
 int main( int argc, char **argv )
@@ -620,8 +754,15 @@ int main( int argc, char **argv )
 			sscanf( a, "-res=%dx%d", &resx, &resy );
 		else if ( strncmp(a, "-t=", 3) == 0 )
 			sscanf( a, "-t=%d", &n_threads );
+		else if ( strncmp(a, "-budget=", 8) == 0 ) {
+			int ms = DEFAULT_FRAME_BUDGET;
+			sscanf( a, "-budget=%d", &ms );
+			frame_budget = ms > 0 ? (uint64) ms * 1000 : frame_budget;
+		}
 		else if ( strcmp(a, "-bench") == 0 )
 			benchmark_mode = 1;
+		else if ( strcmp(a, "-v") == 0 )
+			oc_verbose = 1;
 		else if ( strncmp(*arg, "-d=", 3) == 0 )
 			sscanf( *arg, "-d=%d", &max_octree_depth );
 		else if ( !strcmp(a, "-h") || !strcmp(a, "--help") )
@@ -656,6 +797,14 @@ int main( int argc, char **argv )
 	reset_camera();
 	update_light_pos();
 	
+	if ( benchmark_mode ) {
+		/* Render threads haven't been started yet */
+		benchmark_ray_types( &the_camera, the_volume );
+		oc_free( the_volume );
+		SDL_Quit();
+		return 0;
+	}
+	
 	if ( n_threads > 0 ) {
 		start_render_threads( n_threads );
 	}
@@ -721,7 +870,7 @@ int main( int argc, char **argv )
 							}
 							fclose( file );
 							break;
-							
+						
 						case SDLK_F2:
 							/* Read octree from disk */
 							file = fopen( "oc_cache.dat", "r" );
@@ -736,6 +885,8 @@ int main( int argc, char **argv )
 										the_volume = oc_init( max_octree_depth );
 										setup_test_scene( the_volume );
 									}
+									else
+										oc_enable_normals( the_volume );
 									reset_camera();
 									fclose( file );
 								}
@@ -746,7 +897,7 @@ int main( int argc, char **argv )
 							}
 							oc_detail_level = 0;
 							break;
-							
+						
 						case SDLK_F3:
 							reset_camera();
 							break;
@@ -770,25 +921,37 @@ int main( int argc, char **argv )
 								static int mode = 0;
 								switch( ++mode )
 								{
+									#ifdef TRAVERSAL_STATS
+									case 3:
+										/* Heatmap of nodes entered per primary ray */
+										oc_show_travel_depth = 0;
+										show_normals = 0;
+										show_traversal_cost = 1;
+										break;
+									#endif
+									
 									case 2:
 										/* Show eye space normals */
 										oc_show_travel_depth = 0;
 										show_normals = 1;
+										show_traversal_cost = 0;
 										break;
 									
 									case 1:
 										/* Visualize octree depth */
 										oc_show_travel_depth = 1;
 										show_normals = 0;
+										show_traversal_cost = 0;
 										break;
 									
 									default:
-										/* Larger than 2; reset to 0 */
+										/* Past the last mode; reset to 0 */
 										mode = 0;
 									case 0:
 										/* Show shaded materials */
 										oc_show_travel_depth = 0;
 										show_normals = 0;
+										show_traversal_cost = 0;
 										break;
 								}
 							}
@@ -818,6 +981,10 @@ int main( int argc, char **argv )
 							enable_shadows = !enable_shadows;
 							break;
 						
+						case SDLK_F12:
+							toggle_camera_path_recording();
+							break;
+						
 						case SDLK_SPACE:
 							SDL_ShowCursor( hook_mouse );
 							hook_mouse = !hook_mouse;
@@ -833,8 +1000,8 @@ int main( int argc, char **argv )
 							enable_phong = !enable_phong;
 							break;
 						case SDLK_u:
-							upscale_shift = !upscale_shift;
-							resize_render_output( ( screen->w & ~0xF ) >> upscale_shift, screen->h >> upscale_shift );
+							res_mode = ( res_mode + 1 ) % NUM_RES_MODES;
+							apply_res_mode();
 							break;
 						case SDLK_y:
 							show_depth_buffer = !show_depth_buffer;
@@ -842,14 +1009,48 @@ int main( int argc, char **argv )
 						case SDLK_o:
 							enable_aoccl = ( enable_aoccl + 1 ) % 3;
 							break;
+						case SDLK_j:
+							enable_ao_cache = !enable_ao_cache;
+							break;
+						case SDLK_v:
+							enable_progressive = !enable_progressive;
+							break;
+						case SDLK_x:
+							enable_checkerboard = !enable_checkerboard;
+							break;
+						case SDLK_n:
+							enable_voxel_normals = !enable_voxel_normals;
+							break;
 						case SDLK_i:
-							enable_dac_method = !enable_dac_method;
+							enable_dac_method = ( enable_dac_method + 1 ) & DAC_ALL;
+							break;
+						case SDLK_t:
+							traversal_method = ( traversal_method + 1 ) % NUM_TRAVERSAL_METHODS;
+							break;
+						case SDLK_b:
+							oc_use_bricks = !oc_use_bricks;
 							break;
 						case SDLK_l:
 							moving_light = !moving_light;
 							break;
+						case SDLK_r:
+							toggle_profiler();
+							break;
+						case SDLK_c:
+							enable_reprojection = !enable_reprojection;
+							break;
+						case SDLK_g:
+							enable_beam_prepass = !enable_beam_prepass;
+							break;
+						case SDLK_h:
+							if ( write_heatmap_ppm( HEATMAP_FILE ) )
+								printf( "Wrote %s\n", HEATMAP_FILE );
+							else
+								printf( "Error: Failed to write %s (needs a stats=1 build)\n", HEATMAP_FILE );
+							break;
 						case SDLK_k:
 							rasterize_voxels = !rasterize_voxels;
+							invalidate_reprojection();
 							break;
 						
 						case SDLK_ESCAPE:
@@ -859,7 +1060,7 @@ int main( int argc, char **argv )
 							break;
 					}
 					break;
-					
+				
 				case SDL_MOUSEMOTION:
 					mouse_x = event.motion.x;
 					mouse_y = event.motion.y;
@@ -880,6 +1081,7 @@ int main( int argc, char **argv )
 		
 		prev_camera = the_camera;
 		process_input( timestep, screen->w >> 1, screen->h >> 1, &the_camera );
+		record_camera_path( &the_camera );
 		
 		if ( rasterize_voxels ) {
 			SDL_FillRect( screen, 0, 0 );
@@ -887,16 +1089,27 @@ int main( int argc, char **argv )
 			rasterize_octree( the_volume, &the_camera, screen );
 			SDL_UnlockSurface( screen );
 		} else {
+			if ( res_mode == RES_DYNAMIC )
+			{
+				int w = render_resx, h = render_resy;
+				
+				/* No reallocation. The previous frame keeps its pixels */
+				if ( dynres_update( &dynres, perf.frame_time, enable_aoccl, screen->w, screen->h, &w, &h ) ) {
+					set_render_resolution( w, h );
+					ao_sample_count = dynres.ao_samples;
+				}
+			}
+			
 			/* Start rendering the next frame */
 			begin_volume_rendering( &the_camera, the_volume );
 			
 			/* Put the previous frame on screen */
 			SDL_LockSurface( screen );
 			draw_ui_overlay( screen, &prev_camera );
-			if ( upscale_shift )
-				blit2x( screen->pixels, render_output_rgba, render_resx, render_resy, screen->pitch );
+			if ( shown_w == (size_t) screen->w && shown_h == (size_t) screen->h )
+				memcpy( screen->pixels, render_output_rgba, shown_w*shown_h*4 );
 			else
-				memcpy( screen->pixels, render_output_rgba, render_resx*render_resy*4 );
+				upscale_bilinear( screen->pixels, screen->w, screen->h, screen->pitch, render_output_rgba, shown_w, shown_h, shown_w );
 			SDL_UnlockSurface( screen );
 		}
 		
@@ -906,6 +1119,8 @@ int main( int argc, char **argv )
 		if ( !rasterize_voxels ) {
 			end_volume_rendering( &perf );
 			swap_render_buffers();
+			shown_w = render_resx;
+			shown_h = render_resy;
 		}
 	}
 	
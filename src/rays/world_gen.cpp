@@ -83,6 +83,7 @@ static void insert_subtree( Octree *tree, OctreeNode *dst, OctreeNode *subtree,
 	int hx, hy, hz;
 	
 	oc_expand_node( tree, dst );
+	tree->revision++;
 	
 	s = 1 << --level;
 	hx = x0 + s;